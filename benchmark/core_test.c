@@ -0,0 +1,321 @@
+/*
+ * core_test: behaviour checks of the rufs core, without FUSE or a mount
+ *
+ *   core_test [DIR]
+ *
+ * Links the file system in, like microbench, and checks on fresh images
+ * made in DIR (/dev/shm, else /tmp) what the mounted tests in
+ * test_cases.c can't get at: recovery after a crash and the edge cases
+ * of the block mapping and a full disk. Stops at the first failure.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <linux/falloc.h>
+
+#include "../block.h"
+#include "../journal.h"
+#include "../rufs_ops.h"
+
+#define BLOCKSIZE 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define DISK_SIZE (64 << 20)
+#define SMALL_DISK_SIZE (4 << 20)
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+static const char *dir;
+static char buf[64 * BLOCKSIZE];
+static char rbuf[64 * BLOCKSIZE];
+static char big[100 * BLOCKSIZE];
+
+static void fail(int test, const char *what) {
+	printf("TEST %d: %s failure \n", test, what);
+	exit(1);
+}
+
+/* Byte at offset off of a test file, never 0 so holes tell apart */
+static char pattern(off_t off) {
+	return (char)(1 + (off * 7 + off / BLOCKSIZE) % 251);
+}
+
+static void fill(char *b, off_t off, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		b[i] = pattern(off + i);
+}
+
+/* Does [off, off + len) of b hold the pattern, or zeros if zero is set? */
+static int check(const char *b, off_t off, size_t len, int zero) {
+	for (size_t i = 0; i < len; i++)
+		if (b[i] != (zero ? 0 : pattern(off + i)))
+			return -1;
+	return 0;
+}
+
+/* Mount a new image of size bytes; the old one, if any, is gone */
+static void fresh_image(const char *name, uint64_t size) {
+	snprintf(diskfile_path, PATH_MAX, "%s/rufs-core_test-%s.%d", dir, name, (int)getpid());
+	unlink(diskfile_path);
+	mkfs_disk_size = size;
+	mkfs_num_inodes = 1024;
+	rufs_mount();
+}
+
+static void drop_image() {
+	rufs_unmount();
+	unlink(diskfile_path);
+}
+
+int main(int argc, char **argv) {
+
+	int status;
+	uint64_t fh = 0;
+	struct stat st;
+
+	dir = (argc > 1) ? argv[1] : (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+
+	/* TEST 1: fsynced data survives a crash, through journal replay */
+	fresh_image("crash", DISK_SIZE);
+	rufs_unmount();
+	pid_t pid = fork();
+	if (pid == 0) {
+		/* Dies without unmounting: nothing is checkpointed or flushed */
+		rufs_mount();
+		fill(buf, 0, sizeof(buf));
+		if (rufs_mkdir_tx("/crash", DIRPERM) != 0 ||
+		    rufs_create_tx("/crash/synced", FILEPERM, &fh) != 0 ||
+		    rufs_write_tx("/crash/synced", buf, 10 * BLOCKSIZE + 100, 0, &fh) != 10 * BLOCKSIZE + 100 ||
+		    rufs_fsync("/crash/synced", 0, &fh) != 0 ||
+		    rufs_fsyncdir("/crash", 0, NULL) != 0)
+			_exit(1);
+		_exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fail(1, "Crash before replay");
+	rufs_mount();
+	if (rufs_getattr("/crash/synced", &st, NULL) != 0 || st.st_size != 10 * BLOCKSIZE + 100)
+		fail(1, "Journal replay");
+	if (rufs_read("/crash/synced", rbuf, sizeof(rbuf), 0, NULL) != 10 * BLOCKSIZE + 100 ||
+	    check(rbuf, 0, 10 * BLOCKSIZE + 100, 0) != 0)
+		fail(1, "Journal replay");
+	drop_image();
+	printf("TEST 1: Journal replay Success \n");
+
+	/* TEST 2: truncate shrinks and grows across extent boundaries */
+	fresh_image("trunc", DISK_SIZE);
+	uint64_t fh2 = 0;
+	if (rufs_create_tx("/a", FILEPERM, &fh) != 0 || rufs_create_tx("/b", FILEPERM, &fh2) != 0)
+		fail(2, "Truncate");
+	/* Interleave the two so each 4-block chunk of /a is an extent of its own */
+	fill(buf, 0, sizeof(buf));
+	for (int i = 0; i < 64; i += 4) {
+		if (rufs_write_tx("/a", buf + i * BLOCKSIZE, 4 * BLOCKSIZE, i * BLOCKSIZE, &fh) != 4 * BLOCKSIZE ||
+		    rufs_fsync("/a", 0, &fh) != 0 ||
+		    rufs_write_tx("/b", buf + i * BLOCKSIZE, 4 * BLOCKSIZE, i * BLOCKSIZE, &fh2) != 4 * BLOCKSIZE ||
+		    rufs_fsync("/b", 0, &fh2) != 0)
+			fail(2, "Truncate");
+	}
+
+	/* Into the middle of an extent and of a block. st_blocks counts the
+	 * extent tree block too, so look at what each cut frees. */
+	if (rufs_getattr("/a", &st, &fh) != 0)
+		fail(2, "Truncate");
+	blkcnt_t blocks = st.st_blocks;
+	off_t size = 30 * BLOCKSIZE + 100;
+	if (rufs_truncate_tx("/a", size, &fh) != 0 || rufs_getattr("/a", &st, &fh) != 0 ||
+	    st.st_size != size || blocks - st.st_blocks != 33 * (BLOCKSIZE / 512))
+		fail(2, "Truncate shrink");
+	if (rufs_read("/a", rbuf, sizeof(rbuf), 0, &fh) != size || check(rbuf, 0, size, 0) != 0)
+		fail(2, "Truncate shrink");
+
+	/* Growing again leaves a hole, and the cut tail of block 30 reads as zeros */
+	if (rufs_truncate_tx("/a", 64 * BLOCKSIZE, &fh) != 0 || rufs_getattr("/a", &st, &fh) != 0 ||
+	    st.st_size != 64 * BLOCKSIZE || blocks - st.st_blocks != 33 * (BLOCKSIZE / 512))
+		fail(2, "Truncate grow");
+	if (rufs_read("/a", rbuf, sizeof(rbuf), 0, &fh) != 64 * BLOCKSIZE ||
+	    check(rbuf, 0, size, 0) != 0 || check(rbuf + size, size, 64 * BLOCKSIZE - size, 1) != 0)
+		fail(2, "Truncate grow");
+
+	/* Exactly at an extent boundary, then to nothing */
+	if (rufs_truncate_tx("/a", 16 * BLOCKSIZE, &fh) != 0 || rufs_getattr("/a", &st, &fh) != 0 ||
+	    blocks - st.st_blocks != 48 * (BLOCKSIZE / 512))
+		fail(2, "Truncate to an extent boundary");
+	if (rufs_read("/a", rbuf, sizeof(rbuf), 0, &fh) != 16 * BLOCKSIZE || check(rbuf, 0, 16 * BLOCKSIZE, 0) != 0)
+		fail(2, "Truncate to an extent boundary");
+	if (rufs_truncate_tx("/a", 0, &fh) != 0 || rufs_getattr("/a", &st, &fh) != 0 ||
+	    st.st_size != 0 || st.st_blocks != 0)
+		fail(2, "Truncate to zero");
+
+	/* The blocks freed go to the next writer, never out from under /b */
+	if (rufs_write_tx("/a", buf, sizeof(buf), 0, &fh) != sizeof(buf) || rufs_fsync("/a", 0, &fh) != 0)
+		fail(2, "Truncate");
+	if (rufs_read("/b", rbuf, sizeof(rbuf), 0, &fh2) != sizeof(rbuf) || check(rbuf, 0, sizeof(rbuf), 0) != 0)
+		fail(2, "Truncate");
+	rufs_release("/a", &fh);
+	rufs_release("/b", &fh2);
+	drop_image();
+	printf("TEST 2: Truncate Success \n");
+
+	/* TEST 3: a punched hole reads back as zeros, flushed or buffered */
+	fresh_image("punch", DISK_SIZE);
+	if (rufs_create_tx("/p", FILEPERM, &fh) != 0 ||
+	    rufs_write_tx("/p", buf, 10 * BLOCKSIZE, 0, &fh) != 10 * BLOCKSIZE || rufs_fsync("/p", 0, &fh) != 0 ||
+	    rufs_getattr("/p", &st, &fh) != 0)
+		fail(3, "Punch hole");
+	blocks = st.st_blocks;
+	/* Blocks 2 and 3 go, the ends of 1 and 4 are cleared */
+	off_t hole = BLOCKSIZE + 1000, hole_len = 3 * BLOCKSIZE;
+	if (rufs_fallocate_tx("/p", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, hole_len, &fh) != 0 ||
+	    rufs_getattr("/p", &st, &fh) != 0 ||
+	    st.st_size != 10 * BLOCKSIZE || blocks - st.st_blocks != 2 * (BLOCKSIZE / 512))
+		fail(3, "Punch hole");
+	/* Blocks 12 and 13, still buffered */
+	if (rufs_write_tx("/p", buf + 10 * BLOCKSIZE, 6 * BLOCKSIZE, 10 * BLOCKSIZE, &fh) != 6 * BLOCKSIZE ||
+	    rufs_fallocate_tx("/p", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 12 * BLOCKSIZE, 2 * BLOCKSIZE, &fh) != 0)
+		fail(3, "Punch hole");
+	size = 16 * BLOCKSIZE;
+	if (rufs_read("/p", rbuf, sizeof(rbuf), 0, &fh) != size ||
+	    check(rbuf, 0, hole, 0) != 0 || check(rbuf + hole, hole, hole_len, 1) != 0 ||
+	    check(rbuf + hole + hole_len, hole + hole_len, 12 * BLOCKSIZE - hole - hole_len, 0) != 0 ||
+	    check(rbuf + 12 * BLOCKSIZE, 12 * BLOCKSIZE, 2 * BLOCKSIZE, 1) != 0 ||
+	    check(rbuf + 14 * BLOCKSIZE, 14 * BLOCKSIZE, 2 * BLOCKSIZE, 0) != 0)
+		fail(3, "Punch hole");
+	printf("TEST 3: Punch hole Success \n");
+
+	/* TEST 4: SEEK_DATA and SEEK_HOLE: data 0-1, 4-11 and 14-15, holes 2-3 and 12-13 */
+	struct { off_t offset; int whence; off_t expect; } seeks[] = {
+		{ 0, SEEK_DATA, 0 },
+		{ 0, SEEK_HOLE, 2 * BLOCKSIZE },
+		{ BLOCKSIZE + 2000, SEEK_HOLE, 2 * BLOCKSIZE },
+		{ 2 * BLOCKSIZE + 5, SEEK_DATA, 4 * BLOCKSIZE },
+		{ 3 * BLOCKSIZE, SEEK_HOLE, 3 * BLOCKSIZE },
+		{ 4 * BLOCKSIZE, SEEK_HOLE, 12 * BLOCKSIZE },
+		{ 12 * BLOCKSIZE, SEEK_DATA, 14 * BLOCKSIZE },
+		{ 14 * BLOCKSIZE, SEEK_HOLE, 16 * BLOCKSIZE },
+		{ 16 * BLOCKSIZE, SEEK_DATA, -ENXIO },
+		{ 16 * BLOCKSIZE, SEEK_HOLE, -ENXIO },
+	};
+	for (int i = 0; i < (int)(sizeof(seeks) / sizeof(seeks[0])); i++)
+		if (rufs_lseek("/p", seeks[i].offset, seeks[i].whence, &fh) != seeks[i].expect)
+			fail(4, "Seek data/hole");
+	/* Preallocated blocks never written are a hole too */
+	if (rufs_fallocate_tx("/p", 0, 16 * BLOCKSIZE, 4 * BLOCKSIZE, &fh) != 0 ||
+	    rufs_lseek("/p", 16 * BLOCKSIZE, SEEK_HOLE, &fh) != 16 * BLOCKSIZE ||
+	    rufs_lseek("/p", 16 * BLOCKSIZE, SEEK_DATA, &fh) != -ENXIO)
+		fail(4, "Seek data/hole");
+	if (rufs_write_tx("/p", buf, BLOCKSIZE, 18 * BLOCKSIZE, &fh) != BLOCKSIZE ||
+	    rufs_lseek("/p", 16 * BLOCKSIZE, SEEK_DATA, &fh) != 18 * BLOCKSIZE ||
+	    rufs_lseek("/p", 18 * BLOCKSIZE, SEEK_HOLE, &fh) != 19 * BLOCKSIZE)
+		fail(4, "Seek data/hole");
+	rufs_release("/p", &fh);
+	drop_image();
+	printf("TEST 4: Seek data/hole Success \n");
+
+	/* TEST 5: a full disk fails with ENOSPC, and undoes what it can't finish */
+	fresh_image("enospc", SMALL_DISK_SIZE);
+	int ret = 0;
+	off_t off = 0;
+	if (rufs_create_tx("/full", FILEPERM, &fh) != 0 || rufs_create_tx("/empty", FILEPERM, &fh2) != 0)
+		fail(5, "ENOSPC");
+	while (off < SMALL_DISK_SIZE && (ret = rufs_write_tx("/full", buf, sizeof(buf), off, &fh)) > 0)
+		off += ret;
+	if (ret != -ENOSPC || rufs_fsync("/full", 0, &fh) != 0)
+		fail(5, "ENOSPC on write");
+	if (rufs_fallocate_tx("/empty", 0, 0, SMALL_DISK_SIZE, &fh2) != -ENOSPC ||
+	    rufs_getattr("/empty", &st, &fh2) != 0 || st.st_size != 0 || st.st_blocks != 0)
+		fail(5, "ENOSPC on fallocate");
+	/* Sooner or later the directory needs a block it can't have */
+	char path[32];
+	for (int i = 0; i < 1000; i++) {
+		snprintf(path, sizeof(path), "/file%d", i);
+		uint64_t fh3 = 0;
+		if ((ret = rufs_create_tx(path, FILEPERM, &fh3)) != 0)
+			break;
+		rufs_release(path, &fh3);
+	}
+	if (ret != -ENOSPC || rufs_getattr(path, &st, NULL) != -ENOENT)
+		fail(5, "ENOSPC on create");
+	if (rufs_mkdir_tx("/dir", DIRPERM) != -ENOSPC || rufs_getattr("/dir", &st, NULL) != -ENOENT)
+		fail(5, "ENOSPC on mkdir");
+	/* The space comes back */
+	rufs_release("/full", &fh);
+	if (rufs_unlink_tx("/full") != 0 ||
+	    rufs_write_tx("/empty", buf, sizeof(buf), 0, &fh2) != sizeof(buf) || rufs_fsync("/empty", 0, &fh2) != 0 ||
+	    rufs_mkdir_tx("/dir", DIRPERM) != 0)
+		fail(5, "ENOSPC");
+	rufs_release("/empty", &fh2);
+	drop_image();
+	printf("TEST 5: ENOSPC Success \n");
+
+	/* TEST 6: buffered writes keep their blocks while the disk fills up around them */
+	fresh_image("reserve", SMALL_DISK_SIZE);
+	if (rufs_create_tx("/buffered", FILEPERM, &fh) != 0 || rufs_create_tx("/full", FILEPERM, &fh2) != 0)
+		fail(6, "Reservation");
+	/* Every other block, so writeback adds more extents than the inode holds */
+	for (int i = 0; i < 32; i += 2)
+		if (rufs_write_tx("/buffered", buf + i * BLOCKSIZE, BLOCKSIZE, i * BLOCKSIZE, &fh) != BLOCKSIZE)
+			fail(6, "Reservation");
+	/* Writes too large to buffer, preallocation and new directories take the rest */
+	off = 0;
+	while (off < SMALL_DISK_SIZE && (ret = rufs_write_tx("/full", buf, sizeof(buf), off, &fh2)) > 0)
+		off += ret;
+	while ((ret = rufs_write_tx("/full", buf, 8 * BLOCKSIZE, off, &fh2)) > 0)
+		off += ret;
+	if (ret != -ENOSPC || rufs_fallocate_tx("/full", 0, off, BLOCKSIZE, &fh2) != -ENOSPC)
+		fail(6, "Reservation");
+	for (int i = 0; i < 1000 && rufs_mkdir_tx(path, DIRPERM) == 0; i++)
+		snprintf(path, sizeof(path), "/dir%d", i);
+	rufs_release("/full", &fh2);
+	/* No room for a new block, but for the reserved ones */
+	if (rufs_write_tx("/buffered", buf, BLOCKSIZE, 64 * BLOCKSIZE, &fh) != -ENOSPC ||
+	    rufs_fsync("/buffered", 0, &fh) != 0 || rufs_release("/buffered", &fh) != 0)
+		fail(6, "Reservation");
+	rufs_unmount();
+	rufs_mount();
+	if (rufs_read("/buffered", rbuf, sizeof(rbuf), 0, NULL) != 31 * BLOCKSIZE)
+		fail(6, "Reservation");
+	for (int i = 0; i < 31; i++)
+		if (check(rbuf + i * BLOCKSIZE, i * BLOCKSIZE, BLOCKSIZE, i % 2) != 0)
+			fail(6, "Reservation");
+	drop_image();
+	printf("TEST 6: Reservation Success \n");
+
+	/* TEST 7: a large unaligned write reads back through readahead */
+	fresh_image("readahead", DISK_SIZE);
+	/* Each piece leaves its partial last block dirty in the cache */
+	size = 0;
+	if (rufs_create_tx("/unaligned", FILEPERM, &fh) != 0)
+		fail(7, "Readahead");
+	for (int i = 0; i < 16; i++) {
+		size_t len = sizeof(big) - 3000 + i;
+		fill(big, size, len);
+		if (rufs_write_tx("/unaligned", big, len, size, &fh) != (int)len)
+			fail(7, "Readahead");
+		size += len;
+	}
+	rufs_release("/unaligned", &fh);
+	if (rufs_open("/unaligned", &fh) != 0)
+		fail(7, "Readahead");
+	for (off = 0; off < size; off += 16 * BLOCKSIZE) {
+		int len = (size - off < 16 * BLOCKSIZE) ? size - off : 16 * BLOCKSIZE;
+		if (rufs_read("/unaligned", rbuf, 16 * BLOCKSIZE, off, &fh) != len || check(rbuf, off, len, 0) != 0)
+			fail(7, "Readahead");
+	}
+	rufs_release("/unaligned", &fh);
+	drop_image();
+	printf("TEST 7: Readahead Success \n");
+
+	printf("Benchmark completed \n");
+	return 0;
+}
@@ -0,0 +1,735 @@
+/*
+ * fsbench: throughput and latency of a mounted file system
+ *
+ *   fsbench [options] MOUNTPOINT
+ *
+ *   -t N        client threads (1)
+ *   -s LIST     I/O sizes of the data workloads, e.g. 4k,64k,1m (4k,64k,1m)
+ *   -S SIZE     file size per thread for the data workloads (64m)
+ *   -n N        files per thread for the create/stat/unlink storms (10000)
+ *   -D N        directory depth of the deep tree storms (16)
+ *   -u N        entries per thread extracted by the untar workload (5000)
+ *   -w LIST     workloads to run: seq,rand,flat,deep,untar (all)
+ *   -r SEED     seed for random offsets and file sizes (1)
+ *   -o FORMAT   text, json (one object per line) or csv (text)
+ *   -k          keep the files the run made
+ *
+ * Every workload runs as one or more phases. Each thread does its setup,
+ * then all threads start together and every operation is timed; a phase
+ * reports ops/s, MB/s and the p50/p99/p999/max latency over all threads.
+ * Data written is fsync'ed and dropped from the page cache before it is
+ * read back, so reads reach the file system. The same seed, options and
+ * thread count replay the same operations.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define FSPATHLEN 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+#define W_SEQ	0x01
+#define W_RAND	0x02
+#define W_FLAT	0x04
+#define W_DEEP	0x08
+#define W_UNTAR	0x10
+#define W_ALL	0x1f
+
+#define MAX_SIZES 16
+#define UNTAR_FANOUT 8		/* entries per directory of the extracted tree */
+
+enum { OUT_TEXT, OUT_JSON, OUT_CSV };
+
+struct Config {
+	const char *mount;
+	char base[FSPATHLEN / 2];		/* MOUNTPOINT/fsbench.<pid> */
+	int threads;
+	size_t sizes[MAX_SIZES];
+	int nsizes;
+	size_t file_size;
+	int nfiles;
+	int depth;
+	int untar_entries;
+	int workloads;
+	uint64_t seed;
+	int format;
+	int keep;
+} cfg = {
+	.threads = 1,
+	.sizes = { 4096, 65536, 1048576 },
+	.nsizes = 3,
+	.file_size = 64 << 20,
+	.nfiles = 10000,
+	.depth = 16,
+	.untar_entries = 5000,
+	.workloads = W_ALL,
+	.seed = 1,
+	.format = OUT_TEXT,
+};
+
+typedef struct Worker Worker;
+typedef void (*phase_fn)(Worker *w);
+
+struct Worker {
+	int id;
+	pthread_t thread;
+	phase_fn fn;
+	size_t io_size;
+	uint64_t rng;
+	char *buf;
+	int started;
+	uint64_t start;			/* when the phase started and ended for this thread */
+	uint64_t end;
+
+	uint64_t *lat;			/* latency of each operation, ns */
+	size_t nlat;
+	size_t maxlat;
+	uint64_t bytes;
+	int errors;
+};
+
+static Worker *workers;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one stream per thread so runs replay */
+static uint64_t next_rand(Worker *w) {
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 2685821657736338717ULL;
+}
+
+static void record(Worker *w, uint64_t start) {
+	uint64_t ns = now_ns() - start;
+	if (w->nlat == w->maxlat) {
+		size_t max = w->maxlat ? w->maxlat * 2 : 4096;
+		uint64_t *lat = realloc(w->lat, max * sizeof(uint64_t));
+		if (lat == NULL) {
+			w->errors++;
+			return;
+		}
+		w->lat = lat;
+		w->maxlat = max;
+	}
+	w->lat[w->nlat++] = ns;
+}
+
+static void fail(Worker *w, const char *what, const char *path) {
+	if (w->errors++ == 0)
+		fprintf(stderr, "thread %d: %s %s: %s\n", w->id, what, path, strerror(errno));
+}
+
+/* Setup done, wait for the other threads; the clock starts when all are here */
+static void phase_start(Worker *w) {
+	if (!w->started) {
+		w->started = 1;
+		pthread_barrier_wait(&start_barrier);
+		w->start = now_ns();
+	}
+}
+
+static void *worker_main(void *arg) {
+	Worker *w = arg;
+	w->fn(w);
+	phase_start(w);		/* a thread whose setup failed still releases the others */
+	w->end = now_ns();
+	return NULL;
+}
+
+static void thread_dir(Worker *w, char *path) {
+	snprintf(path, FSPATHLEN, "%s/t%d", cfg.base, w->id);
+}
+
+/*
+ * Data workloads, on one file per thread
+ */
+static void data_path(Worker *w, char *path) {
+	snprintf(path, FSPATHLEN, "%s/t%d/data", cfg.base, w->id);
+}
+
+// Drop the file's pages from the kernel cache, so reads reach the file system
+static int drop_cache(int fd) {
+	if (fsync(fd) != 0)
+		return -1;
+	return posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void seq_write(Worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, FILEPERM);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+
+	phase_start(w);
+	for (size_t off = 0; off + w->io_size <= cfg.file_size; off += w->io_size) {
+		uint64_t t = now_ns();
+		if (write(fd, w->buf, w->io_size) != (ssize_t)w->io_size) {
+			fail(w, "write", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	if (fsync(fd) != 0)
+		fail(w, "fsync", path);
+	close(fd);
+}
+
+static void seq_read(Worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || drop_cache(fd) != 0) {
+		fail(w, "open", path);
+		return;
+	}
+
+	phase_start(w);
+	for (size_t off = 0; off + w->io_size <= cfg.file_size; off += w->io_size) {
+		uint64_t t = now_ns();
+		if (read(fd, w->buf, w->io_size) != (ssize_t)w->io_size) {
+			fail(w, "read", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	close(fd);
+}
+
+// As many I/Os as the sequential pass, at random aligned offsets
+static void rand_io(Worker *w, int writing) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, writing ? O_WRONLY : O_RDONLY);
+	if (fd < 0 || drop_cache(fd) != 0) {
+		fail(w, "open", path);
+		return;
+	}
+
+	size_t slots = cfg.file_size / w->io_size;
+	phase_start(w);
+	for (size_t i = 0; i < slots; i++) {
+		off_t off = (off_t)(next_rand(w) % slots) * w->io_size;
+		uint64_t t = now_ns();
+		ssize_t n = writing ? pwrite(fd, w->buf, w->io_size, off) : pread(fd, w->buf, w->io_size, off);
+		if (n != (ssize_t)w->io_size) {
+			fail(w, writing ? "pwrite" : "pread", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	if (writing && fsync(fd) != 0)
+		fail(w, "fsync", path);
+	close(fd);
+}
+
+static void rand_write(Worker *w) {
+	rand_io(w, 1);
+}
+
+static void rand_read(Worker *w) {
+	rand_io(w, 0);
+}
+
+/*
+ * Metadata storms: the flat ones share one directory among all threads,
+ * the deep ones run at the bottom of a chain of cfg.depth directories
+ */
+static int deep_storm = 0;
+
+static void storm_dir(Worker *w, char *path) {
+	if (!deep_storm) {
+		snprintf(path, FSPATHLEN, "%s/flat", cfg.base);
+		return;
+	}
+	int len = snprintf(path, FSPATHLEN, "%s/t%d", cfg.base, w->id);
+	for (int d = 0; d < cfg.depth && len < FSPATHLEN; d++)
+		len += snprintf(path + len, FSPATHLEN - len, "/d%d", d);
+}
+
+static void storm_create(Worker *w) {
+	char dir[FSPATHLEN], path[FSPATHLEN + 32];
+	storm_dir(w, dir);
+
+	// the chain is built here, outside the clock
+	if (deep_storm) {
+		char *p = dir + strlen(cfg.base) + 1;
+		while ((p = strchr(p, '/')) != NULL) {
+			*p = '\0';
+			if (mkdir(dir, DIRPERM) != 0 && errno != EEXIST) {
+				fail(w, "mkdir", dir);
+				return;
+			}
+			*p++ = '/';
+		}
+		if (mkdir(dir, DIRPERM) != 0 && errno != EEXIST) {
+			fail(w, "mkdir", dir);
+			return;
+		}
+	}
+
+	phase_start(w);
+	for (int i = 0; i < cfg.nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/t%d_f%d", dir, w->id, i);
+		uint64_t t = now_ns();
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, FILEPERM);
+		if (fd < 0) {
+			fail(w, "create", path);
+			break;
+		}
+		close(fd);
+		record(w, t);
+	}
+}
+
+static void storm_stat(Worker *w) {
+	char dir[FSPATHLEN], path[FSPATHLEN + 32];
+	struct stat st;
+	storm_dir(w, dir);
+
+	phase_start(w);
+	for (int i = 0; i < cfg.nfiles; i++) {
+		int n = next_rand(w) % cfg.nfiles;
+		snprintf(path, sizeof(path), "%s/t%d_f%d", dir, w->id, n);
+		uint64_t t = now_ns();
+		if (stat(path, &st) != 0) {
+			fail(w, "stat", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+static void storm_unlink(Worker *w) {
+	char dir[FSPATHLEN], path[FSPATHLEN + 32];
+	storm_dir(w, dir);
+
+	phase_start(w);
+	for (int i = 0; i < cfg.nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/t%d_f%d", dir, w->id, i);
+		uint64_t t = now_ns();
+		if (unlink(path) != 0) {
+			fail(w, "unlink", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+/*
+ * untar: extract a made-up source tree, directories UNTAR_FANOUT wide
+ * holding small files (mostly a few KB, a few up to 256KB), each entry one
+ * operation: mkdir, or create, write and close. Then remove it as rm -r
+ * would, deepest entries first.
+ */
+
+// Path of entry i: its parent is entry (i - 1) / UNTAR_FANOUT, entry 0 the root
+static void untar_path(Worker *w, int i, char *path) {
+	int chain[64], n = 0;
+	for (int e = i; e > 0 && n < 64; e = (e - 1) / UNTAR_FANOUT)
+		chain[n++] = e;
+
+	int len = snprintf(path, FSPATHLEN, "%s/t%d/src", cfg.base, w->id);
+	while (n > 0 && len < FSPATHLEN)
+		len += snprintf(path + len, FSPATHLEN - len, "/e%d", chain[--n]);
+}
+
+// An entry with children is a directory
+static int untar_is_dir(int i) {
+	return i == 0 || (uint64_t)i * UNTAR_FANOUT + 1 < (uint64_t)cfg.untar_entries;
+}
+
+static size_t untar_size(Worker *w) {
+	uint64_t r = next_rand(w);
+	int shift = 9 + (r & 7);					/* 512B .. 64KB, log-uniform */
+	if ((r >> 8) % 16 == 0)
+		shift += 2;							/* one in 16 up to 256KB */
+	return ((size_t)1 << shift) + (r >> 16) % ((size_t)1 << shift);
+}
+
+static void untar_extract(Worker *w) {
+	char path[FSPATHLEN];
+	phase_start(w);
+	for (int i = 0; i < cfg.untar_entries; i++) {
+		untar_path(w, i, path);
+		uint64_t t = now_ns();
+		if (untar_is_dir(i)) {
+			if (mkdir(path, DIRPERM) != 0) {
+				fail(w, "mkdir", path);
+				break;
+			}
+		} else {
+			size_t size = untar_size(w);
+			int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, FILEPERM);
+			if (fd < 0 || write(fd, w->buf, size) != (ssize_t)size) {
+				fail(w, "extract", path);
+				if (fd >= 0)
+					close(fd);
+				break;
+			}
+			close(fd);
+			w->bytes += size;
+		}
+		record(w, t);
+	}
+}
+
+static void untar_remove(Worker *w) {
+	char path[FSPATHLEN];
+	phase_start(w);
+	for (int i = cfg.untar_entries - 1; i >= 0; i--) {
+		untar_path(w, i, path);
+		uint64_t t = now_ns();
+		if ((untar_is_dir(i) ? rmdir(path) : unlink(path)) != 0) {
+			fail(w, "remove", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+/*
+ * Setup and cleanup, outside any phase
+ */
+static void make_thread_dir(Worker *w) {
+	char path[FSPATHLEN];
+	thread_dir(w, path);
+	if (mkdir(path, DIRPERM) != 0 && errno != EEXIST)
+		fail(w, "mkdir", path);
+}
+
+static void remove_data(Worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	if (unlink(path) != 0 && errno != ENOENT)
+		fail(w, "unlink", path);
+}
+
+static void remove_deep(Worker *w) {
+	char path[FSPATHLEN];
+	deep_storm = 1;
+	storm_dir(w, path);
+	for (int d = 0; d < cfg.depth; d++) {
+		if (rmdir(path) != 0 && errno != ENOENT) {
+			fail(w, "rmdir", path);
+			return;
+		}
+		*strrchr(path, '/') = '\0';
+	}
+}
+
+static void remove_thread_dir(Worker *w) {
+	char path[FSPATHLEN];
+	thread_dir(w, path);
+	if (rmdir(path) != 0 && errno != ENOENT)
+		fail(w, "rmdir", path);
+}
+
+/*
+ * Reporting
+ */
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *lat, size_t n, double q) {
+	if (n == 0)
+		return 0;
+	size_t rank = (size_t)(q * n + 0.999999);	/* nearest rank */
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return lat[rank - 1] / 1000.0;
+}
+
+static void report(const char *name, size_t io_size, double secs) {
+	static int header_done = 0;
+	size_t n = 0;
+	uint64_t bytes = 0;
+	int errors = 0;
+	for (int i = 0; i < cfg.threads; i++) {
+		n += workers[i].nlat;
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+	}
+
+	// Step 1: Merge the latencies of all threads
+	uint64_t *lat = malloc((n ? n : 1) * sizeof(uint64_t));
+	if (lat == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	size_t k = 0;
+	for (int i = 0; i < cfg.threads; i++) {
+		if (workers[i].nlat > 0)
+			memcpy(lat + k, workers[i].lat, workers[i].nlat * sizeof(uint64_t));
+		k += workers[i].nlat;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	double ops = secs > 0 ? n / secs : 0;
+	double mbs = secs > 0 ? bytes / secs / (1 << 20) : 0;
+	double p50 = percentile_us(lat, n, 0.50);
+	double p99 = percentile_us(lat, n, 0.99);
+	double p999 = percentile_us(lat, n, 0.999);
+	double max = n ? lat[n - 1] / 1000.0 : 0;
+	free(lat);
+
+	// Step 2: Print a row
+	switch (cfg.format) {
+	case OUT_JSON:
+		printf("{\"workload\":\"%s\",\"io_size\":%zu,\"threads\":%d,\"ops\":%zu,\"bytes\":%lu,"
+			"\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+			"\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f,\"errors\":%d}\n",
+			name, io_size, cfg.threads, n, bytes, secs, ops, mbs, p50, p99, p999, max, errors);
+		break;
+	case OUT_CSV:
+		if (!header_done++)
+			printf("workload,io_size,threads,ops,bytes,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us,max_us,errors\n");
+		printf("%s,%zu,%d,%zu,%lu,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%d\n",
+			name, io_size, cfg.threads, n, bytes, secs, ops, mbs, p50, p99, p999, max, errors);
+		break;
+	default:
+		if (!header_done++)
+			printf("%-14s %8s %4s %9s %11s %9s %10s %10s %10s %10s %6s\n", "workload", "io_size", "thr",
+				"ops", "ops/s", "MB/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "errors");
+		printf("%-14s %8zu %4d %9zu %11.1f %9.2f %10.2f %10.2f %10.2f %10.2f %6d\n",
+			name, io_size, cfg.threads, n, ops, mbs, p50, p99, p999, max, errors);
+		break;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Run fn on every thread at once. A named phase is timed and reported;
+ * an unnamed one is setup or cleanup.
+ */
+static int run_phase(const char *name, phase_fn fn, size_t io_size) {
+	pthread_barrier_init(&start_barrier, NULL, cfg.threads);
+	for (int i = 0; i < cfg.threads; i++) {
+		Worker *w = &workers[i];
+		w->fn = fn;
+		w->io_size = io_size;
+		w->started = 0;
+		w->nlat = 0;
+		w->bytes = 0;
+		w->errors = 0;
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	// the phase lasts from the first thread starting to the last one done
+	uint64_t start = UINT64_MAX, end = 0;
+	int errors = 0;
+	for (int i = 0; i < cfg.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		errors += workers[i].errors;
+		if (workers[i].start < start)
+			start = workers[i].start;
+		if (workers[i].end > end)
+			end = workers[i].end;
+	}
+	double secs = (end - start) / 1e9;
+	pthread_barrier_destroy(&start_barrier);
+
+	if (name != NULL)
+		report(name, io_size, secs);
+	return errors;
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	double v = strtod(s, &end);
+	switch (*end) {
+	case 'k': case 'K': v *= 1024; break;
+	case 'm': case 'M': v *= 1024 * 1024; break;
+	case 'g': case 'G': v *= 1024 * 1024 * 1024; break;
+	}
+	return (size_t)v;
+}
+
+static int parse_workloads(char *list) {
+	static const char *names[] = { "seq", "rand", "flat", "deep", "untar" };
+	int mask = 0;
+	for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int found = 0;
+		for (int i = 0; i < 5; i++) {
+			if (strcmp(tok, names[i]) == 0) {
+				mask |= 1 << i;
+				found = 1;
+			}
+		}
+		if (strcmp(tok, "all") == 0)
+			mask = W_ALL;
+		else if (!found) {
+			fprintf(stderr, "unknown workload: %s\n", tok);
+			exit(1);
+		}
+	}
+	return mask;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-t threads] [-s sizes] [-S file size] [-n files] [-D depth] "
+		"[-u untar entries] [-w seq,rand,flat,deep,untar] [-r seed] [-o text|json|csv] [-k] MOUNTPOINT\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "t:s:S:n:D:u:w:r:o:k")) != -1) {
+		switch (opt) {
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'S': cfg.file_size = parse_size(optarg); break;
+		case 'n': cfg.nfiles = atoi(optarg); break;
+		case 'D': cfg.depth = atoi(optarg); break;
+		case 'u': cfg.untar_entries = atoi(optarg); break;
+		case 'w': cfg.workloads = parse_workloads(optarg); break;
+		case 'r': cfg.seed = strtoull(optarg, NULL, 0); break;
+		case 'k': cfg.keep = 1; break;
+		case 's':
+			cfg.nsizes = 0;
+			for (char *tok = strtok(optarg, ","); tok != NULL && cfg.nsizes < MAX_SIZES; tok = strtok(NULL, ","))
+				cfg.sizes[cfg.nsizes++] = parse_size(tok);
+			break;
+		case 'o':
+			if (strcmp(optarg, "json") == 0)
+				cfg.format = OUT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				cfg.format = OUT_CSV;
+			else if (strcmp(optarg, "text") == 0)
+				cfg.format = OUT_TEXT;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || cfg.threads < 1 || cfg.nfiles < 1 || cfg.depth < 1 || cfg.depth > 60 || cfg.untar_entries < 1)
+		usage(argv[0]);
+	for (int i = 0; i < cfg.nsizes; i++) {
+		if (cfg.sizes[i] == 0 || cfg.sizes[i] > cfg.file_size) {
+			fprintf(stderr, "I/O sizes must be between 1 byte and the file size\n");
+			exit(1);
+		}
+	}
+
+	// Step 1: A fresh directory for this run, one below it per thread
+	cfg.mount = argv[optind];
+	if (snprintf(cfg.base, sizeof(cfg.base), "%s/fsbench.%d", cfg.mount, (int)getpid()) >= (int)sizeof(cfg.base)) {
+		fprintf(stderr, "mount point path too long\n");
+		exit(1);
+	}
+	if (mkdir(cfg.base, DIRPERM) != 0) {
+		perror(cfg.base);
+		exit(1);
+	}
+
+	size_t max_io = 256 << 10;		/* largest untar file */
+	for (int i = 0; i < cfg.nsizes; i++)
+		if (cfg.sizes[i] > max_io)
+			max_io = cfg.sizes[i];
+
+	workers = calloc(cfg.threads, sizeof(Worker));
+	if (workers == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (int i = 0; i < cfg.threads; i++) {
+		workers[i].id = i;
+		workers[i].rng = (cfg.seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+		if ((workers[i].buf = malloc(max_io)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		for (size_t j = 0; j < max_io; j++)
+			workers[i].buf[j] = (char)next_rand(&workers[i]);
+	}
+	run_phase(NULL, make_thread_dir, 0);
+
+	// Step 2: Data workloads, each I/O size on a file written afresh
+	if (cfg.workloads & (W_SEQ | W_RAND)) {
+		for (int i = 0; i < cfg.nsizes; i++) {
+			size_t size = cfg.sizes[i];
+			if (run_phase("seqwrite", seq_write, size) != 0)
+				break;
+			if (cfg.workloads & W_SEQ)
+				run_phase("seqread", seq_read, size);
+			if (cfg.workloads & W_RAND) {
+				run_phase("randwrite", rand_write, size);
+				run_phase("randread", rand_read, size);
+			}
+			if (!cfg.keep)
+				run_phase(NULL, remove_data, 0);
+		}
+	}
+
+	// Step 3: Metadata storms, in one directory shared by every thread
+	// and at the bottom of deep trees
+	if (cfg.workloads & W_FLAT) {
+		char flat[FSPATHLEN + 8];
+		snprintf(flat, sizeof(flat), "%s/flat", cfg.base);
+		if (mkdir(flat, DIRPERM) != 0) {
+			perror(flat);
+			exit(1);
+		}
+		deep_storm = 0;
+		if (run_phase("flat-create", storm_create, 0) == 0) {
+			run_phase("flat-stat", storm_stat, 0);
+			if (!cfg.keep && run_phase("flat-unlink", storm_unlink, 0) == 0)
+				rmdir(flat);
+		}
+	}
+	if (cfg.workloads & W_DEEP) {
+		deep_storm = 1;
+		if (run_phase("deep-create", storm_create, 0) == 0) {
+			run_phase("deep-stat", storm_stat, 0);
+			if (!cfg.keep && run_phase("deep-unlink", storm_unlink, 0) == 0)
+				run_phase(NULL, remove_deep, 0);
+		}
+	}
+
+	// Step 4: Small files, as a tarball extracts
+	if (cfg.workloads & W_UNTAR) {
+		if (run_phase("untar", untar_extract, 0) == 0 && !cfg.keep)
+			run_phase("untar-rm", untar_remove, 0);
+	}
+
+	if (!cfg.keep) {
+		run_phase(NULL, remove_thread_dir, 0);
+		rmdir(cfg.base);
+	}
+
+	for (int i = 0; i < cfg.threads; i++) {
+		free(workers[i].lat);
+		free(workers[i].buf);
+	}
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,433 @@
+/*
+ * microbench: the rufs core, timed without FUSE or a mount
+ *
+ *   microbench [options]
+ *
+ *   -n N        operations per benchmark (10000)
+ *   -S SIZE     file size of the read/write benchmarks (16m)
+ *   -s SIZE     size of the disk image (512m)
+ *   -w LIST     benchmarks to run: alloc,path,dir,rw (all)
+ *   -b BACKEND  pread, mmap or uring (pread)
+ *   -d DIR      where the disk image goes (/dev/shm, else /tmp)
+ *   -o FORMAT   text, json (one object per line) or csv (text)
+ *
+ * The file system is linked in (rufs.c and its modules) and its
+ * operations are called directly, the way the FUSE front end would, on a
+ * fresh image made in DIR; tmpfs keeps the device out of the numbers.
+ * Needs neither root, /dev/fuse nor libfuse. Each benchmark reports
+ * ops/s and the p50/p99/p999/max latency of a single call, in
+ * nanoseconds.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../block.h"
+#include "../journal.h"
+#include "../rufs_ops.h"
+
+#define W_ALLOC	0x01
+#define W_PATH	0x02
+#define W_DIR	0x04
+#define W_RW	0x08
+#define W_ALL	0x0f
+
+enum { OUT_TEXT, OUT_JSON, OUT_CSV };
+
+static int nops = 10000;
+static size_t file_size = 16 << 20;
+static uint64_t disk_size = 512 << 20;
+static int workloads = W_ALL;
+static int format = OUT_TEXT;
+
+static uint64_t *lat;
+static size_t nlat;
+static uint64_t bytes;
+static uint64_t phase_start;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded the same every run */
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_rand() {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static void die(const char *what, const char *path) {
+	fprintf(stderr, "%s %s failed\n", what, path);
+	exit(1);
+}
+
+static void bench_begin() {
+	nlat = 0;
+	bytes = 0;
+	phase_start = now_ns();
+}
+
+static void record(uint64_t start) {
+	lat[nlat++] = now_ns() - start;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(double q) {
+	size_t rank = (size_t)(q * nlat + 0.999999);	/* nearest rank */
+	if (rank < 1)
+		rank = 1;
+	if (rank > nlat)
+		rank = nlat;
+	return lat[rank - 1];
+}
+
+static void bench_end(const char *name, long param) {
+	static int header_done = 0;
+	double secs = (now_ns() - phase_start) / 1e9;
+	if (nlat == 0)
+		return;
+
+	qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+	double ops = nlat / secs;
+	double mbs = bytes / secs / (1 << 20);
+	uint64_t p50 = percentile(0.50), p99 = percentile(0.99), p999 = percentile(0.999), max = lat[nlat - 1];
+
+	switch (format) {
+	case OUT_JSON:
+		printf("{\"bench\":\"%s\",\"param\":%ld,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+			"\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+			name, param, nlat, secs, ops, mbs, p50, p99, p999, max);
+		break;
+	case OUT_CSV:
+		if (!header_done++)
+			printf("bench,param,ops,seconds,ops_per_sec,mb_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+		printf("%s,%ld,%zu,%.6f,%.1f,%.2f,%lu,%lu,%lu,%lu\n", name, param, nlat, secs, ops, mbs, p50, p99, p999, max);
+		break;
+	default:
+		if (!header_done++)
+			printf("%-14s %8s %8s %12s %9s %10s %10s %10s %10s\n", "bench", "param", "ops", "ops/s", "MB/s",
+				"p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+		printf("%-14s %8ld %8zu %12.1f %9.2f %10lu %10lu %10lu %10lu\n", name, param, nlat, ops, mbs, p50, p99, p999, max);
+		break;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Allocation: data blocks near a goal, and inodes, one at a time as the
+ * write and create paths take them. Freed after, outside the clock.
+ */
+static void bench_alloc() {
+	int *got = malloc(nops * sizeof(int));
+	if (got == NULL)
+		die("malloc", "");
+
+	bench_begin();
+	for (int i = 0; i < nops; i++) {
+		uint64_t t = now_ns();
+		journal_begin();
+		got[i] = get_avail_blkno(0);
+		journal_end();
+		record(t);
+		if (got[i] < 0)
+			die("get_avail_blkno", "");
+	}
+	bench_end("alloc-blk", 1);
+
+	journal_begin();
+	for (int i = 0; i < nops; i++)
+		free_blkno(got[i]);
+	journal_end();
+
+	bench_begin();
+	for (int i = 0; i < nops; i++) {
+		uint64_t t = now_ns();
+		journal_begin();
+		got[i] = get_avail_ino(0, 0);
+		journal_end();
+		record(t);
+		if (got[i] < 0)
+			die("get_avail_ino", "");
+	}
+	bench_end("alloc-ino", 1);
+
+	journal_begin();
+	for (int i = 0; i < nops; i++)
+		free_ino(got[i]);
+	journal_end();
+	journal_reclaim();
+	free(got);
+}
+
+/*
+ * Path resolution through chains of directories, the dentry cache warm
+ * as it is for a busy mount
+ */
+static void bench_path() {
+	static const int depths[] = { 1, 4, 16, 64 };
+	char path[8192];
+	struct inode inode;
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		int len = snprintf(path, sizeof(path), "/path%d", depths[d]);
+		if (rufs_mkdir_tx(path, 0755) != 0)
+			die("mkdir", path);
+		for (int i = 1; i < depths[d]; i++) {
+			len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+			if (rufs_mkdir_tx(path, 0755) != 0)
+				die("mkdir", path);
+		}
+
+		bench_begin();
+		for (int i = 0; i < nops; i++) {
+			uint64_t t = now_ns();
+			if (get_node_by_path(path, 0, &inode) != 0)
+				die("get_node_by_path", path);
+			record(t);
+		}
+		bench_end("path", depths[d]);
+	}
+}
+
+/*
+ * Directory insert, lookup and removal, in directories of growing size:
+ * the small ones stay linear, the large ones are hashed
+ */
+static void bench_dir() {
+	static const int sizes[] = { 100, 1000, 10000, 50000 };
+	char path[256];
+	struct inode dir;
+	struct dirent dirent;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		if ((uint64_t)n + 16 > sb->max_inum)
+			break;
+
+		snprintf(path, sizeof(path), "/dir%d", n);
+		if (rufs_mkdir_tx(path, 0755) != 0 || get_node_by_path(path, 0, &dir) != 0)
+			die("mkdir", path);
+
+		// Step 1: Insert, create as the FUSE op does it; the handle is
+		// dropped outside the clock
+		bench_begin();
+		for (int i = 0; i < n; i++) {
+			uint64_t fh = 0;
+			snprintf(path, sizeof(path), "/dir%d/file%d", n, i);
+			uint64_t t = now_ns();
+			if (rufs_create_tx(path, 0644, &fh) != 0)
+				die("create", path);
+			record(t);
+			rufs_release(path, &fh);
+		}
+		bench_end("dir-insert", n);
+
+		// Step 2: Lookups at random, through the directory blocks
+		bench_begin();
+		for (int i = 0; i < nops; i++) {
+			char name[32];
+			int len = snprintf(name, sizeof(name), "file%d", (int)(next_rand() % n));
+			uint64_t t = now_ns();
+			if (dir_find(dir.ino, name, len, &dirent) != 0)
+				die("dir_find", name);
+			record(t);
+		}
+		bench_end("dir-find", n);
+
+		// Step 3: Remove it all
+		bench_begin();
+		for (int i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "/dir%d/file%d", n, i);
+			uint64_t t = now_ns();
+			if (rufs_unlink_tx(path) != 0)
+				die("unlink", path);
+			record(t);
+		}
+		bench_end("dir-remove", n);
+		journal_reclaim();
+	}
+}
+
+/*
+ * Reads and writes through an open handle at several sizes: a sequential
+ * write, then sequential and random reads of it
+ */
+static void bench_rw() {
+	static const size_t sizes[] = { 512, 4096, 65536, 1 << 20 };
+	char path[64];
+	char *buf = malloc(1 << 20);
+	if (buf == NULL)
+		die("malloc", "");
+	for (int i = 0; i < (1 << 20); i++)
+		buf[i] = (char)next_rand();
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t size = sizes[s];
+		size_t count = file_size / size;
+		uint64_t fh = 0;
+		snprintf(path, sizeof(path), "/rw%zu", size);
+		if (rufs_create_tx(path, 0644, &fh) != 0)
+			die("create", path);
+
+		bench_begin();
+		for (size_t i = 0; i < count; i++) {
+			uint64_t t = now_ns();
+			if (rufs_write_tx(path, buf, size, (off_t)(i * size), &fh) != (int)size)
+				die("write", path);
+			record(t);
+			bytes += size;
+		}
+		rufs_flush(path, &fh);
+		bench_end("write-seq", size);
+
+		bench_begin();
+		for (size_t i = 0; i < count; i++) {
+			uint64_t t = now_ns();
+			if (rufs_read(path, buf, size, (off_t)(i * size), &fh) != (int)size)
+				die("read", path);
+			record(t);
+			bytes += size;
+		}
+		bench_end("read-seq", size);
+
+		bench_begin();
+		for (size_t i = 0; i < count; i++) {
+			off_t off = (off_t)(next_rand() % count) * size;
+			uint64_t t = now_ns();
+			if (rufs_read(path, buf, size, off, &fh) != (int)size)
+				die("read", path);
+			record(t);
+			bytes += size;
+		}
+		bench_end("read-rand", size);
+
+		rufs_release(path, &fh);
+		if (rufs_unlink_tx(path) != 0)
+			die("unlink", path);
+		journal_reclaim();
+	}
+	free(buf);
+}
+
+static uint64_t parse_size(const char *s) {
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'g': case 'G': n <<= 10; /* fall through */
+	case 'm': case 'M': n <<= 10; /* fall through */
+	case 'k': case 'K': n <<= 10; break;
+	}
+	return n;
+}
+
+static int parse_workloads(char *list) {
+	static const char *names[] = { "alloc", "path", "dir", "rw" };
+	int mask = 0;
+	for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int found = 0;
+		for (int i = 0; i < 4; i++) {
+			if (strcmp(tok, names[i]) == 0) {
+				mask |= 1 << i;
+				found = 1;
+			}
+		}
+		if (strcmp(tok, "all") == 0)
+			mask = W_ALL;
+		else if (!found) {
+			fprintf(stderr, "unknown benchmark: %s\n", tok);
+			exit(1);
+		}
+	}
+	return mask;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-n ops] [-S file size] [-s disk size] [-w alloc,path,dir,rw] "
+		"[-b pread|mmap|uring] [-d dir] [-o text|json|csv]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *dir = (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+	int opt;
+	while ((opt = getopt(argc, argv, "n:S:s:w:b:d:o:")) != -1) {
+		switch (opt) {
+		case 'n': nops = atoi(optarg); break;
+		case 'S': file_size = parse_size(optarg); break;
+		case 's': disk_size = parse_size(optarg); break;
+		case 'w': workloads = parse_workloads(optarg); break;
+		case 'd': dir = optarg; break;
+		case 'b':
+			if (strcmp(optarg, "pread") == 0)
+				dev_set_backend(DEV_PREAD);
+			else if (strcmp(optarg, "mmap") == 0)
+				dev_set_backend(DEV_MMAP);
+			else if (strcmp(optarg, "uring") == 0)
+				dev_set_backend(DEV_URING);
+			else
+				usage(argv[0]);
+			break;
+		case 'o':
+			if (strcmp(optarg, "json") == 0)
+				format = OUT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				format = OUT_CSV;
+			else if (strcmp(optarg, "text") == 0)
+				format = OUT_TEXT;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nops < 1 || file_size < (1 << 20))
+		usage(argv[0]);
+
+	// Step 1: A fresh image, sized for the largest directory benchmark
+	snprintf(diskfile_path, PATH_MAX, "%s/rufs-microbench.%d", dir, (int)getpid());
+	unlink(diskfile_path);
+	mkfs_disk_size = disk_size;
+	mkfs_num_inodes = disk_size / BLOCK_SIZE / 2;
+
+	size_t max_ops = (size_t)nops;
+	if (file_size / 512 > max_ops)
+		max_ops = file_size / 512;
+	if (max_ops < 50000)
+		max_ops = 50000;
+	if ((lat = malloc(max_ops * sizeof(uint64_t))) == NULL)
+		die("malloc", "");
+
+	rufs_mount();
+
+	// Step 2: Run the benchmarks
+	if (workloads & W_ALLOC)
+		bench_alloc();
+	if (workloads & W_PATH)
+		bench_path();
+	if (workloads & W_DIR)
+		bench_dir();
+	if (workloads & W_RW)
+		bench_rw();
+
+	rufs_unmount();
+	unlink(diskfile_path);
+	free(lat);
+	return 0;
+}
@@ -14,16 +14,113 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "block.h"
-
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+#include "metrics.h"
+#include "uring.h"
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+// With DEV_MMAP the whole disk file is mapped here and block I/O is memcpy
+static int backend = DEV_PREAD;
+static char *diskmap = NULL;
+static size_t diskmap_size = 0;
+
+//Choose how the disk file is accessed, before it is opened
+void dev_set_backend(int dev_backend) {
+    backend = dev_backend;
+}
+
+// Map the open disk file, falling back to pread/pwrite if that fails
+static void dev_map() {
+    struct stat st;
+    if (backend != DEV_MMAP || fstat(diskfile, &st) != 0 || st.st_size == 0) {
+		return;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+    if (p == MAP_FAILED) {
+		perror("disk mmap failed, using pread");
+		return;
+    }
+    diskmap = p;
+    diskmap_size = st.st_size;
+}
+
+// With DEV_URING each thread gets its own ring, created on first use.
+// Vectored I/O issued between bio_batch_begin() and bio_batch_end() is
+// queued on it and submitted with one io_uring_enter().
+static int uring_ok = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread Uring *ring = NULL;
+static __thread int batch_depth = 0;
+
+static void ring_release(void *r) {
+    uring_destroy(r);
+}
+
+static void ring_key_init() {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static Uring *thread_ring() {
+    if (ring == NULL) {
+		ring = uring_create(URING_ENTRIES);
+		if (ring != NULL) {
+			pthread_once(&ring_once, ring_key_init);
+			pthread_setspecific(ring_key, ring);
+		}
+    }
+    return ring;
+}
+
+// Check io_uring works here, falling back to pread/pwrite if it doesn't
+static void dev_ring_probe() {
+    if (backend != DEV_URING) {
+		return;
+    }
+
+    Uring *probe = uring_create(URING_ENTRIES);
+    if (probe == NULL) {
+		perror("io_uring unavailable, using pread");
+		return;
+    }
+    uring_destroy(probe);
+    uring_ok = 1;
+}
+
+// Queue vectored I/O on this thread's ring if a batch is open, returns
+// the bytes it will move or -1 if it has to be done synchronously
+static int ring_queue(int op, const int block_num, const struct iovec *iov, const int iovcnt) {
+    if (batch_depth == 0 || ring == NULL) {
+		return -1;
+    }
+    if (uring_queue(ring, op, diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE) != 0) {
+		return -1;
+    }
+
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Address of a block in the mapping, NULL if it lies past the end
+static char *block_addr(const int block_num, size_t len) {
+    size_t off = (size_t)block_num * BLOCK_SIZE;
+    if (block_num < 0 || off + len > diskmap_size) {
+		return NULL;
+    }
+    return diskmap + off;
+}
+
+//Creates a file of disk_size bytes which is your new emulated disk
+void dev_init(const char* diskfile_path, off_t disk_size) {
     if (diskfile >= 0) {
 		return;
     }
@@ -34,7 +131,9 @@ void dev_init(const char* diskfile_path) {
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    ftruncate(diskfile, disk_size);
+    dev_map();
+    dev_ring_probe();
 }
 
 //Function to open the disk file
@@ -48,19 +147,47 @@ int dev_open(const char* diskfile_path) {
 		perror("disk_open failed");
 		return -1;
     }
+    dev_map();
+    dev_ring_probe();
 	return 0;
 }
 
 void dev_close() {
+    uring_ok = 0;
+    if (diskmap != NULL) {
+		munmap(diskmap, diskmap_size);
+		diskmap = NULL;
+		diskmap_size = 0;
+    }
     if (diskfile >= 0) {
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
+static inline size_t iov_bytes(const struct iovec *iov, const int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+    }
+    return len;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    METRIC_COUNT(MC_BIO_READS, 1);
+    METRIC_COUNT(MC_BIO_READ_BYTES, BLOCK_SIZE);
+    if (diskmap != NULL) {
+		char *src = block_addr(block_num, BLOCK_SIZE);
+		if (src == NULL) {
+			memset(buf, 0, BLOCK_SIZE);
+			return 0;
+		}
+		memcpy(buf, src, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -73,10 +200,173 @@ int bio_read(const int block_num, void *buf) {
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    METRIC_COUNT(MC_BIO_WRITES, 1);
+    METRIC_COUNT(MC_BIO_WRITE_BYTES, BLOCK_SIZE);
+    if (diskmap != NULL) {
+		char *dst = block_addr(block_num, BLOCK_SIZE);
+		if (dst == NULL) {
+			return -1;
+		}
+		memcpy(dst, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+//Read count contiguous blocks starting at block_num into buf
+int bio_read_range(const int block_num, const int count, void *buf) {
+    struct iovec iov = { buf, (size_t)count * BLOCK_SIZE };
+    return bio_readv(block_num, &iov, 1);
+}
+
+//Write count contiguous blocks starting at block_num from buf
+int bio_write_range(const int block_num, const int count, const void *buf) {
+    struct iovec iov = { (void *)buf, (size_t)count * BLOCK_SIZE };
+    return bio_writev(block_num, &iov, 1);
+}
+
+//Read contiguous blocks starting at block_num into the buffers of iov,
+//each a multiple of BLOCK_SIZE long, with a single syscall
+int bio_readv(const int block_num, const struct iovec *iov, const int iovcnt) {
+    int retstat = 0;
+    METRIC_COUNT(MC_BIO_READS, 1);
+    METRIC_COUNT(MC_BIO_READ_BYTES, iov_bytes(iov, iovcnt));
+    if (diskmap != NULL) {
+		char *src = block_addr(block_num, 0);
+		for (int i = 0; src != NULL && i < iovcnt; i++) {
+			if (block_addr(block_num, retstat + iov[i].iov_len) == NULL) {
+				break;
+			}
+			memcpy(iov[i].iov_base, src + retstat, iov[i].iov_len);
+			retstat += iov[i].iov_len;
+		}
+		return retstat;
+    }
+    if ((retstat = ring_queue(URING_READ, block_num, iov, iovcnt)) >= 0) {
+		return retstat;
+    }
+    retstat = preadv(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		perror("block_readv failed");
+    }
+
+    return retstat;
+}
+
+//Write the buffers of iov to contiguous blocks starting at block_num
+//with a single syscall
+int bio_writev(const int block_num, const struct iovec *iov, const int iovcnt) {
+    int retstat = 0;
+    METRIC_COUNT(MC_BIO_WRITES, 1);
+    METRIC_COUNT(MC_BIO_WRITE_BYTES, iov_bytes(iov, iovcnt));
+    if (diskmap != NULL) {
+		char *dst = block_addr(block_num, 0);
+		for (int i = 0; dst != NULL && i < iovcnt; i++) {
+			if (block_addr(block_num, retstat + iov[i].iov_len) == NULL) {
+				return -1;
+			}
+			memcpy(dst + retstat, iov[i].iov_base, iov[i].iov_len);
+			retstat += iov[i].iov_len;
+		}
+		return retstat;
+    }
+    if ((retstat = ring_queue(URING_WRITE, block_num, iov, iovcnt)) >= 0) {
+		return retstat;
+    }
+    retstat = pwritev(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		perror("block_writev failed");
+    }
+    return retstat;
+}
+
+//Start queueing this thread's bio_readv/bio_writev calls instead of
+//issuing them one by one. Buffers must stay untouched until
+//bio_batch_end(). Batches nest; only the outermost end submits.
+void bio_batch_begin() {
+    if (uring_ok && thread_ring() != NULL) {
+		batch_depth++;
+    }
+}
+
+//Submit the queued I/O with a single io_uring_enter() and wait for all
+//of it. Returns -1 if any queued request failed.
+int bio_batch_end() {
+    if (batch_depth == 0 || --batch_depth > 0) {
+		return 0;
+    }
+    return uring_submit_wait(ring);
+}
+
+//Pointer to a block inside the mapped disk, NULL unless DEV_MMAP is active
+void *bio_map(const int block_num) {
+    if (diskmap == NULL) {
+		return NULL;
+    }
+    return block_addr(block_num, BLOCK_SIZE);
+}
+
+//Tell the kernel count blocks starting at block_num will be read soon
+int bio_prefetch(const int block_num, const int count) {
+    size_t len = (size_t)count * BLOCK_SIZE;
+    if (diskmap != NULL) {
+		char *addr = block_addr(block_num, len);
+		return (addr != NULL) ? madvise(addr, len, MADV_WILLNEED) : -1;
+    }
+    return posix_fadvise(diskfile, (off_t)block_num*BLOCK_SIZE, len, POSIX_FADV_WILLNEED) == 0 ? 0 : -1;
+}
+
+// Concurrent dev_sync() callers share barriers: each takes a ticket, and
+// one flush started after a ticket was taken covers it.
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long sync_requested = 0;
+static unsigned long sync_done = 0;
+static int sync_running = 0;
+static int sync_error = 0;
+
+static int dev_flush() {
+    METRIC_COUNT(MC_DEV_FLUSHES, 1);
+    if (diskmap != NULL && msync(diskmap, diskmap_size, MS_SYNC) != 0) {
+		perror("disk msync failed");
+		return -1;
+    }
+    if (diskmap == NULL && diskfile >= 0 && fdatasync(diskfile) != 0) {
+		perror("disk fdatasync failed");
+		return -1;
+    }
+    return 0;
+}
+
+//Make every write issued so far durable, the journal's ordering barrier
+int dev_sync() {
+    METRIC_COUNT(MC_DEV_SYNCS, 1);
+    pthread_mutex_lock(&sync_lock);
+    unsigned long ticket = ++sync_requested;
+
+    // Step 1: wait out a flush that may have started before our writes
+    while (sync_running && sync_done < ticket) {
+		pthread_cond_wait(&sync_cond, &sync_lock);
+    }
+
+    // Step 2: nobody covered us, flush for everyone waiting so far
+    if (sync_done < ticket) {
+		unsigned long covers = sync_requested;
+		sync_running = 1;
+		pthread_mutex_unlock(&sync_lock);
+		int ret = dev_flush();
+		pthread_mutex_lock(&sync_lock);
+		sync_running = 0;
+		sync_done = covers;
+		sync_error = ret;
+		pthread_cond_broadcast(&sync_cond);
+    }
+
+    int ret = sync_error;
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
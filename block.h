@@ -8,12 +8,29 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+#define DEV_PREAD	0	/* pread/pwrite on the disk file */
+#define DEV_MMAP	1	/* disk file mapped into memory */
+#define DEV_URING	2	/* pread/pwrite, batched through io_uring */
+
+void dev_set_backend(int dev_backend);
+void dev_init(const char* diskfile_path, off_t disk_size);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_read_range(const int block_num, const int count, void *buf);
+int bio_write_range(const int block_num, const int count, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, const int iovcnt);
+int bio_writev(const int block_num, const struct iovec *iov, const int iovcnt);
+void bio_batch_begin();
+int bio_batch_end();
+int bio_prefetch(const int block_num, const int count);
+void *bio_map(const int block_num);
+int dev_sync();
 
 #endif
@@ -0,0 +1,665 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	cache.c
+ *
+ *	Write-back block cache sitting between rufs.c and block.c.
+ *	Blocks are hashed by block number and evicted with the CLOCK
+ *	algorithm; dirty blocks reach the disk on eviction, on cache_flush()
+ *	and periodically from a background flusher thread.
+ *
+ *	The cache is split into CACHE_SHARDS independent shards, each with
+ *	its own lock, so FUSE threads touching different blocks don't
+ *	serialize on a single mutex.
+ *
+ *	When the device is memory-mapped (DEV_MMAP) the page cache already
+ *	plays this role, so the cache passes every call straight through and
+ *	cache_view() hands out pointers into the mapping.
+ *
+ *	Metadata blocks written for the journal are pinned: they stay in the
+ *	cache, are never written back or evicted, until the transaction
+ *	holding them is in the journal. With a mapped device the shards hold
+ *	nothing else.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "block.h"
+#include "cache.h"
+#include "metrics.h"
+
+typedef struct CacheEntry {
+    int blk_num;        // cached block number, -1 if slot unused
+    int dirty;          // block differs from the disk copy
+    int referenced;     // CLOCK reference bit
+    unsigned pin;       // journal transaction holding the block back, 0 if none
+    int next;           // next slot in the same hash bucket, -1 ends chain
+    char *data;
+} CacheEntry;
+
+typedef struct CacheShard {
+    CacheEntry *entries;
+    int *buckets;
+    int num_entries;
+    int num_buckets;
+    int clock_hand;
+    int num_pinned;
+    pthread_mutex_t lock;
+} CacheShard;
+
+static CacheShard shards[CACHE_SHARDS];
+static int initialized = 0;
+static int passthrough = 0;     // device is mapped, only pinned blocks are held here
+
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running = 0;
+
+
+static CacheShard *shard_of(int blk_num) {
+    return &shards[(unsigned int)blk_num % CACHE_SHARDS];
+}
+
+static int hash_blk(CacheShard *sh, int blk_num) {
+    return ((unsigned int)blk_num / CACHE_SHARDS) * 2654435761u & (sh->num_buckets - 1);
+}
+
+// Find the slot holding blk_num, -1 if it is not cached
+static int lookup(CacheShard *sh, int blk_num) {
+    for (int i = sh->buckets[hash_blk(sh, blk_num)]; i != -1; i = sh->entries[i].next) {
+        if (sh->entries[i].blk_num == blk_num)
+            return i;
+    }
+    return -1;
+}
+
+static void unhash(CacheShard *sh, int slot) {
+    int *link = &sh->buckets[hash_blk(sh, sh->entries[slot].blk_num)];
+    while (*link != slot)
+        link = &sh->entries[*link].next;
+    *link = sh->entries[slot].next;
+    sh->entries[slot].next = -1;
+}
+
+// Pick a victim with CLOCK, writing it back if dirty. Returns -1 on I/O
+// error or when every block of the shard is pinned.
+static int evict(CacheShard *sh) {
+    for (int scanned = 0; scanned < 2 * sh->num_entries; scanned++) {
+        CacheEntry *e = &sh->entries[sh->clock_hand];
+        int slot = sh->clock_hand;
+        sh->clock_hand = (sh->clock_hand + 1) % sh->num_entries;
+
+        if (e->blk_num == -1)
+            return slot;
+
+        if (e->pin)
+            continue;
+
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+
+        if (e->dirty) {
+            if (bio_write(e->blk_num, e->data) <= 0)
+                return -1;
+            e->dirty = 0;
+        }
+        unhash(sh, slot);
+        e->blk_num = -1;
+        return slot;
+    }
+    return -1;
+}
+
+// Forget a slot's block, e.g. when the disk copy supersedes it
+static void drop(CacheShard *sh, int slot) {
+    CacheEntry *e = &sh->entries[slot];
+    if (e->pin)
+        sh->num_pinned--;
+    unhash(sh, slot);
+    e->blk_num = -1;
+    e->dirty = 0;
+    e->pin = 0;
+}
+
+// Bind a free slot to blk_num and link it into its bucket
+static int insert(CacheShard *sh, int blk_num) {
+    int slot = evict(sh);
+    if (slot == -1)
+        return -1;
+
+    int b = hash_blk(sh, blk_num);
+    sh->entries[slot].blk_num = blk_num;
+    sh->entries[slot].dirty = 0;
+    sh->entries[slot].referenced = 1;
+    sh->entries[slot].pin = 0;
+    sh->entries[slot].next = sh->buckets[b];
+    sh->buckets[b] = slot;
+    return slot;
+}
+
+typedef struct DirtySlot {
+    int blk_num;
+    int slot;
+} DirtySlot;
+
+static int cmp_dirty_blk(const void *a, const void *b) {
+    return ((const DirtySlot*)a)->blk_num - ((const DirtySlot*)b)->blk_num;
+}
+
+// Write every dirty block of a shard back in block order; caller holds its lock
+static int flush_locked(CacheShard *sh) {
+    DirtySlot *dirty = malloc(sh->num_entries * sizeof(DirtySlot));
+    int num_dirty = 0;
+    int ret = 0;
+
+    for (int i = 0; i < sh->num_entries; i++) {
+        // pinned blocks wait for their journal commit
+        if (sh->entries[i].blk_num != -1 && sh->entries[i].dirty && !sh->entries[i].pin) {
+            dirty[num_dirty].blk_num = sh->entries[i].blk_num;
+            dirty[num_dirty++].slot = i;
+        }
+    }
+
+    qsort(dirty, num_dirty, sizeof(DirtySlot), cmp_dirty_blk);
+
+    // Shards interleave block numbers, so nothing here is contiguous;
+    // queue the writes as one batch instead so a ring-backed device
+    // takes them all in a single submission
+    struct iovec *iov = malloc(num_dirty * sizeof(struct iovec));
+    int *written = malloc(num_dirty * sizeof(int));
+
+    bio_batch_begin();
+    for (int i = 0; i < num_dirty; i++) {
+        CacheEntry *e = &sh->entries[dirty[i].slot];
+        iov[i].iov_base = e->data;
+        iov[i].iov_len = BLOCK_SIZE;
+        written[i] = bio_writev(e->blk_num, &iov[i], 1) > 0;
+    }
+    int batch_failed = bio_batch_end() != 0;
+
+    for (int i = 0; i < num_dirty; i++) {
+        if (!written[i] || batch_failed) {
+            ret = -1;
+            continue;
+        }
+        sh->entries[dirty[i].slot].dirty = 0;
+    }
+
+    free(written);
+    free(iov);
+    free(dirty);
+    return ret;
+}
+
+static void *flusher_main(void *arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_FLUSH_INTERVAL;
+
+        if (pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&flusher_lock);
+            cache_flush();
+            pthread_mutex_lock(&flusher_lock);
+        }
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+
+void cache_init(int num_blocks) {
+    if (initialized) {
+        return;
+    }
+
+    passthrough = bio_map(0) != NULL;
+
+    int per_shard = (num_blocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard *sh = &shards[s];
+        sh->num_entries = per_shard;
+        sh->num_buckets = 1;
+        while (sh->num_buckets < 2 * per_shard)
+            sh->num_buckets <<= 1;
+
+        sh->entries = calloc(sh->num_entries, sizeof(CacheEntry));
+        sh->buckets = malloc(sh->num_buckets * sizeof(int));
+        char *pool = malloc((size_t)sh->num_entries * BLOCK_SIZE);
+
+        for (int i = 0; i < sh->num_entries; i++) {
+            sh->entries[i].blk_num = -1;
+            sh->entries[i].next = -1;
+            sh->entries[i].data = pool + (size_t)i * BLOCK_SIZE;
+        }
+        memset(sh->buckets, -1, sh->num_buckets * sizeof(int));
+        sh->clock_hand = 0;
+        sh->num_pinned = 0;
+        pthread_mutex_init(&sh->lock, NULL);
+    }
+    initialized = 1;
+
+    if (passthrough)
+        return;
+
+    flusher_running = 1;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        perror("cache flusher failed");
+        flusher_running = 0;
+    }
+}
+
+void cache_destroy() {
+    if (!initialized) {
+        return;
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    int was_running = flusher_running;
+    flusher_running = 0;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+
+    if (was_running)
+        pthread_join(flusher, NULL);
+
+    cache_flush();
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        free(shards[s].entries[0].data);
+        free(shards[s].entries);
+        free(shards[s].buckets);
+        pthread_mutex_destroy(&shards[s].lock);
+    }
+    passthrough = 0;
+    initialized = 0;
+}
+
+// Copy blk_num out of the cache if it is there, 0 on a miss
+static int read_cached(int blk_num, char *dst) {
+    CacheShard *sh = shard_of(blk_num);
+    pthread_mutex_lock(&sh->lock);
+
+    int slot = lookup(sh, blk_num);
+    if (slot != -1) {
+        sh->entries[slot].referenced = 1;
+        memcpy(dst, sh->entries[slot].data, BLOCK_SIZE);
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    METRIC_COUNT((slot != -1) ? MC_CACHE_HITS : MC_CACHE_MISSES, 1);
+    return slot != -1;
+}
+
+//Read a block through the cache
+int cache_read(const int block_num, void *buf) {
+    if (passthrough)
+        return read_cached(block_num, buf) ? BLOCK_SIZE : bio_read(block_num, buf);
+
+    CacheShard *sh = shard_of(block_num);
+    pthread_mutex_lock(&sh->lock);
+
+    int slot = lookup(sh, block_num);
+    METRIC_COUNT((slot != -1) ? MC_CACHE_HITS : MC_CACHE_MISSES, 1);
+    if (slot == -1) {
+        slot = insert(sh, block_num);
+        if (slot == -1) {
+            pthread_mutex_unlock(&sh->lock);
+            return -1;
+        }
+
+        int retstat = bio_read(block_num, sh->entries[slot].data);
+        if (retstat <= 0) {
+            // don't keep a block we failed to read
+            unhash(sh, slot);
+            sh->entries[slot].blk_num = -1;
+            pthread_mutex_unlock(&sh->lock);
+            memset(buf, 0, BLOCK_SIZE);
+            return retstat;
+        }
+    }
+
+    sh->entries[slot].referenced = 1;
+    memcpy(buf, sh->entries[slot].data, BLOCK_SIZE);
+
+    pthread_mutex_unlock(&sh->lock);
+    return BLOCK_SIZE;
+}
+
+//Write a block into the cache, it reaches the disk on eviction or flush
+int cache_write(const int block_num, const void *buf) {
+    CacheShard *sh = shard_of(block_num);
+    pthread_mutex_lock(&sh->lock);
+
+    int slot = lookup(sh, block_num);
+    if (slot == -1 && passthrough) {
+        pthread_mutex_unlock(&sh->lock);
+        return bio_write(block_num, buf);
+    }
+    if (slot == -1) {
+        // whole block is overwritten, no need to read it first
+        slot = insert(sh, block_num);
+        if (slot == -1) {
+            pthread_mutex_unlock(&sh->lock);
+            return -1;
+        }
+    }
+
+    memcpy(sh->entries[slot].data, buf, BLOCK_SIZE);
+    sh->entries[slot].dirty = 1;
+    sh->entries[slot].referenced = 1;
+
+    pthread_mutex_unlock(&sh->lock);
+    return BLOCK_SIZE;
+}
+
+// Pending run of uncached blocks, read from the disk with one bio_readv()
+typedef struct ReadRun {
+    struct iovec iov[CACHE_IOV_MAX];
+    int iovcnt;
+    int blk_num;        // first block of the run
+    int count;          // blocks in the run
+} ReadRun;
+
+static int run_submit(ReadRun *run) {
+    if (run->count == 0)
+        return 0;
+
+    int retstat = bio_readv(run->blk_num, run->iov, run->iovcnt);
+    int want = run->count * BLOCK_SIZE;
+    run->iovcnt = 0;
+    run->count = 0;
+    return retstat == want ? 0 : -1;
+}
+
+static int run_add(ReadRun *run, int blk_num, char *dst) {
+    if (run->count > 0 && run->blk_num + run->count != blk_num && run_submit(run) != 0)
+        return -1;
+
+    // buffers that follow each other in memory share one iovec
+    struct iovec *last = run->iovcnt ? &run->iov[run->iovcnt - 1] : NULL;
+    if (last != NULL && (char*)last->iov_base + last->iov_len == dst) {
+        last->iov_len += BLOCK_SIZE;
+    } else {
+        if (run->iovcnt == CACHE_IOV_MAX) {
+            if (run_submit(run) != 0)
+                return -1;
+        }
+        run->iov[run->iovcnt].iov_base = dst;
+        run->iov[run->iovcnt++].iov_len = BLOCK_SIZE;
+    }
+
+    if (run->count++ == 0)
+        run->blk_num = blk_num;
+    return 0;
+}
+
+//Read contiguous blocks starting at block_num into the buffers of iov.
+//Cached blocks are copied out, the rest is read from the disk in as few
+//bio_readv() calls as possible, without being added to the cache.
+int cache_readv(const int block_num, const struct iovec *iov, const int iovcnt) {
+    if (passthrough)
+        return bio_readv(block_num, iov, iovcnt);
+
+    ReadRun run;
+    run.iovcnt = 0;
+    run.count = 0;
+
+    int blk_num = block_num;
+    for (int i = 0; i < iovcnt; i++) {
+        for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE, blk_num++) {
+            char *dst = (char*)iov[i].iov_base + off;
+            if (read_cached(blk_num, dst))
+                continue;
+            if (run_add(&run, blk_num, dst) != 0)
+                return -1;
+        }
+    }
+
+    if (run_submit(&run) != 0)
+        return -1;
+    return (blk_num - block_num) * BLOCK_SIZE;
+}
+
+//Write the buffers of iov to contiguous blocks starting at block_num,
+//straight to the disk with one bio_writev(). Cached copies are dropped
+//as they are superseded; the caller keeps other users of these blocks
+//out until this returns.
+int cache_writev(const int block_num, const struct iovec *iov, const int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    for (int blk_num = block_num; blk_num < block_num + (int)(len / BLOCK_SIZE); blk_num++) {
+        CacheShard *sh = shard_of(blk_num);
+        pthread_mutex_lock(&sh->lock);
+
+        int slot = lookup(sh, blk_num);
+        if (slot != -1)
+            drop(sh, slot);
+
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    return bio_writev(block_num, iov, iovcnt);
+}
+
+//Read-only view of a block: in place when the device is mapped, else
+//copied into buf. NULL on error.
+const void *cache_view(const int block_num, void *buf) {
+    if (passthrough) {
+        if (read_cached(block_num, buf))
+            return buf;
+        void *p = bio_map(block_num);
+        if (p != NULL)
+            return p;
+    }
+    return cache_read(block_num, buf) > 0 ? buf : NULL;
+}
+
+static int is_cached(int blk_num) {
+    CacheShard *sh = shard_of(blk_num);
+    pthread_mutex_lock(&sh->lock);
+    int slot = lookup(sh, blk_num);
+    pthread_mutex_unlock(&sh->lock);
+    return slot != -1;
+}
+
+//Read count contiguous blocks starting at block_num into the cache ahead
+//of their use, with one bio_readv(). Blocks already cached are kept as
+//they are; the caller keeps writers of these blocks out until this returns.
+int cache_prefetch(const int block_num, const int count) {
+    if (passthrough)
+        return bio_prefetch(block_num, count);
+
+    // only the stretch between the first and last uncached block is read
+    int first = block_num, last = block_num + count;
+    while (first < last && is_cached(first))
+        first++;
+    while (last > first && is_cached(last - 1))
+        last--;
+    if (first == last)
+        return 0;
+
+    size_t len = (size_t)(last - first) * BLOCK_SIZE;
+    char *buf = malloc(len);
+    char *cached = malloc(last - first);
+    if (buf == NULL || cached == NULL) {
+        free(buf);
+        free(cached);
+        return -1;
+    }
+
+    // what is cached in between may be newer than the disk, and may be
+    // evicted by the inserts below before its turn comes; note it now
+    for (int blk_num = first; blk_num < last; blk_num++)
+        cached[blk_num - first] = is_cached(blk_num);
+
+    struct iovec iov = { buf, len };
+    if (bio_readv(first, &iov, 1) != (int)len) {
+        free(cached);
+        free(buf);
+        return -1;
+    }
+
+    for (int blk_num = first; blk_num < last; blk_num++) {
+        if (cached[blk_num - first])
+            continue;
+        CacheShard *sh = shard_of(blk_num);
+        pthread_mutex_lock(&sh->lock);
+        if (lookup(sh, blk_num) == -1) {
+            int slot = insert(sh, blk_num);
+            if (slot != -1)
+                memcpy(sh->entries[slot].data, buf + (size_t)(blk_num - first) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    free(cached);
+    free(buf);
+    return 0;
+}
+
+//Write a metadata block on behalf of journal transaction tx (non-zero).
+//The block is pinned: it stays in the cache and never reaches its home
+//location until cache_unpin(). A dirty copy left by an earlier, already
+//committed transaction goes home first, so the journal never needs it
+//again. Returns the number of blocks pinned in the block's shard, -1 on
+//error.
+int cache_write_pinned(const int block_num, const void *buf, const unsigned tx) {
+    CacheShard *sh = shard_of(block_num);
+    pthread_mutex_lock(&sh->lock);
+
+    int slot = lookup(sh, block_num);
+    if (slot == -1) {
+        slot = insert(sh, block_num);
+        if (slot == -1) {
+            pthread_mutex_unlock(&sh->lock);
+            return -1;
+        }
+    }
+
+    CacheEntry *e = &sh->entries[slot];
+    if (e->dirty && !e->pin) {
+        if (bio_write(block_num, e->data) <= 0) {
+            pthread_mutex_unlock(&sh->lock);
+            return -1;
+        }
+    }
+
+    memcpy(e->data, buf, BLOCK_SIZE);
+    e->dirty = 1;
+    e->referenced = 1;
+    if (!e->pin)
+        sh->num_pinned++;
+    e->pin = tx;
+
+    int pinned = sh->num_pinned;
+    pthread_mutex_unlock(&sh->lock);
+    return pinned;
+}
+
+//Release a block pinned by transaction tx now that tx is in the journal.
+//If a later transaction has pinned it again the cache keeps the newer
+//contents, and data, the block as tx logged it, is written home instead.
+int cache_unpin(const int block_num, const unsigned tx, const void *data) {
+    CacheShard *sh = shard_of(block_num);
+    pthread_mutex_lock(&sh->lock);
+
+    int ret = 0;
+    int slot = lookup(sh, block_num);
+    if (slot == -1) {
+        // superseded by a cache_writev() straight to the disk
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+
+    CacheEntry *e = &sh->entries[slot];
+    if (e->pin == tx) {
+        e->pin = 0;
+        sh->num_pinned--;
+        if (passthrough) {
+            ret = bio_write(block_num, e->data) > 0 ? 0 : -1;
+            drop(sh, slot);
+        }
+    } else if (e->pin && data != NULL) {
+        ret = bio_write(block_num, data) > 0 ? 0 : -1;
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    return ret;
+}
+
+// Write one slot back if it is dirty and not held by the journal
+static int flush_slot(CacheShard *sh, int slot) {
+    CacheEntry *e = &sh->entries[slot];
+    if (!e->dirty || e->pin)
+        return 0;
+    if (bio_write(e->blk_num, e->data) <= 0)
+        return -1;
+    e->dirty = 0;
+    return 0;
+}
+
+//Write back the dirty blocks among count blocks starting at block_num,
+//e.g. the data of one file. Pinned blocks are left to the journal.
+int cache_flush_range(const int block_num, const int count) {
+    if (!initialized || passthrough) {
+        return 0;
+    }
+
+    int ret = 0;
+    if (count <= CACHE_NUM_BLOCKS) {
+        for (int b = block_num; b < block_num + count; b++) {
+            CacheShard *sh = shard_of(b);
+            pthread_mutex_lock(&sh->lock);
+            int slot = lookup(sh, b);
+            if (slot != -1 && flush_slot(sh, slot) < 0)
+                ret = -1;
+            pthread_mutex_unlock(&sh->lock);
+        }
+        return ret;
+    }
+
+    // a range longer than the cache is cheaper to match slot by slot
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+        for (int i = 0; i < sh->num_entries; i++) {
+            int b = sh->entries[i].blk_num;
+            if (b >= block_num && b < block_num + count && flush_slot(sh, i) < 0)
+                ret = -1;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return ret;
+}
+
+//Write all dirty blocks back to the disk
+int cache_flush() {
+    if (!initialized || passthrough) {
+        return 0;
+    }
+
+    int ret = 0;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_lock(&shards[s].lock);
+        if (flush_locked(&shards[s]) != 0)
+            ret = -1;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    return ret;
+}
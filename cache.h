@@ -0,0 +1,31 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	cache.h
+ *
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <sys/uio.h>
+
+#define CACHE_NUM_BLOCKS		1024	/* blocks held in memory (4MB) */
+#define CACHE_FLUSH_INTERVAL	5		/* seconds between background flushes */
+#define CACHE_SHARDS			16		/* independently locked partitions */
+#define CACHE_IOV_MAX			64		/* buffers per vectored disk read */
+
+void cache_init(int num_blocks);
+void cache_destroy();
+int cache_read(const int block_num, void *buf);
+int cache_write(const int block_num, const void *buf);
+int cache_readv(const int block_num, const struct iovec *iov, const int iovcnt);
+int cache_writev(const int block_num, const struct iovec *iov, const int iovcnt);
+int cache_prefetch(const int block_num, const int count);
+const void *cache_view(const int block_num, void *buf);
+int cache_write_pinned(const int block_num, const void *buf, const unsigned tx);
+int cache_unpin(const int block_num, const unsigned tx, const void *data);
+int cache_flush();
+int cache_flush_range(const int block_num, const int count);
+
+#endif
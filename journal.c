@@ -0,0 +1,814 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ *	Write-ahead journal for metadata blocks. rufs.c writes bitmap,
+ *	inode-table, directory and extent blocks with journal_write(); they
+ *	join the running transaction and stay pinned in the cache so nothing
+ *	reaches its home location early.
+ *
+ *	Every operation that changes metadata runs between journal_begin()
+ *	and journal_end(). A commit waits for the operations in flight, takes
+ *	a copy of the transaction and lets the next one start, so one commit
+ *	carries every operation of the last interval (group commit). It costs
+ *	one sequential write and one dev_sync() barrier, after which the
+ *	blocks are unpinned and go home through the cache as usual.
+ *
+ *	A checkpoint writes every committed block home and empties the log.
+ *	Commits and checkpoints run from a background thread, or right away
+ *	for journal_commit() and when the running transaction gets too big.
+ *	At mount the committed transactions still in the log are replayed.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "block.h"
+#include "cache.h"
+#include "journal.h"
+#include "metrics.h"
+
+// pinned blocks allowed in one cache shard before a commit is forced
+#define JOURNAL_SHARD_PINS (CACHE_NUM_BLOCKS / CACHE_SHARDS / 2)
+
+typedef struct IntList {
+    int *v;
+    int n;
+    int max;
+} IntList;
+
+typedef struct Transaction {
+    unsigned tid;       // tag pinning its blocks in the cache, never 0
+    IntList blocks;     // home blocks logged, each once
+    IntList revoked;    // freed blocks with an older copy in the log
+    IntList freed;      // (first, count) runs released once committed
+} Transaction;
+
+// Blocks logged since the last checkpoint, with the transaction that logged them last
+typedef struct LogSlot {
+    int blk;            // -1 if the slot is unused
+    unsigned tid;
+} LogSlot;
+
+static int jopen = 0;
+static int jstart, jblocks;             // journal region, its first block is the journal_super
+static int tx_max;                      // logged blocks before a commit is forced
+static int (*prepare_fn)();             // moves in-core metadata into blocks before a commit
+static void (*release_fn)(int, int);    // frees a run of blocks for good
+
+static int head = 1;                    // where the next transaction goes
+static int used = 0;                    // log blocks in use, wrap gap included
+static uint64_t next_seq;
+static unsigned committed_tid;          // every transaction up to this one is in the log
+static unsigned next_tid;
+
+static Transaction running;
+static int commit_wanted = 0;
+static int aborted = 0;                 // a transaction failed to reach the log, nothing more is committed
+static LogSlot *logged;
+static int logged_size, logged_count;
+
+// Operations hold op_lock shared; a commit takes it exclusively while it
+// copies a transaction. It prefers writers so commits aren't starved.
+static pthread_rwlock_t op_lock;
+static pthread_once_t op_lock_once = PTHREAD_ONCE_INIT;
+static __thread int op_depth = 0;
+
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;     // running transaction and logged set
+static pthread_cond_t tx_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // one commit or checkpoint at a time
+
+static pthread_t committer;
+static int committer_running = 0;
+
+
+static int list_add(IntList *l, int x) {
+    if (l->n == l->max) {
+        int max = l->max ? 2 * l->max : 64;
+        int *v = realloc(l->v, max * sizeof(int));
+        if (v == NULL)
+            return -1;
+        l->v = v;
+        l->max = max;
+    }
+    l->v[l->n++] = x;
+    return 0;
+}
+
+static void tx_start(Transaction *tx) {
+    memset(tx, 0, sizeof(Transaction));
+    tx->tid = next_tid++;
+    if (next_tid == 0)
+        next_tid = 1;
+}
+
+static void tx_free(Transaction *tx) {
+    free(tx->blocks.v);
+    free(tx->revoked.v);
+    free(tx->freed.v);
+}
+
+// Has the transaction tagged tid made it to the log? Tags wrap around.
+static int tid_done(unsigned tid) {
+    return (int)(committed_tid - tid) >= 0;
+}
+
+static uint32_t crc_table[256];
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *buf, size_t len) {
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ (unsigned char)buf[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+static int desc_count(int nblocks, int nrevoked) {
+    int entries = nblocks + nrevoked;
+    return entries == 0 ? 1 : (entries + (int)JOURNAL_DESC_ENTRIES - 1) / (int)JOURNAL_DESC_ENTRIES;
+}
+
+
+/*
+ * logged set, open addressing keyed on block number; caller holds tx_lock
+ */
+static LogSlot *logged_find(int blk) {
+    unsigned h = (unsigned)blk * 2654435761u & (logged_size - 1);
+    while (logged[h].blk != -1 && logged[h].blk != blk)
+        h = (h + 1) & (logged_size - 1);
+    return &logged[h];
+}
+
+static int logged_alloc(int size) {
+    logged = malloc(size * sizeof(LogSlot));
+    if (logged == NULL)
+        return -1;
+    for (int i = 0; i < size; i++)
+        logged[i].blk = -1;
+    logged_size = size;
+    logged_count = 0;
+    return 0;
+}
+
+// Rebuild the set at twice the size (grow), or keeping only blocks of
+// transactions not yet committed (after a checkpoint)
+static int logged_rehash(int grow) {
+    LogSlot *old = logged;
+    int old_size = logged_size;
+    if (logged_alloc(grow ? 2 * old_size : old_size) != 0) {
+        logged = old;
+        logged_size = old_size;
+        return -1;
+    }
+
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].blk == -1 || (!grow && tid_done(old[i].tid)))
+            continue;
+        *logged_find(old[i].blk) = old[i];
+        logged_count++;
+    }
+    free(old);
+    return 0;
+}
+
+static int logged_put(int blk, unsigned tid) {
+    if (2 * (logged_count + 1) > logged_size && logged_rehash(1) != 0)
+        return -1;
+    LogSlot *s = logged_find(blk);
+    if (s->blk == -1)
+        logged_count++;
+    s->blk = blk;
+    s->tid = tid;
+    return 0;
+}
+
+
+static int super_write(uint64_t tail_seq, int tail) {
+    char buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    struct journal_super *js = (struct journal_super*) buf;
+    js->magic = JOURNAL_MAGIC;
+    js->blocks = jblocks;
+    js->tail_seq = tail_seq;
+    js->tail = tail;
+    return bio_write(jstart, buf) > 0 ? 0 : -1;
+}
+
+/*
+ * Lay out an empty journal of blocks blocks at block start (mkfs)
+ */
+int journal_format(int start, int blocks) {
+    jstart = start;
+    jblocks = blocks;
+    return super_write(1, 1);
+}
+
+/*
+ * Write every committed block home and empty the log. Caller holds
+ * commit_lock, so no transaction is halfway into the log.
+ */
+static int checkpoint_locked() {
+
+    // Step 1: Blocks of committed transactions are unpinned, flushing the
+    // cache sends them home; make that durable before the log lets go
+    if (cache_flush() != 0 || dev_sync() != 0)
+        return -1;
+
+    // Step 2: Empty the log
+    if (super_write(next_seq, 1) != 0 || dev_sync() != 0)
+        return -1;
+    head = 1;
+    used = 0;
+
+    // Step 3: Nothing checkpointed can be replayed any more, so frees of
+    // those blocks need no revoke record
+    pthread_mutex_lock(&tx_lock);
+    logged_rehash(0);
+    pthread_mutex_unlock(&tx_lock);
+    return 0;
+}
+
+/*
+ * Put a transaction in the log: descriptors, the copies in buf, the commit
+ * block, then a barrier. buf has room for the descriptors in front.
+ */
+static int log_write(Transaction *tx, char *buf, int ndesc, int nrevoked) {
+    int n = tx->blocks.n;
+    int len = ndesc + n + 1;
+
+    // Step 1: Fill in the descriptors, logged blocks first then revoked ones
+    for (int d = 0; d < ndesc; d++) {
+        char *desc = buf + (size_t)d * BLOCK_SIZE;
+        memset(desc, 0, BLOCK_SIZE);
+        struct journal_head *h = (struct journal_head*) desc;
+        h->magic = JOURNAL_MAGIC;
+        h->type = JBLK_DESC;
+        h->seq = next_seq;
+        h->nblocks = n;
+        h->nrevoked = nrevoked;
+
+        uint32_t *entries = (uint32_t*)(desc + sizeof(struct journal_head));
+        for (int i = 0; i < (int)JOURNAL_DESC_ENTRIES; i++) {
+            int k = d * JOURNAL_DESC_ENTRIES + i;
+            if (k < n)
+                entries[i] = tx->blocks.v[k];
+            else if (k < n + nrevoked)
+                entries[i] = tx->revoked.v[k - n];
+        }
+    }
+
+    // Step 2: The commit block vouches for everything in front of it
+    char *commit = buf + (size_t)(len - 1) * BLOCK_SIZE;
+    memset(commit, 0, BLOCK_SIZE);
+    struct journal_head *c = (struct journal_head*) commit;
+    c->magic = JOURNAL_MAGIC;
+    c->type = JBLK_COMMIT;
+    c->seq = next_seq;
+    c->nblocks = n;
+    c->nrevoked = nrevoked;
+    c->checksum = crc32(buf, (size_t)(len - 1) * BLOCK_SIZE);
+
+    // Step 3: Find room, a transaction is never split across the end
+    int skip = (head + len > jblocks) ? jblocks - head : 0;
+    if (used + skip + len > jblocks - 1) {
+        if (checkpoint_locked() != 0)
+            return -1;
+        skip = 0;
+    }
+    if (head + len > jblocks) {
+        used += skip;
+        head = 1;
+    }
+
+    // Step 4: Write it and wait until it is durable
+    if (bio_write_range(jstart + head, len, buf) != len * BLOCK_SIZE || dev_sync() != 0)
+        return -1;
+    head += len;
+    used += len;
+    next_seq++;
+    return 0;
+}
+
+/*
+ * Commit the running transaction. Caller holds commit_lock. Returns 1
+ * once it is durable, 0 if there was nothing to log, -1 on error. A
+ * transaction that doesn't reach the log aborts the journal.
+ */
+static int commit_locked() {
+    if (aborted)
+        return -1;
+
+    // Step 1: Wait for the operations in flight, move in-core metadata into
+    // blocks and close the running transaction
+    pthread_rwlock_wrlock(&op_lock);
+    if (prepare_fn != NULL)
+        prepare_fn();
+
+    pthread_mutex_lock(&tx_lock);
+    Transaction tx = running;
+    tx_start(&running);
+    __atomic_store_n(&commit_wanted, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tx_lock);
+
+    int n = tx.blocks.n;
+    int nrevoked = tx.revoked.n;
+    int ndesc = desc_count(n, nrevoked);
+    int overflow = 0, in_place = 0;
+
+    // too many revokes: leave them out and checkpoint once committed, so
+    // the log holds no copy of a freed block
+    if (ndesc + n + 1 > jblocks - 1) {
+        nrevoked = 0;
+        ndesc = desc_count(n, 0);
+        overflow = 1;
+    }
+    if (ndesc + n + 1 > jblocks - 1) {
+        fprintf(stderr, "journal: %d block transaction doesn't fit, written in place\n", n);
+        in_place = 1;
+    }
+
+    // Step 2: Copy the blocks while nothing can change them; operations
+    // carry on into the next transaction from here
+    char *buf = NULL;
+    int ret = 0;
+    if (n > 0 || nrevoked > 0) {
+        buf = malloc((size_t)(ndesc + n + 1) * BLOCK_SIZE);
+        for (int i = 0; buf != NULL && i < n; i++) {
+            if (cache_read(tx.blocks.v[i], buf + (size_t)(ndesc + i) * BLOCK_SIZE) <= 0)
+                ret = -1;
+        }
+        if (buf == NULL)
+            ret = -1;
+    }
+    pthread_rwlock_unlock(&op_lock);
+
+    // Step 3: Log it
+    if (ret == 0 && buf != NULL && !in_place && log_write(&tx, buf, ndesc, nrevoked) != 0) {
+        perror("journal commit failed");
+        ret = -1;
+    }
+
+    // Not in the log: its blocks stay pinned, since writing them home would
+    // tear the transaction, and so does everything after it
+    if (ret != 0) {
+        fprintf(stderr, "journal: transaction %u lost, journal aborted\n", tx.tid);
+        pthread_mutex_lock(&tx_lock);
+        aborted = 1;
+        pthread_mutex_unlock(&tx_lock);
+        free(buf);
+        tx_free(&tx);
+        return -1;
+    }
+
+    // Step 4: The blocks may go home now
+    for (int i = 0; i < n; i++) {
+        const char *copy = (buf != NULL) ? buf + (size_t)(ndesc + i) * BLOCK_SIZE : NULL;
+        if (cache_unpin(tx.blocks.v[i], tx.tid, copy) != 0)
+            ret = -1;
+    }
+    committed_tid = tx.tid;
+
+    if ((overflow || in_place) && checkpoint_locked() != 0)
+        ret = -1;
+
+    // Step 5: Blocks the transaction freed can be handed out again
+    for (int i = 0; i + 1 < tx.freed.n; i += 2)
+        release_fn(tx.freed.v[i], tx.freed.v[i + 1]);
+
+    if (ret == 0 && buf != NULL) {
+        METRIC_COUNT(MC_JOURNAL_COMMITS, 1);
+        ret = 1;
+    }
+    free(buf);
+    tx_free(&tx);
+    return ret;
+}
+
+static void *committer_main(void *arg) {
+    pthread_mutex_lock(&tx_lock);
+    while (committer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_COMMIT_INTERVAL;
+
+        pthread_cond_timedwait(&tx_cond, &tx_lock, &deadline);
+        if (!committer_running)
+            break;
+        pthread_mutex_unlock(&tx_lock);
+
+        pthread_mutex_lock(&commit_lock);
+        commit_locked();
+        // checkpoint while the log is half full, before a commit has to wait for it
+        if (used > (jblocks - 1) / 2)
+            checkpoint_locked();
+        pthread_mutex_unlock(&commit_lock);
+
+        pthread_mutex_lock(&tx_lock);
+    }
+    pthread_mutex_unlock(&tx_lock);
+    return NULL;
+}
+
+
+/*
+ * Read the descriptor of the transaction expected at pos, 0 if there is none
+ */
+static int replay_head(int pos, uint64_t seq, struct journal_head *h) {
+    char buf[BLOCK_SIZE];
+    if (pos < 1 || pos >= jblocks || bio_read(jstart + pos, buf) <= 0)
+        return 0;
+    memcpy(h, buf, sizeof(struct journal_head));
+    return h->magic == JOURNAL_MAGIC && h->type == JBLK_DESC && h->seq == seq;
+}
+
+typedef struct Revoke {
+    int blk;
+    uint64_t seq;
+} Revoke;
+
+static int cmp_revoke(const void *a, const void *b) {
+    const Revoke *x = a, *y = b;
+    if (x->blk != y->blk)
+        return x->blk < y->blk ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// Was blk freed by transaction seq or a later one?
+static int revoked_since(Revoke *r, int nr, int blk, uint64_t seq) {
+    int lo = 0, hi = nr;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r[mid].blk <= blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // lo - 1 is the last, latest revoke of blk if there is one
+    return lo > 0 && r[lo - 1].blk == blk && r[lo - 1].seq >= seq;
+}
+
+typedef struct Replayed {
+    char *buf;          // the whole transaction as read from the log
+    uint64_t seq;
+    int ndesc;
+    int nblocks;
+} Replayed;
+
+/*
+ * Bring the home blocks up to date with every committed transaction in
+ * the log, then empty it
+ */
+static int replay() {
+    char sbuf[BLOCK_SIZE];
+    if (bio_read(jstart, sbuf) <= 0)
+        return -1;
+    struct journal_super js;
+    memcpy(&js, sbuf, sizeof(js));
+    if (js.magic != JOURNAL_MAGIC || (int)js.blocks != jblocks) {
+        fprintf(stderr, "journal superblock is damaged\n");
+        return -1;
+    }
+
+    // Step 1: Read the chain of transactions from the tail, one read each,
+    // up to the first one that is missing or torn
+    Replayed *txs = NULL;
+    int ntx = 0;
+    Revoke *revokes = NULL;
+    int nrevokes = 0;
+    uint64_t seq = js.tail_seq;
+    int pos = js.tail;
+
+    for (;;) {
+        struct journal_head h;
+        if (!replay_head(pos, seq, &h)) {
+            // the transaction didn't fit before the end, it starts over at the front
+            if (pos == 1 || !replay_head(1, seq, &h))
+                break;
+            pos = 1;
+        }
+
+        int ndesc = desc_count(h.nblocks, h.nrevoked);
+        int len = ndesc + h.nblocks + 1;
+        if (pos + len > jblocks)
+            break;
+
+        char *buf = malloc((size_t)len * BLOCK_SIZE);
+        if (buf == NULL || bio_read_range(jstart + pos, len, buf) != len * BLOCK_SIZE) {
+            free(buf);
+            break;
+        }
+
+        struct journal_head *c = (struct journal_head*)(buf + (size_t)(len - 1) * BLOCK_SIZE);
+        if (c->magic != JOURNAL_MAGIC || c->type != JBLK_COMMIT || c->seq != seq
+            || c->checksum != crc32(buf, (size_t)(len - 1) * BLOCK_SIZE)) {
+            free(buf);
+            break;
+        }
+
+        Replayed *t = realloc(txs, (ntx + 1) * sizeof(Replayed));
+        Revoke *r = realloc(revokes, (nrevokes + h.nrevoked + 1) * sizeof(Revoke));
+        if (t != NULL)
+            txs = t;
+        if (r != NULL)
+            revokes = r;
+        if (t == NULL || r == NULL) {
+            free(buf);
+            break;
+        }
+
+        txs[ntx].buf = buf;
+        txs[ntx].seq = seq;
+        txs[ntx].ndesc = ndesc;
+        txs[ntx++].nblocks = h.nblocks;
+        for (uint32_t k = h.nblocks; k < h.nblocks + h.nrevoked; k++) {
+            char *desc = buf + (size_t)(k / JOURNAL_DESC_ENTRIES) * BLOCK_SIZE;
+            revokes[nrevokes].blk = ((uint32_t*)(desc + sizeof(struct journal_head)))[k % JOURNAL_DESC_ENTRIES];
+            revokes[nrevokes++].seq = seq;
+        }
+
+        pos += len;
+        seq++;
+    }
+
+    // Step 2: Write the logged copies home in log order, skipping those
+    // freed since, and make them durable
+    qsort(revokes, nrevokes, sizeof(Revoke), cmp_revoke);
+    int ret = 0;
+    for (int t = 0; t < ntx; t++) {
+        for (int k = 0; k < txs[t].nblocks; k++) {
+            char *desc = txs[t].buf + (size_t)(k / JOURNAL_DESC_ENTRIES) * BLOCK_SIZE;
+            int blk = ((uint32_t*)(desc + sizeof(struct journal_head)))[k % JOURNAL_DESC_ENTRIES];
+            if (revoked_since(revokes, nrevokes, blk, txs[t].seq))
+                continue;
+            if (cache_write(blk, txs[t].buf + (size_t)(txs[t].ndesc + k) * BLOCK_SIZE) <= 0)
+                ret = -1;
+        }
+        free(txs[t].buf);
+    }
+    free(txs);
+    free(revokes);
+
+    if (ret != 0 || cache_flush() != 0 || dev_sync() != 0)
+        return -1;
+    if (ntx > 0)
+        fprintf(stderr, "journal: replayed %d transactions\n", ntx);
+
+    // Step 3: Empty the log. A torn transaction may have used seq, skip it.
+    next_seq = seq + 1;
+    head = 1;
+    used = 0;
+    if (super_write(next_seq, 1) != 0 || dev_sync() != 0)
+        return -1;
+    return 0;
+}
+
+static void op_lock_init() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&op_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+/*
+ * Replay the journal at block start and start logging. prepare is called
+ * before each commit to write in-core metadata back with journal_write();
+ * release frees a run of blocks once the transaction freeing them is
+ * committed.
+ */
+int journal_open(int start, int blocks, int (*prepare)(), void (*release)(int, int)) {
+    if (jopen) {
+        return 0;
+    }
+
+    pthread_once(&op_lock_once, op_lock_init);
+    crc_init();
+    jstart = start;
+    jblocks = blocks;
+    // a commit is forced with half the log left for what operations in
+    // flight add, so the transaction still fits
+    tx_max = (JOURNAL_TX_MAX < (blocks - 1) / 2) ? JOURNAL_TX_MAX : (blocks - 1) / 2;
+    prepare_fn = prepare;
+    release_fn = release;
+
+    if (replay() != 0)
+        return -1;
+
+    if (logged_alloc(1024) != 0)
+        return -1;
+    next_tid = 1;
+    committed_tid = 0;
+    aborted = 0;
+    tx_start(&running);
+    jopen = 1;
+
+    committer_running = 1;
+    if (pthread_create(&committer, NULL, committer_main, NULL) != 0) {
+        perror("journal thread failed");
+        committer_running = 0;
+    }
+    return 0;
+}
+
+/*
+ * Commit what is left, checkpoint and stop logging
+ */
+void journal_close() {
+    if (!jopen) {
+        return;
+    }
+
+    pthread_mutex_lock(&tx_lock);
+    int was_running = committer_running;
+    committer_running = 0;
+    pthread_cond_signal(&tx_cond);
+    pthread_mutex_unlock(&tx_lock);
+
+    if (was_running)
+        pthread_join(committer, NULL);
+
+    pthread_mutex_lock(&commit_lock);
+    commit_locked();
+    checkpoint_locked();
+    pthread_mutex_unlock(&commit_lock);
+
+    jopen = 0;
+    tx_free(&running);
+    free(logged);
+    logged = NULL;
+}
+
+/*
+ * Bracket an operation that changes metadata, before it takes any other
+ * lock. Calls nest.
+ */
+void journal_begin() {
+    if (op_depth++ == 0)
+        pthread_rwlock_rdlock(&op_lock);
+}
+
+void journal_end() {
+    if (--op_depth > 0)
+        return;
+    pthread_rwlock_unlock(&op_lock);
+
+    // the transaction grew too big for the cache to hold it back; set
+    // under tx_lock, a stale read only delays the commit to the next end
+    if (__atomic_load_n(&commit_wanted, __ATOMIC_RELAXED))
+        journal_commit();
+}
+
+/*
+ * Write a metadata block as part of the running transaction. Before the
+ * journal is open this is a plain cache_write().
+ */
+int journal_write(const int block_num, const void *buf) {
+    if (!jopen)
+        return cache_write(block_num, buf);
+
+    pthread_mutex_lock(&tx_lock);
+    if (aborted) {
+        pthread_mutex_unlock(&tx_lock);
+        return -1;
+    }
+
+    // pinned under tx_lock, so it can't land in a transaction that is
+    // already being copied
+    int pinned = cache_write_pinned(block_num, buf, running.tid);
+    if (pinned < 0) {
+        pthread_mutex_unlock(&tx_lock);
+        return -1;
+    }
+
+    LogSlot *s = logged_find(block_num);
+    if (s->blk != block_num || s->tid != running.tid) {
+        if (logged_put(block_num, running.tid) != 0 || list_add(&running.blocks, block_num) != 0) {
+            pthread_mutex_unlock(&tx_lock);
+            return -1;
+        }
+    }
+
+    if (!commit_wanted && (running.blocks.n >= tx_max || pinned > JOURNAL_SHARD_PINS)) {
+        __atomic_store_n(&commit_wanted, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&tx_cond);
+    }
+
+    pthread_mutex_unlock(&tx_lock);
+    return BLOCK_SIZE;
+}
+
+/*
+ * Free count blocks from block_num on behalf of the running transaction.
+ * They are released only once the transaction is committed, so they
+ * can't be reused and overwritten while the free could still be lost. Returns 0 if the
+ * journal isn't open and the caller should release it itself.
+ */
+int journal_free(const int block_num, const int count) {
+    if (!jopen)
+        return 0;
+
+    pthread_mutex_lock(&tx_lock);
+
+    // a copy in the log must not be replayed over the block's next use
+    for (int k = 0; k < count && logged_count > 0; k++) {
+        if (logged_find(block_num + k)->blk == block_num + k)
+            list_add(&running.revoked, block_num + k);
+    }
+
+    IntList *f = &running.freed;
+    if (f->n > 0 && f->v[f->n - 2] + f->v[f->n - 1] == block_num) {
+        f->v[f->n - 1] += count;
+    } else if (list_add(f, block_num) != 0 || list_add(f, count) != 0) {
+        f->n &= ~1;
+        pthread_mutex_unlock(&tx_lock);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&tx_lock);
+    return 1;
+}
+
+/*
+ * Make everything done so far durable. Callers arriving while a commit
+ * is in flight share the next one, and those whose work a commit already
+ * carried return at once.
+ */
+int journal_commit() {
+    if (!jopen || op_depth > 0)
+        return 0;
+
+    pthread_mutex_lock(&tx_lock);
+    unsigned want = running.tid;
+    pthread_mutex_unlock(&tx_lock);
+
+    pthread_mutex_lock(&commit_lock);
+    int ret = 0;
+    if (!tid_done(want))
+        ret = commit_locked();
+    pthread_mutex_unlock(&commit_lock);
+    return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Commit the running transaction if it freed blocks, so an allocation
+ * that failed can find them. Returns 1 if it is worth retrying.
+ */
+int journal_reclaim() {
+    if (!jopen || op_depth > 0)
+        return 0;
+
+    pthread_mutex_lock(&tx_lock);
+    int freed = running.freed.n > 0;
+    pthread_mutex_unlock(&tx_lock);
+
+    return freed && journal_commit() == 0;
+}
+
+/*
+ * The running transaction, for a later journal_sync()
+ */
+unsigned journal_tid() {
+    if (!jopen)
+        return 0;
+
+    pthread_mutex_lock(&tx_lock);
+    unsigned tid = running.tid;
+    pthread_mutex_unlock(&tx_lock);
+    return tid;
+}
+
+/*
+ * Make transaction tid durable, along with every write issued before
+ * the call. If tid is still open a commit does both; otherwise, or if
+ * a commit by another caller carried it, a barrier is still needed for
+ * the writes.
+ */
+int journal_sync(unsigned tid) {
+    if (jopen && op_depth == 0) {
+        pthread_mutex_lock(&commit_lock);
+        int ret = 0;
+        if (!tid_done(tid))
+            ret = commit_locked();
+        pthread_mutex_unlock(&commit_lock);
+        if (ret != 0)
+            return (ret < 0) ? -1 : 0;
+    }
+    return dev_sync();
+}
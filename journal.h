@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#include "block.h"
+
+#define JOURNAL_MAGIC			0x4A524E4C	/* "JRNL" */
+#define JOURNAL_DEFAULT_BLOCKS	1024		/* journal made by mkfs (4MB) */
+#define JOURNAL_MIN_BLOCKS		256			/* half of it holds a transaction forced at the size below */
+#define JOURNAL_COMMIT_INTERVAL	1			/* seconds between background commits */
+#define JOURNAL_TX_MAX			256			/* logged blocks before a commit is forced */
+
+#define JBLK_DESC		1	/* lists the blocks of a transaction */
+#define JBLK_COMMIT		2	/* closes a transaction */
+
+/*
+ * The journal is a circular log of transactions, each laid out as
+ *
+ *   | descriptor blocks | logged blocks ... | commit block |
+ *
+ * The descriptors list the home block of every logged block, then the
+ * blocks the transaction freed (revoked): older copies of those must not
+ * be replayed over whatever the block holds now. The commit block carries
+ * a checksum of everything before it, so a torn transaction is ignored.
+ */
+struct journal_super {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	blocks;				/* journal size, this block included */
+	uint64_t	tail_seq;			/* sequence number of the first transaction to replay */
+	uint32_t	tail;				/* its first block, relative to the journal */
+};
+
+struct journal_head {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	type;				/* JBLK_DESC or JBLK_COMMIT */
+	uint64_t	seq;				/* transaction sequence number */
+	uint32_t	nblocks;			/* blocks logged */
+	uint32_t	nrevoked;			/* blocks revoked */
+	uint32_t	checksum;			/* commit block: crc32 of the transaction */
+};
+
+/* home block numbers held by each descriptor block, after its head */
+#define JOURNAL_DESC_ENTRIES	((BLOCK_SIZE - sizeof(struct journal_head)) / sizeof(uint32_t))
+
+int journal_format(int start, int blocks);
+int journal_open(int start, int blocks, int (*prepare)(), void (*release)(int, int));
+void journal_close();
+void journal_begin();
+void journal_end();
+int journal_write(const int block_num, const void *buf);
+int journal_free(const int block_num, const int count);
+int journal_commit();
+int journal_reclaim();
+unsigned journal_tid();
+int journal_sync(unsigned tid);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	metrics.c
+ *
+ *	Operation counters and latency histograms, served in the Prometheus
+ *	text format on a Unix socket (--metrics-socket=PATH), e.g.
+ *
+ *	  curl --unix-socket PATH http://rufs/metrics
+ *
+ *	Each FUSE operation is timed into a log-linear (HDR-style) histogram:
+ *	exact below 2^HIST_SUB_BITS ns, then 2^HIST_SUB_BITS buckets per power
+ *	of two. Counters are kept in METRICS_SHARDS cache-aligned copies, each
+ *	thread updating its own, and summed only when scraped.
+ *
+ *	Built without RUFS_METRICS, the METRIC_* macros compile to nothing.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#ifdef RUFS_METRICS
+
+typedef struct MetricShard {
+    uint64_t op_count[NUM_OPS];
+    uint64_t op_nsec[NUM_OPS];              // total time, the histogram's _sum
+    uint64_t op_bytes[NUM_OPS];
+    uint64_t hist[NUM_OPS][HIST_BUCKETS];
+    uint64_t counters[NUM_COUNTERS];
+} __attribute__((aligned(64))) MetricShard;
+
+static MetricShard shards[METRICS_SHARDS];
+static unsigned next_shard = 0;
+static __thread MetricShard *my_shard = NULL;
+
+static const char *op_names[NUM_OPS] = {
+    "lookup", "forget", "getattr", "setattr",
+    "opendir", "readdir", "releasedir", "fsyncdir",
+    "mkdir", "rmdir", "create", "unlink",
+    "open", "read", "write", "flush", "release", "fsync",
+    "truncate", "fallocate", "lseek", "utimens",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[NUM_COUNTERS] = {
+    { "rufs_bio_reads_total", "Disk reads issued by the block layer." },
+    { "rufs_bio_read_bytes_total", "Bytes read from the disk." },
+    { "rufs_bio_writes_total", "Disk writes issued by the block layer." },
+    { "rufs_bio_write_bytes_total", "Bytes written to the disk." },
+    { "rufs_cache_hits_total", "Block reads served by the block cache." },
+    { "rufs_cache_misses_total", "Block reads that missed the block cache." },
+    { "rufs_dev_syncs_total", "Durability barriers asked for." },
+    { "rufs_dev_flushes_total", "Durability barriers issued, after coalescing." },
+    { "rufs_journal_commits_total", "Journal transactions committed." },
+};
+
+// Each thread sticks to one shard, handed out round robin
+static MetricShard *shard() {
+    if (my_shard == NULL)
+        my_shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS];
+    return my_shard;
+}
+
+static void add(uint64_t *c, uint64_t n) {
+    __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(const uint64_t *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static int hist_bucket(uint64_t ns) {
+    if (ns < (1 << HIST_SUB_BITS))
+        return ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest latency falling in bucket b
+static uint64_t hist_upper(int b) {
+    if (b < (1 << HIST_SUB_BITS))
+        return b;
+
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return (((uint64_t)(1 << HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+struct metric_timer metric_op_begin(int op) {
+    struct metric_timer t;
+    t.op = op;
+    clock_gettime(CLOCK_MONOTONIC, &t.start);
+    return t;
+}
+
+void metric_op_end(struct metric_timer *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)(now.tv_sec - t->start.tv_sec) * 1000000000ULL + now.tv_nsec - t->start.tv_nsec;
+
+    MetricShard *sh = shard();
+    add(&sh->op_count[t->op], 1);
+    add(&sh->op_nsec[t->op], ns);
+    add(&sh->hist[t->op][hist_bucket(ns)], 1);
+}
+
+void metric_op_bytes(int op, uint64_t bytes) {
+    add(&shard()->op_bytes[op], bytes);
+}
+
+void metric_count(int counter, uint64_t n) {
+    add(&shard()->counters[counter], n);
+}
+
+/*
+ * Render every metric, summed over the shards, in the Prometheus text
+ * exposition format. The caller frees *text.
+ */
+int metrics_format(char **text, size_t *len) {
+    static uint64_t hist[NUM_OPS][HIST_BUCKETS];
+    static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t count[NUM_OPS] = { 0 }, nsec[NUM_OPS] = { 0 }, bytes[NUM_OPS] = { 0 };
+    uint64_t counters[NUM_COUNTERS] = { 0 };
+
+    FILE *f = open_memstream(text, len);
+    if (f == NULL)
+        return -1;
+
+    // Step 1: Sum the shards; the totals may be a few events apart, which
+    // a scrape doesn't mind
+    pthread_mutex_lock(&format_lock);
+    memset(hist, 0, sizeof(hist));
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            count[op] += get(&shards[s].op_count[op]);
+            nsec[op] += get(&shards[s].op_nsec[op]);
+            bytes[op] += get(&shards[s].op_bytes[op]);
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                hist[op][b] += get(&shards[s].hist[op][b]);
+        }
+        for (int c = 0; c < NUM_COUNTERS; c++)
+            counters[c] += get(&shards[s].counters[c]);
+    }
+
+    // Step 2: Operation counts and bytes
+    fprintf(f, "# HELP rufs_op_total FUSE operations completed.\n# TYPE rufs_op_total counter\n");
+    for (int op = 0; op < NUM_OPS; op++)
+        fprintf(f, "rufs_op_total{op=\"%s\"} %lu\n", op_names[op], count[op]);
+
+    fprintf(f, "# HELP rufs_op_bytes_total Bytes read and written by FUSE operations.\n# TYPE rufs_op_bytes_total counter\n");
+    fprintf(f, "rufs_op_bytes_total{op=\"read\"} %lu\n", bytes[OP_READ]);
+    fprintf(f, "rufs_op_bytes_total{op=\"write\"} %lu\n", bytes[OP_WRITE]);
+
+    // Step 3: Latency histograms, at power-of-two bounds from 1us to 16s
+    fprintf(f, "# HELP rufs_op_duration_seconds Latency of FUSE operations.\n# TYPE rufs_op_duration_seconds histogram\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (count[op] == 0)
+            continue;
+
+        uint64_t below = 0;
+        int b = 0;
+        for (int bits = 10; bits <= 34; bits++) {
+            for (; b < HIST_BUCKETS && hist_upper(b) < (1ULL << bits); b++)
+                below += hist[op][b];
+            fprintf(f, "rufs_op_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %lu\n", op_names[op], (double)(1ULL << bits) / 1e9, below);
+        }
+        fprintf(f, "rufs_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", op_names[op], count[op]);
+        fprintf(f, "rufs_op_duration_seconds_sum{op=\"%s\"} %.9f\n", op_names[op], nsec[op] / 1e9);
+        fprintf(f, "rufs_op_duration_seconds_count{op=\"%s\"} %lu\n", op_names[op], count[op]);
+    }
+
+    // Step 4: Quantiles from the full-resolution histogram
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    fprintf(f, "# HELP rufs_op_latency_seconds Latency quantiles of FUSE operations since mount.\n# TYPE rufs_op_latency_seconds gauge\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (count[op] == 0)
+            continue;
+
+        uint64_t seen = 0;
+        int b = 0;
+        for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * count[op] + 0.5);
+            if (rank == 0)
+                rank = 1;
+            while (b < HIST_BUCKETS - 1 && seen + hist[op][b] < rank)
+                seen += hist[op][b++];
+            fprintf(f, "rufs_op_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9g\n", op_names[op], quantiles[q], hist_upper(b) / 1e9);
+        }
+    }
+    pthread_mutex_unlock(&format_lock);
+
+    // Step 5: Block layer, cache and journal counters
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_info[c].name, counter_info[c].help,
+                counter_info[c].name, counter_info[c].name, counters[c]);
+
+    return (fclose(f) == 0) ? 0 : -1;
+}
+
+static int listen_fd = -1;
+static pthread_t server;
+static char server_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Answer every connection with the metrics as an HTTP/1.0 response, so
+ * both curl --unix-socket and a plain nc -U can scrape them
+ */
+static void *metrics_server(void *arg) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (fd < 0)
+            break;      // shut down by metrics_stop()
+
+        // Step 1: Take in the request, whatever it asks for, so closing
+        // doesn't reset the connection under the client
+        struct timeval tv = { 0, 200000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) {
+            ssize_t n = recv(fd, req + got, sizeof(req) - 1 - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+                break;
+        }
+
+        // Step 2: Send the metrics
+        char *text;
+        size_t len;
+        if (metrics_format(&text, &len) == 0) {
+            char head[160];
+            int n = snprintf(head, sizeof(head),
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+            if (send_all(fd, head, n) == 0)
+                send_all(fd, text, len);
+            free(text);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Serve the metrics on a Unix socket at socket_path, replacing a stale one
+ */
+int metrics_serve(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("metrics socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 8) != 0) {
+        perror("metrics socket");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    strcpy(server_path, socket_path);
+
+    if (pthread_create(&server, NULL, metrics_server, NULL) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(server_path);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop() {
+    if (listen_fd < 0)
+        return;
+
+    // wakes the server out of accept()
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(server_path);
+}
+
+#else
+
+int metrics_format(char **text, size_t *len) {
+    return -1;
+}
+
+int metrics_serve(const char *socket_path) {
+    fprintf(stderr, "rufs was built without metrics (make METRICS=1)\n");
+    return -1;
+}
+
+void metrics_stop() {
+}
+
+#endif
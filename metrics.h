@@ -0,0 +1,80 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	metrics.h
+ *
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_SHARDS		8		/* counter copies, picked per thread */
+#define HIST_SUB_BITS		3		/* 8 buckets per power of two (~12% error) */
+#define HIST_MAX_BITS		40		/* latencies up to 2^40ns (~18 min) */
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* FUSE operations, timed from entry to return */
+enum metric_op {
+	OP_LOOKUP, OP_FORGET, OP_GETATTR, OP_SETATTR,
+	OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_FSYNCDIR,
+	OP_MKDIR, OP_RMDIR, OP_CREATE, OP_UNLINK,
+	OP_OPEN, OP_READ, OP_WRITE, OP_FLUSH, OP_RELEASE, OP_FSYNC,
+	OP_TRUNCATE, OP_FALLOCATE, OP_LSEEK, OP_UTIMENS,
+	NUM_OPS
+};
+
+/* Plain event counters */
+enum metric_counter {
+	MC_BIO_READS, MC_BIO_READ_BYTES,		/* bio_read*() calls and bytes */
+	MC_BIO_WRITES, MC_BIO_WRITE_BYTES,		/* bio_write*() calls and bytes */
+	MC_CACHE_HITS, MC_CACHE_MISSES,			/* block reads through the cache */
+	MC_DEV_SYNCS, MC_DEV_FLUSHES,			/* barriers asked for, and issued */
+	MC_JOURNAL_COMMITS,
+	NUM_COUNTERS
+};
+
+#ifdef RUFS_METRICS
+
+struct metric_timer {
+	int op;
+	struct timespec start;
+};
+
+struct metric_timer metric_op_begin(int op);
+void metric_op_end(struct metric_timer *t);
+void metric_op_bytes(int op, uint64_t bytes);
+void metric_count(int counter, uint64_t n);
+
+/*
+ * Time the rest of the enclosing block as one call of op; the timer
+ * stops on whichever return leaves it
+ */
+#define METRIC_OP(op) \
+	struct metric_timer metric_timer_ __attribute__((cleanup(metric_op_end))) = metric_op_begin(op)
+#define METRIC_BYTES(op, n)		metric_op_bytes(op, n)
+#define METRIC_COUNT(c, n)		metric_count(c, n)
+
+#else
+
+#define METRIC_OP(op)			do { } while (0)
+#define METRIC_BYTES(op, n)		do { } while (0)
+#define METRIC_COUNT(c, n)		do { } while (0)
+
+#endif
+
+/* Debug chatter, compiled in with RUFS_TRACE */
+#ifdef RUFS_TRACE
+#include <stdio.h>
+#define TRACE(...)				fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE(...)				do { } while (0)
+#endif
+
+int metrics_format(char **text, size_t *len);
+int metrics_serve(const char *socket_path);
+void metrics_stop();
+
+#endif
@@ -5,9 +5,6 @@
  *
  */
 
-#define FUSE_USE_VERSION 26
-
-#include <fuse.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,9 +16,16 @@
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "cache.h"
+#include "journal.h"
+#include "metrics.h"
 #include "rufs.h"
+#include "rufs_ops.h"
 
 char diskfile_path[PATH_MAX];
 
@@ -79,860 +83,2251 @@ char diskfile_path[PATH_MAX];
 //     return count;
 // }
 
-typedef struct LastDirent {
-    int last_block ;
-    int last_offset;
-} LastDirent;
+#define INODE_SIZE sizeof(struct inode) // Size of an inode
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE) // inodes per blocks
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8) // bitmap bits per block
 
-LastDirent* inodeMap[MAX_INUM] = {NULL};
+// Geometry of a new image, set from the command line (see rufs_parse_opts)
+uint64_t mkfs_disk_size = DEFAULT_DISK_SIZE;
+uint64_t mkfs_num_inodes = DEFAULT_NUM_INODES;
+uint64_t mkfs_journal_blocks = JOURNAL_DEFAULT_BLOCKS;
 
 
 
-#define INODE_SIZE sizeof(struct inode) // Size of an inode
-#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE) // inodes per blocks
+struct superblock *sb;
 
-int num_of_inode_blocks = (MAX_INUM * sizeof(struct inode) ) / BLOCK_SIZE;
+// Scratch buffers are per thread so FUSE callbacks can run in parallel
+__thread char block[BLOCK_SIZE];
+__thread char first_block[BLOCK_SIZE];
 
 
-struct superblock *sb;
-void* block;
-void* first_block;
+/*
+ * block groups
+ *
+ * Past the superblock the disk is cut into groups of BITS_PER_BLOCK
+ * blocks, each laid out as
+ *
+ *   | data bitmap | inode bitmap | inode table slice | data blocks ... |
+ *
+ * with the superblock and the journal in front of group 0's. A group's
+ * data bitmap covers every block of the group, its own metadata
+ * included, so data block numbers are plain disk block numbers; its
+ * inode bitmap covers the group's inodes_per_group inodes. Files are
+ * kept in the group of their inode, so their bitmaps stay short to scan
+ * and their data close to the inode.
+ *
+ * Both bitmaps live in memory as the source of truth, one block per
+ * group, and bitmap_sync() writes back only dirty groups, before every
+ * journal commit. Bits that don't stand for a free inode or data block
+ * are kept set. Freed blocks are handed back through the journal, which
+ * releases them once the free is committed.
+ */
+#define GROUP_META_BLKS 2   // data and inode bitmap heading each group
 
+typedef struct GroupInfo {
+    int free_blocks;    // guarded by blkno_lock
+    int free_inodes;    // guarded by ino_lock
+} GroupInfo;
 
 bitmap_t inode_bitmap;
 bitmap_t dBlock_bitmap;
+GroupInfo *groups;
+
+// one flag per group
+char *inode_bitmap_dirty;
+char *dBlock_bitmap_dirty;
+
+// Each bitmap, its dirty flags and free counts are guarded by their own lock
+pthread_mutex_t ino_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t blkno_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Free data blocks, and how many of them delayed writes have claimed.
+// Both are guarded by blkno_lock.
+int dblk_free = 0;
+int dblk_reserved = 0;
+
+// Reserved blocks the allocator may hand out to this thread, those of the
+// file whose delayed writes it is writing back (see da_writeback())
+static __thread int dblk_held = 0;
+
+static int group_of_blk(int blk_no) {
+    return blk_no / sb->blocks_per_group;
+}
+
+static int group_of_ino(uint32_t ino) {
+    return ino / sb->inodes_per_group;
+}
+
+// First metadata block of a group, its data bitmap
+static int group_meta_blk(int g) {
+    return g * sb->blocks_per_group + (g == 0 ? 1 + sb->journal_blocks : 0);
+}
+
+static int group_itable_blk(int g) {
+    return group_meta_blk(g) + GROUP_META_BLKS;
+}
+
+// First data block of a group
+static int group_data_blk(int g) {
+    return group_itable_blk(g) + sb->inodes_per_group / INODES_PER_BLOCK;
+}
+
+// Where the data of an inode starts out, in the inode's own group
+static int data_goal(uint32_t ino) {
+    return group_data_blk(group_of_ino(ino));
+}
+
+// The in-memory bitmap block of a group
+static bitmap_t group_bits(bitmap_t b, int g) {
+    return b + (size_t)g * BLOCK_SIZE;
+}
 
 /*
- * Get available inode number from bitmap
+ * Find the lowest clear bit at or after hint, wrapping around once.
+ * Scans a 64-bit word at a time; the bits padding nbits up to a whole
+ * word must be set.
  */
-int get_avail_ino() {
+static int find_free_bit(bitmap_t b, int nbits, int hint) {
 
-    // Step 1: Read inode bitmap from disk
-    if( bio_read(sb->i_bitmap_blk , inode_bitmap) <= 0)
-        return -1;
+    uint64_t *words = (uint64_t*) b;
+    int nwords = (nbits + 63) / 64;
+    int start = (hint / 64) % nwords;
 
+    // from the hint to the end of the map, ignoring bits below the hint
+    uint64_t free_bits = ~words[start] & (~0ULL << (hint % 64));
+    for (int w = start; w < nwords; w++)
+    {
+        if (w != start)
+            free_bits = ~words[w];
+        if (free_bits != 0)
+            return w * 64 + __builtin_ctzll(free_bits);
+    }
+
+    // wrap around to catch anything freed below the hint
+    for (int w = 0; w <= start; w++)
+    {
+        if (~words[w] != 0)
+            return w * 64 + __builtin_ctzll(~words[w]);
+    }
+    return -1;
+}
+
+/*
+ * Get available inode number from bitmap. A file's inode goes into the
+ * group of its directory; a new directory goes to the group with the
+ * most free blocks among those with an above-average share of free
+ * inodes, so unrelated trees spread out over the disk.
+ */
+int get_avail_ino(uint32_t parent, int is_dir) {
 
-    // Step 2: Traverse inode bitmap to find an available slot
-    int avail_inode = -1;
-    for(int i = 1; i < MAX_INUM; i++)
+    pthread_mutex_lock(&ino_lock);
+
+    // Step 1: Pick the group. Free block counts are only a hint here,
+    // they aren't read under their lock.
+    int ngroups = sb->num_groups;
+    int g = -1;
+    if (is_dir)
     {
-        if(get_bitmap(inode_bitmap, i) == 0)
+        long long total = 0;
+        for (int i = 0; i < ngroups; i++)
+            total += groups[i].free_inodes;
+        long long avg = total / ngroups;
+
+        for (int i = 0; i < ngroups; i++)
         {
-            avail_inode = i;
-            break;
+            if (groups[i].free_inodes == 0 || groups[i].free_inodes < avg)
+                continue;
+            if (g == -1 || groups[i].free_blocks > groups[g].free_blocks)
+                g = i;
+        }
+    }
+    else
+    {
+        for (int k = 0; k < ngroups && g == -1; k++)
+        {
+            int i = (group_of_ino(parent) + k) % ngroups;
+            if (groups[i].free_inodes > 0)
+                g = i;
         }
     }
-    // Step 3: Update inode bitmap and write to disk
+
+    // Step 2: Traverse the group's inode bitmap to find an available slot
+    bitmap_t bits = (g != -1) ? group_bits(inode_bitmap, g) : NULL;
+    int avail_inode = (g != -1) ? find_free_bit(bits, BITS_PER_BLOCK, 0) : -1;
     if(avail_inode == -1)
+    {
+        pthread_mutex_unlock(&ino_lock);
         return -1;
-    
-    set_bitmap(inode_bitmap, avail_inode);
+    }
 
-    if( bio_write(sb->i_bitmap_blk, inode_bitmap) <= 0)
-        return -1;
+    // Step 3: Update inode bitmap, it is written back lazily
+    set_bitmap(bits, avail_inode);
+    inode_bitmap_dirty[g] = 1;
+    groups[g].free_inodes--;
 
-    return avail_inode;
+    pthread_mutex_unlock(&ino_lock);
+    return g * sb->inodes_per_group + avail_inode;
 }
 
 /*
- * Get available data block number from bitmap
+ * Get up to want contiguous data blocks, preferring the run that starts
+ * at block goal (e.g. right after the previous block of the same file,
+ * or the first data block of its group). Returns the first block and
+ * sets *got, or -1 if the disk is full. Blocks reserved for delayed
+ * writes count as taken, but for the thread writing them back.
  */
-int get_avail_blkno() {
+int get_avail_blkrun(int goal, int want, int *got) {
+
+    pthread_mutex_lock(&blkno_lock);
 
-    // Step 1: Read data block bitmap from disk
-    if( bio_read(sb->d_bitmap_blk , dBlock_bitmap) <= 0 )
+    // Step 1: What may be taken without eating into the reservations
+    int avail = dblk_free - dblk_reserved + dblk_held;
+    if (avail <= 0)
+    {
+        pthread_mutex_unlock(&blkno_lock);
         return -1;
+    }
+    if (want > avail)
+        want = avail;
+
+    // Step 2: First free block from the goal on in its group, moving on
+    // to the following groups that have any
+    int ngroups = sb->num_groups;
+    int goal_group = 0, hint = 0;
+    if (goal >= 0 && goal < (int)sb->disk_blocks)
+    {
+        goal_group = group_of_blk(goal);
+        hint = goal % sb->blocks_per_group;
+    }
 
-    // Step 2: Traverse data block bitmap to find an available slot
-    int avail_data_block = -1;
-    for(int i = 0; i < MAX_DNUM; i++)
+    int g = -1, first = -1;
+    for (int k = 0; k < ngroups && first == -1; k++)
     {
-        if(get_bitmap(dBlock_bitmap, i) == 0)
-        {
-            avail_data_block = i;
-            break;
-        }
+        g = (goal_group + k) % ngroups;
+        if (groups[g].free_blocks > 0)
+            first = find_free_bit(group_bits(dBlock_bitmap, g), BITS_PER_BLOCK, k == 0 ? hint : 0);
     }
-    // Step 3: Update data block bitmap and write to disk
-    if(avail_data_block == -1)
+    if(first == -1)
+    {
+        pthread_mutex_unlock(&blkno_lock);
         return -1;
-    
-    set_bitmap(dBlock_bitmap, avail_data_block);
+    }
 
-    if(bio_write(sb->d_bitmap_blk, dBlock_bitmap) <= 0)
-        return -1;
+    // Step 3: Take the free blocks following it, up to the end of the group,
+    // out of this thread's reservation first
+    bitmap_t bits = group_bits(dBlock_bitmap, g);
+    int n = 0;
+    while (n < want && first + n < BITS_PER_BLOCK && !get_bitmap(bits, first + n))
+    {
+        set_bitmap(bits, first + n);
+        n++;
+    }
+    dBlock_bitmap_dirty[g] = 1;
+    groups[g].free_blocks -= n;
+    dblk_free -= n;
+    int used = (n < dblk_held) ? n : dblk_held;
+    dblk_held -= used;
+    dblk_reserved -= used;
 
-    
-    return sb->d_start_blk + avail_data_block;
+    pthread_mutex_unlock(&blkno_lock);
+
+    *got = n;
+    return g * sb->blocks_per_group + first;
 }
 
 /*
- * inode operations
+ * Get available data block number from bitmap, as close to goal as possible
  */
-int readi(uint16_t ino, struct inode *inode) {
-
+int get_avail_blkno(int goal) {
+    int got;
+    return get_avail_blkrun(goal, 1, &got);
+}
 
-    int blk_num = 3 + (ino/INODES_PER_BLOCK);
+/*
+ * Set n blocks aside for delayed writes so they can't run out of space
+ * by the time they are allocated. Returns -1 if the disk is full.
+ */
+int reserve_blkno(int n) {
+    pthread_mutex_lock(&blkno_lock);
+    int ok = (dblk_free - dblk_reserved >= n);
+    if (ok)
+        dblk_reserved += n;
+    pthread_mutex_unlock(&blkno_lock);
+    return ok ? 0 : -1;
+}
 
-    // Step 1: Get the inode's on-disk block number
+void unreserve_blkno(int n) {
+    pthread_mutex_lock(&blkno_lock);
+    dblk_reserved -= n;
+    pthread_mutex_unlock(&blkno_lock);
+}
 
-    memset(block, 0, BLOCK_SIZE);
+/*
+ * Return an inode number to the bitmap
+ */
+void free_ino(int ino) {
+    int g = group_of_ino(ino);
+    pthread_mutex_lock(&ino_lock);
+    unset_bitmap(group_bits(inode_bitmap, g), ino % sb->inodes_per_group);
+    inode_bitmap_dirty[g] = 1;
+    groups[g].free_inodes++;
+    pthread_mutex_unlock(&ino_lock);
+}
 
-    if(bio_read(blk_num, block) > 0 )
+// Clear bits [from, to) of a bitmap
+static void clear_bit_range(bitmap_t b, int from, int to) {
+    while (from < to && from % 8 != 0)
+        unset_bitmap(b, from++);
+    if (to - from >= 8)
     {
-        // Step 2: Get offset of the inode in the inode on-disk block
-        int offset = (ino % INODES_PER_BLOCK) * INODE_SIZE;
-
-        // Step 3: Read the block from disk and then copy into inode structure
-        memcpy(inode, (char*)block + offset, INODE_SIZE);
-        return 0;
+        memset(b + from / 8, 0, (to - from) / 8);
+        from += (to - from) / 8 * 8;
     }
-    return -1;
+    while (from < to)
+        unset_bitmap(b, from++);
 }
 
-int writei(uint16_t ino, struct inode *inode) {
+/*
+ * Return count data blocks from blk_no (absolute block number) to the
+ * bitmap, a group at a time
+ */
+static void release_blkrun(int blk_no, int count) {
+    pthread_mutex_lock(&blkno_lock);
+    while (count > 0)
+    {
+        int g = group_of_blk(blk_no);
+        int first = blk_no % sb->blocks_per_group;
+        int n = (first + count <= (int)sb->blocks_per_group) ? count : (int)sb->blocks_per_group - first;
+        clear_bit_range(group_bits(dBlock_bitmap, g), first, first + n);
+        dBlock_bitmap_dirty[g] = 1;
+        groups[g].free_blocks += n;
+        dblk_free += n;
+        blk_no += n;
+        count -= n;
+    }
+    pthread_mutex_unlock(&blkno_lock);
+}
 
-    memset(block, 0, BLOCK_SIZE);
+/*
+ * Free a run of data blocks; they become available once the journal has
+ * committed the transaction freeing them. Their contents are left as
+ * they are, whoever gets them next overwrites or zeroes them.
+ */
+void free_blkrun(int blk_no, int count) {
+    if (count > 0 && !journal_free(blk_no, count))
+        release_blkrun(blk_no, count);
+}
 
-    // Step 1: Get the block number where this inode resides on disk
-    int blk_num = 3 + (ino/INODES_PER_BLOCK);
+void free_blkno(int blk_no) {
+    free_blkrun(blk_no, 1);
+}
 
-    if(bio_read(blk_num, block) > 0 )
+// Set bits [from, to) of a bitmap
+static void set_bit_range(bitmap_t b, int from, int to) {
+    while (from < to && from % 8 != 0)
+        set_bitmap(b, from++);
+    if (to - from >= 8)
     {
-        // Step 2: Get the offset in the block where this inode resides on disk
-        int offset = (ino % INODES_PER_BLOCK) * INODE_SIZE;
-
-        // Step 3: Write inode to disk
-        memcpy((char*)block + offset, inode ,INODE_SIZE);
-        
-        if (bio_write(blk_num, block) > 0 )
-        {
-            return 0; // Success
-        }
+        memset(b + from / 8, 0xFF, (to - from) / 8);
+        from += (to - from) / 8 * 8;
     }
-    return -1;
+    while (from < to)
+        set_bitmap(b, from++);
 }
 
+static int bits_clear(bitmap_t b) {
+    int n = BITS_PER_BLOCK;
+    for (int i = 0; i < BLOCK_SIZE / 8; i++)
+        n -= __builtin_popcountll(((uint64_t*)b)[i]);
+    return n;
+}
 
 /*
- * directory operations
+ * Allocate the in-memory bitmaps and group table
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-    struct inode i_node;
-    
-    if(readi(ino, &i_node) == -1)
-    {
+static int bitmap_alloc() {
+    int ngroups = sb->num_groups;
+    inode_bitmap = calloc(ngroups, BLOCK_SIZE);
+    dBlock_bitmap = calloc(ngroups, BLOCK_SIZE);
+    inode_bitmap_dirty = calloc(ngroups, 1);
+    dBlock_bitmap_dirty = calloc(ngroups, 1);
+    groups = calloc(ngroups, sizeof(GroupInfo));
+    if (inode_bitmap == NULL || dBlock_bitmap == NULL || inode_bitmap_dirty == NULL
+        || dBlock_bitmap_dirty == NULL || groups == NULL)
         return -1;
-    }
+    return 0;
+}
 
-    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
-    // int total_dir_entries = i_node.size/sizeof(struct dirent); // here i will have the total num of dir entries
-    // int entriesToRead = 0;
+/*
+ * Count what is free in every group
+ */
+static void bitmap_count() {
+    dblk_free = 0;
+    dblk_reserved = 0;
+    for (int g = 0; g < (int)sb->num_groups; g++)
+    {
+        groups[g].free_blocks = bits_clear(group_bits(dBlock_bitmap, g));
+        groups[g].free_inodes = bits_clear(group_bits(inode_bitmap, g));
+        dblk_free += groups[g].free_blocks;
+    }
+}
 
-  
-    // Step 2: Get data block of current directory from inode
+/*
+ * Read both bitmaps of every group, they sit next to each other so one
+ * vectored read per group does
+ */
+static int bitmap_load() {
+    if (bitmap_alloc() != 0)
+        return -1;
 
-    //     DIRECT POINTERS
-    for(int i=0; i < 16; i++)
+    for (int g = 0; g < (int)sb->num_groups; g++)
     {
-        int data_blk = i_node.direct_ptr[i];
-        if (data_blk <= 0) continue; // Skip if block number is invalid
-
-        // Step 3: Read directory's data block and check each directory entry.
-        memset(block, 0, BLOCK_SIZE);
-        if( bio_read(data_blk , block) <= 0 )
-        {
+        struct iovec iov[GROUP_META_BLKS] = {
+            { group_bits(dBlock_bitmap, g), BLOCK_SIZE },
+            { group_bits(inode_bitmap, g), BLOCK_SIZE },
+        };
+        if (cache_readv(group_meta_blk(g), iov, GROUP_META_BLKS) <= 0)
             return -1;
-        }
-
-        struct dirent* entries = (struct dirent*) block;
+    }
 
-        for(int j = 0; j<blk_dir_entries; j++)
-        {
-            //If the name matches, then copy directory entry to dirent structure
-            if (strncmp(fname, entries[j].name, name_len) == 0 && entries[j].len == name_len)
-            {
-                // strcmp returns 0 when the two strings are equal.
-                memcpy(dirent, &entries[j], sizeof(struct dirent));
-                return 0;
-            }
-            
-        }
+    bitmap_count();
+    return 0;
+}
 
-    }
-    
-    memset(first_block, 0, BLOCK_SIZE);
+/*
+ * Write dirty bitmaps back to their on-disk blocks, offset is the
+ * bitmap's place among its group's metadata blocks
+ */
+static int bitmap_sync_one(bitmap_t b, char *dirty, pthread_mutex_t *lock, int offset) {
+    char buf[BLOCK_SIZE];
+    int ret = 0;
 
-    //     INDIRECT POINTERS
-    for(int i =0; i<8; i++)
+    for (int g = 0; g < (int)sb->num_groups; g++)
     {
-        int data_blk = i_node.indirect_ptr[i];
-        
-        if (data_blk <= 0) continue; // Skip if block number is invalid
-
-        // Step 3: Read directory's data block and check each directory entry.
-        if( bio_read(data_blk , first_block) <= 0 )
+        // snapshot under the lock so allocation isn't held up by the write
+        pthread_mutex_lock(lock);
+        int was_dirty = dirty[g];
+        if (was_dirty)
+            memcpy(buf, group_bits(b, g), BLOCK_SIZE);
+        dirty[g] = 0;
+        pthread_mutex_unlock(lock);
+
+        if (was_dirty && journal_write(group_meta_blk(g) + offset, buf) <= 0)
         {
-            return -1;
+            pthread_mutex_lock(lock);
+            dirty[g] = 1;
+            pthread_mutex_unlock(lock);
+            ret = -1;
         }
+    }
+    return ret;
+}
 
-        int* blk_nums = (int*) first_block; // storing the direct pointers
-
-        for(int j = 0; j<(BLOCK_SIZE/sizeof(int)); j++)
-        {
-            if(blk_nums[j] <= 0) continue;
-
-            memset(block, 0 ,BLOCK_SIZE);
-
-            if( bio_read(blk_nums[j] , block) <= 0 )
-            {
-                return -1;
-            }
+int bitmap_sync() {
+    if (bitmap_sync_one(dBlock_bitmap, dBlock_bitmap_dirty, &blkno_lock, 0) != 0)
+        return -1;
+    if (bitmap_sync_one(inode_bitmap, inode_bitmap_dirty, &ino_lock, 1) != 0)
+        return -1;
+    return 0;
+}
 
-            struct dirent* entries = (struct dirent*) block;
+/*
+ * in-core inode table
+ *
+ * Inodes are cached in a hash keyed on ino. An entry with a non-zero
+ * refcount (held across open/release, or while an operation uses it)
+ * is never evicted. Updates only mark the entry dirty; dirty inodes
+ * are written back grouped by inode-table block by inode_sync().
+ *
+ * icache_lock guards the table itself and every in-core copy. Each
+ * entry also carries a reader/writer lock, taken with ilock(), that
+ * serializes whole operations on one file or directory.
+ */
+#define ICACHE_SIZE 512
+#define ICACHE_BUCKETS 1024
+
+struct DirtyPage;
+
+typedef struct InodeEntry {
+    struct inode inode;
+    int used;           // slot holds a valid in-core inode
+    int refcount;       // open handles and in-flight users
+    int dirty;          // in-core copy is newer than the inode table
+    int referenced;     // CLOCK reference bit for eviction
+    int next;           // next slot in the same hash bucket, -1 ends chain
+    unsigned tid;       // journal transaction of the last change, see rufs_fsync()
+    unsigned dtid;      // same, counting only changes reading the data depends on
+    pthread_rwlock_t lock;
+    struct DirtyPage **pages;   // delayed writes sorted by block, see da_page()
+    int npages;
+    int maxpages;
+    int nremap;         // pages whose writeback changes the mapping
+    int nreserved;      // pages over a hole, each needing a block
+    int reserved;       // blocks reserved for the pages, tree blocks included
+} InodeEntry;
+
+InodeEntry icache[ICACHE_SIZE];
+int icache_buckets[ICACHE_BUCKETS];
+int icache_hand = 0;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int inode_blk(uint32_t ino) {
+    return group_itable_blk(group_of_ino(ino)) + (ino % sb->inodes_per_group) / INODES_PER_BLOCK;
+}
 
-            for(int k = 0; k < blk_dir_entries; k++)
-            {
-                //If the name matches, then copy directory entry to dirent structure
-                if (strncmp(fname, entries[k].name, name_len) == 0 && entries[k].len == name_len)
-                {
-                    // strcmp returns 0 when the two strings are equal.
-                    memcpy(dirent, &entries[k], sizeof(struct dirent));
-                    return 0;
-                }
-            }
-        }
+void icache_init() {
+    memset(icache, 0, sizeof(icache));
+    for (int i = 0; i < ICACHE_SIZE; i++)
+    {
+        icache[i].next = -1;
+        pthread_rwlock_init(&icache[i].lock, NULL);
     }
+    memset(icache_buckets, -1, sizeof(icache_buckets));
+    icache_hand = 0;
+}
 
+static int icache_lookup(uint32_t ino) {
+    for (int i = icache_buckets[ino % ICACHE_BUCKETS]; i != -1; i = icache[i].next)
+    {
+        if (icache[i].inode.ino == ino)
+            return i;
+    }
     return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+/*
+ * Write back every dirty in-core inode sharing its inode-table block with
+ * ino with a single read-modify-write of that block
+ */
+static int icache_write_block(uint32_t ino) {
 
-    // Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-    // Step 3: Add directory entry in dir_inode's data block and write to disk
-    // Allocate a new data block for this directory if it does not exist
-    // Update directory inode
-    // Write directory entry
+    int blk_num = inode_blk(ino);
+    char buf[BLOCK_SIZE];
+    if (cache_read(blk_num, buf) <= 0)
+        return -1;
 
-    struct dirent d;
-    if(dir_find(dir_inode.ino, fname, name_len, &d) == 0)
+    // a group's inode table slice holds a whole number of blocks
+    uint32_t first_ino = ino - ino % INODES_PER_BLOCK;
+    for (int i = 0; i < INODES_PER_BLOCK; i++)
     {
-        return -1; // Step 2: Check if fname (directory name) is already used in other entries
-    }
+        int slot = icache_lookup(first_ino + i);
+        if (slot == -1 || !icache[slot].dirty)
+            continue;
 
-    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
+        memcpy(buf + i * INODE_SIZE, &icache[slot].inode, INODE_SIZE);
+        icache[slot].dirty = 0;
+    }
 
-    // if(size(dir_inode.ino) > 0){
-    //     int free_blk = getBlock(dir_inode.ino);
-    //     int offset = getOffset(dir_inode.ino);
+    if (journal_write(blk_num, buf) <= 0)
+        return -1;
+    return 0;
+}
 
-    //     set_bitmap(dBlock_bitmap, (free_blk - sb->d_start_blk) );
-        
-    //     if(bio_write(sb->d_bitmap_blk, dBlock_bitmap) <= 0)
-    //         return -1;
-        
-    //     // now we need to update inode information as a result on disk
-    //     time_t current_time = time(NULL);
-    //     dir_inode.vstat.st_atime = current_time;
-    //     dir_inode.vstat.st_mtime = current_time;
-    //     dir_inode.size += sizeof(struct dirent);;
-        
-    //     if (writei(dir_inode.ino, &dir_inode) != 0)
-    //         return -1;
+/*
+ * Find an unreferenced slot with CLOCK, writing it back if dirty
+ */
+static int icache_evict() {
+    for (int scanned = 0; scanned < 2 * ICACHE_SIZE; scanned++)
+    {
+        int slot = icache_hand;
+        InodeEntry *e = &icache[slot];
+        icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+
+        if (!e->used)
+            return slot;
+        if (e->refcount > 0 || e->npages > 0)
+            continue;
+        if (e->referenced)
+        {
+            e->referenced = 0;
+            continue;
+        }
 
-    //     memset(block, 0, BLOCK_SIZE);
+        if (e->dirty && icache_write_block(e->inode.ino) != 0)
+            return -1;
 
-    //     if( bio_read(free_blk , block) <= 0 )
-    //     {
-    //         return -1;
-    //     }
+        // unlink from its hash chain
+        int *link = &icache_buckets[e->inode.ino % ICACHE_BUCKETS];
+        while (*link != slot)
+            link = &icache[*link].next;
+        *link = e->next;
+        e->next = -1;
+        e->used = 0;
+        return slot;
+    }
+    return -1; // every in-core inode is pinned
+}
 
-    //     struct dirent new_entry;
-    //     new_entry.valid = 1; // assuming 1 mean in used
-    //     new_entry.ino = f_ino;
-    //     strncpy(new_entry.name, fname, name_len);
-    //     new_entry.name[name_len] = '\0';
-    //     new_entry.len = name_len;
+/*
+ * Get a referenced in-core inode, loading it from disk unless the
+ * caller is about to overwrite it completely (load == 0).
+ * Caller holds icache_lock.
+ */
+static InodeEntry *icache_get(uint32_t ino, int load) {
 
-    //     memcpy((char*)block + offset, &new_entry, sizeof(struct dirent));
+    int slot = icache_lookup(ino);
+    if (slot != -1)
+    {
+        icache[slot].refcount++;
+        icache[slot].referenced = 1;
+        return &icache[slot];
+    }
 
-    //     if (bio_write(free_blk, block) > 0 )
-    //     {
-    //         return 0; // Success
-    //     }
+    slot = icache_evict();
+    if (slot == -1)
+        return NULL;
 
-    // }
+    InodeEntry *e = &icache[slot];
+    memset(&e->inode, 0, INODE_SIZE);
 
-    int total_dir_entries = dir_inode.size/sizeof(struct dirent);
+    if (load)
+    {
+        char buf[BLOCK_SIZE];
+        const char *itable = cache_view(inode_blk(ino), buf);
+        if (itable == NULL)
+            return NULL;
+        memcpy(&e->inode, itable + (ino % INODES_PER_BLOCK) * INODE_SIZE, INODE_SIZE);
+    }
+    e->inode.ino = ino;
+
+    e->used = 1;
+    e->refcount = 1;
+    e->dirty = 0;
+    e->referenced = 1;
+    // an earlier copy may have been evicted into a transaction still open
+    e->tid = e->dtid = journal_tid();
+    e->next = icache_buckets[ino % ICACHE_BUCKETS];
+    icache_buckets[ino % ICACHE_BUCKETS] = slot;
+    return e;
+}
 
-    // Finding the last half used block
-    int last_half_used_blk = ceil((double)total_dir_entries/blk_dir_entries);
+/*
+ * Take a reference on an inode, e.g. for the lifetime of an open file
+ */
+InodeEntry *iget(uint32_t ino) {
+    pthread_mutex_lock(&icache_lock);
+    InodeEntry *e = icache_get(ino, 1);
+    pthread_mutex_unlock(&icache_lock);
+    return e;
+}
 
+/*
+ * Drop a reference taken by iget()
+ */
+void iput(InodeEntry *e) {
+    pthread_mutex_lock(&icache_lock);
+    if (e != NULL && e->refcount > 0)
+        e->refcount--;
+    pthread_mutex_unlock(&icache_lock);
+}
 
-    if(total_dir_entries == 0) last_half_used_blk = 0;
+/*
+ * Take a reference and the inode's read (write == 0) or write lock
+ */
+InodeEntry *ilock(uint32_t ino, int write) {
+    InodeEntry *e = iget(ino);
+    if (e == NULL)
+        return NULL;
 
-    // Finding the number of total full Blocks.
-    int total_full_blk = total_dir_entries/blk_dir_entries;
+    if (write)
+        pthread_rwlock_wrlock(&e->lock);
+    else
+        pthread_rwlock_rdlock(&e->lock);
+    return e;
+}
 
-    int entriesToRead = total_dir_entries - (total_full_blk * blk_dir_entries);
+/*
+ * Release an inode taken with ilock()
+ */
+void iunlock(InodeEntry *e) {
+    pthread_rwlock_unlock(&e->lock);
+    iput(e);
+}
 
-    if(total_full_blk < 16)
+/*
+ * Write all dirty in-core inodes back to the inode table, one
+ * read-modify-write per inode-table block
+ */
+int inode_sync() {
+    int ret = 0;
+    pthread_mutex_lock(&icache_lock);
+    for (int i = 0; i < ICACHE_SIZE; i++)
     {
-        // WILL GO HERE FOR DIRECT POINTER
-        if(last_half_used_blk > total_full_blk)
+        if (icache[i].used && icache[i].dirty)
         {
-            // If the block is half used then it will go here
-            int data_blk = dir_inode.direct_ptr[last_half_used_blk-1];
-
-            // now we need to update inode information as a result on disk
-            time_t current_time = time(NULL);
-            dir_inode.vstat.st_atime = current_time;
-            dir_inode.vstat.st_mtime = current_time;
-            dir_inode.size += sizeof(struct dirent);
-            
-            if (writei(dir_inode.ino, &dir_inode) != 0)
-                return -1;
+            if (icache_write_block(icache[i].inode.ino) != 0)
+                ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return ret;
+}
 
-            memset(block, 0, BLOCK_SIZE);
+/*
+ * inode operations
+ */
+int readi(uint32_t ino, struct inode *inode) {
 
-            if( bio_read(data_blk , block) <= 0 )
-            {
-                return -1;
-            }
+    pthread_mutex_lock(&icache_lock);
 
-            int offset = entriesToRead * sizeof(struct dirent);
+    // Step 1: Get the in-core inode, reading its block only on a miss
+    InodeEntry *e = icache_get(ino, 1);
+    if (e == NULL)
+    {
+        pthread_mutex_unlock(&icache_lock);
+        return -1;
+    }
 
-            struct dirent new_entry;
-            new_entry.valid = 1; // assuming 1 mean in used
-            new_entry.ino = f_ino;
-            strncpy(new_entry.name, fname, name_len);
-            new_entry.name[name_len] = '\0';
-            new_entry.len = name_len;
+    // Step 2: Copy it out to the caller
+    memcpy(inode, &e->inode, INODE_SIZE);
+    e->refcount--;
 
-            memcpy((char*) block+offset, &new_entry, sizeof(struct dirent));
+    pthread_mutex_unlock(&icache_lock);
+    return 0;
+}
 
+int writei(uint32_t ino, struct inode *inode) {
 
-            if (bio_write(data_blk, block) > 0 )
-            {
-                if (inodeMap[dir_inode.ino] == NULL)
-                {
-                    inodeMap[dir_inode.ino] = malloc(sizeof(LastDirent));
+    pthread_mutex_lock(&icache_lock);
 
-                    inodeMap[dir_inode.ino]->last_block = data_blk;
-                    inodeMap[dir_inode.ino]->last_offset = offset;
-                }
-                else
-                {
-                    inodeMap[dir_inode.ino]->last_block = data_blk;
-                    inodeMap[dir_inode.ino]->last_offset = offset;
-                }
-                return 0; // Success
-            }
+    // Step 1: Get the in-core inode, no need to read it as it is overwritten
+    InodeEntry *e = icache_get(ino, 0);
+    if (e == NULL)
+    {
+        pthread_mutex_unlock(&icache_lock);
+        return -1;
+    }
 
-        }
-        else
-        {
-            // If new block need to be allocated then it will go here
-            int avail_data_block = get_avail_blkno();
+    // Step 2: Note which transaction the change goes out with. Size and
+    // mapping matter to fdatasync, timestamps alone don't.
+    struct inode cmp;
+    memcpy(&cmp, inode, INODE_SIZE);
+    cmp.vstat.st_atime = e->inode.vstat.st_atime;
+    cmp.vstat.st_mtime = e->inode.vstat.st_mtime;
+    cmp.vstat.st_ctime = e->inode.vstat.st_ctime;
+    e->tid = journal_tid();
+    if (memcmp(&cmp, &e->inode, INODE_SIZE) != 0)
+        e->dtid = e->tid;
+
+    // Step 3: Update it and leave the write-back to inode_sync()
+    memcpy(&e->inode, inode, INODE_SIZE);
+    e->dirty = 1;
+    e->refcount--;
+
+    pthread_mutex_unlock(&icache_lock);
+    return 0;
+}
 
-            // assigning the blk number which is free to the direct ptr
-            dir_inode.direct_ptr[last_half_used_blk] = avail_data_block;
 
+/*
+ * Account n blocks allocated to an inode, or freed if negative, in the
+ * 512-byte units of st_blocks. Holes aren't counted, so a sparse file
+ * shows how much of the disk it really takes.
+ */
+static void inode_add_blocks(struct inode *inode, int n) {
+    blkcnt_t sectors = inode->vstat.st_blocks + (blkcnt_t)n * (BLOCK_SIZE / 512);
+    inode->vstat.st_blocks = (sectors > 0) ? sectors : 0;
+}
 
-            // now we need to update inode information as a result on disk
-            time_t current_time = time(NULL);
-            dir_inode.vstat.st_atime = current_time;
-            dir_inode.vstat.st_mtime = current_time;
-            dir_inode.size += sizeof(struct dirent);
-            if (writei(dir_inode.ino, &dir_inode) != 0)
-                return -1;
 
-            memset(block, 0, BLOCK_SIZE);
+/*
+ * extent tree
+ *
+ * Every inode maps its data with extents (see rufs.h). Each level of the
+ * tree is binary searched, so a lookup costs O(log extents). Allocation
+ * asks for a run right after the previous extent and grows it in place,
+ * so sequential files stay in a handful of records. A full node is split
+ * in two, and a full root pushes its records down into a new block,
+ * growing the tree by one level.
+ */
+void ext_init(struct inode *inode) {
+    memset(&inode->ext, 0, sizeof(inode->ext));
+    inode->ext.hdr.magic = EXT_MAGIC;
+    inode->ext.hdr.max = EXT_ROOT_MAX;
+    inode->flags |= I_EXTENTS;
+}
 
-            struct dirent new_entry;
-            new_entry.valid = 1; // assuming 1 mean in used
-            new_entry.ino = f_ino;
-            strncpy(new_entry.name, fname, name_len);
-            new_entry.name[name_len] = '\0';
-            new_entry.len = name_len;
-
-            memcpy(block, &new_entry, sizeof(struct dirent));
-
-            if (bio_write(avail_data_block, block) > 0 )
-            {
-                printf("error here");
-                fflush(stdout);
-                if (inodeMap[dir_inode.ino] == NULL)
-                {
-                    inodeMap[dir_inode.ino] = malloc(sizeof(LastDirent));
-                    
-                    inodeMap[dir_inode.ino]->last_block = avail_data_block;
-                    inodeMap[dir_inode.ino]->last_offset = 0;
-                }
-                else
-                {
-                    inodeMap[dir_inode.ino]->last_block = avail_data_block;
-                    inodeMap[dir_inode.ino]->last_offset = 0;
-                }
-                return 0; // Success
-            }
+static struct extent *ext_records(struct extent_header *h) {
+    return (struct extent*) (h + 1);
+}
 
+// Last record starting at or before lblk, -1 if lblk is below all of them
+static int ext_search(struct extent_header *h, uint32_t lblk) {
+    struct extent *r = ext_records(h);
+    int lo = 0, hi = h->entries - 1, found = -1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (r[mid].lblk <= lblk)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
         }
     }
-    else
+    return found;
+}
+
+// Nodes visited on the way from the root to a leaf
+typedef struct ExtPath {
+    int depth;
+    struct extent_header *node[EXT_MAX_DEPTH + 1]; // level 0 is the root in the inode
+    int blk[EXT_MAX_DEPTH + 1];     // disk block of each level, -1 for the root
+    int slot[EXT_MAX_DEPTH + 1];    // record followed (index) or found (leaf)
+    uint32_t next[EXT_MAX_DEPTH + 1]; // first lblk covered by the next record
+    char buf[EXT_MAX_DEPTH][BLOCK_SIZE];
+} ExtPath;
+
+static int ext_walk(struct inode *inode, uint32_t lblk, ExtPath *path) {
+
+    struct extent_header *h = &inode->ext.hdr;
+    path->depth = h->depth;
+    path->node[0] = h;
+    path->blk[0] = -1;
+    if (h->magic != EXT_MAGIC || path->depth > EXT_MAX_DEPTH)
+        return -1;
+
+    for (int l = 0; l <= path->depth; l++)
     {
-        // WILL GO HERE FOR INDIRECT POINTER
+        int i = ext_search(h, lblk);
+        path->next[l] = (i + 1 < h->entries) ? ext_records(h)[i + 1].lblk : UINT32_MAX;
+        if (l == path->depth)
+        {
+            path->slot[l] = i;
+            break;
+        }
 
-        total_dir_entries -= (16*blk_dir_entries); // will get the remaining dir entries deducting the directPtr dir entries
+        // index entry 0 covers everything below entry 1
+        path->slot[l] = (i == -1) ? 0 : i;
+        int child = ext_records(h)[path->slot[l]].pblk;
+        if (cache_read(child, path->buf[l]) <= 0)
+            return -1;
 
-        total_full_blk = total_dir_entries / blk_dir_entries;
-        entriesToRead = total_dir_entries - (total_full_blk * blk_dir_entries);
+        h = (struct extent_header*) path->buf[l];
+        if (h->magic != EXT_MAGIC)
+            return -1;
+        path->node[l + 1] = h;
+        path->blk[l + 1] = child;
+    }
+    return 0;
+}
 
-        last_half_used_blk = ceil((double)total_dir_entries/blk_dir_entries);
+// Write a modified node back; the root lives in the inode, which the caller writes
+static int ext_write_node(ExtPath *path, int level) {
+    if (level == 0)
+        return 0;
+    return journal_write(path->blk[level], path->node[level]) > 0 ? 0 : -1;
+}
 
+static void ext_insert_at(struct extent_header *h, int pos, struct extent *rec) {
+    struct extent *r = ext_records(h);
+    memmove(&r[pos + 1], &r[pos], (h->entries - pos) * sizeof(struct extent));
+    r[pos] = *rec;
+    h->entries++;
+}
 
-        int inner_entries = BLOCK_SIZE/(sizeof(int));
-        int indirect_idx = total_full_blk/inner_entries; // will get the index 0-based for indirect_ptr[]
-        int inner_entries_idx = last_half_used_blk % inner_entries; // will get the index 1-based for inner entries******
-        if(inner_entries_idx == 0 && last_half_used_blk != 0) inner_entries_idx = inner_entries; // 1-based index
+/*
+ * Add a record to the tree, splitting full nodes on the way
+ */
+static int ext_insert(struct inode *inode, struct extent *rec) {
 
-        if(last_half_used_blk > total_full_blk)
-        {
+    ExtPath path;
+    char buf[BLOCK_SIZE];
 
-            int blk_num = dir_inode.indirect_ptr[indirect_idx]; // will never be -1 as there is a half used blk!
+    for (;;)
+    {
+        if (ext_walk(inode, rec->lblk, &path) != 0)
+            return -1;
 
-            // now we need to update inode information as a result on disk
-            time_t current_time = time(NULL);
-            dir_inode.vstat.st_atime = current_time;
-            dir_inode.vstat.st_mtime = current_time;
-            dir_inode.size += sizeof(struct dirent);
-            if (writei(dir_inode.ino, &dir_inode) != 0)
-                return -1;
+        // Step 1: Find the highest level from which every node down to the leaf is full
+        int l = path.depth;
+        while (l >= 0 && path.node[l]->entries >= path.node[l]->max)
+            l--;
 
+        // Step 2: The leaf has room, keep its records sorted
+        if (l == path.depth)
+        {
+            ext_insert_at(path.node[l], path.slot[l] + 1, rec);
+            return ext_write_node(&path, l);
+        }
 
-            memset(block, 0, BLOCK_SIZE);
-            memset(first_block, 0, BLOCK_SIZE);
+        int blk = get_avail_blkno(data_goal(inode->ino));
+        if (blk == -1)
+            return -1;
+        inode_add_blocks(inode, 1);
 
+        memset(buf, 0, BLOCK_SIZE);
+        struct extent_header *h = (struct extent_header*) buf;
+        h->magic = EXT_MAGIC;
+        h->max = EXT_BLOCK_MAX;
 
-            if( bio_read(blk_num , first_block) <= 0 )
+        if (l < 0)
+        {
+            // Step 3a: Every node is full, move the root's records into a new block
+            struct extent_header *root = path.node[0];
+            if (path.depth == EXT_MAX_DEPTH)
             {
-                
+                free_blkno(blk);
+                inode_add_blocks(inode, -1);
                 return -1;
             }
 
-            int* blk_nums = (int*) first_block; // storing the direct pointers
+            h->depth = root->depth;
+            h->entries = root->entries;
+            memcpy(ext_records(h), ext_records(root), root->entries * sizeof(struct extent));
+            if (journal_write(blk, buf) <= 0)
+                return -1;
 
-            int data_blk = blk_nums[inner_entries_idx-1];
+            root->depth++;
+            root->entries = 1;
+            memset(ext_records(root), 0, sizeof(struct extent));
+            ext_records(root)[0].lblk = ext_records(h)[0].lblk;
+            ext_records(root)[0].pblk = blk;
+            continue;
+        }
 
-            if( bio_read(data_blk , block) <= 0 )
-            {
-                
-                return -1;
-            }
+        // Step 3b: Split the full node below level l, moving its upper part
+        // into a new block. Appends only move the last record so the left
+        // node stays full.
+        struct extent_header *node = path.node[l + 1];
+        int keep = (path.slot[l + 1] == node->entries - 1) ? node->entries - 1 : node->entries / 2;
+
+        h->depth = node->depth;
+        h->entries = node->entries - keep;
+        memcpy(ext_records(h), &ext_records(node)[keep], h->entries * sizeof(struct extent));
+        node->entries = keep;
+
+        if (journal_write(blk, buf) <= 0 || ext_write_node(&path, l + 1) != 0)
+            return -1;
+
+        struct extent idx;
+        memset(&idx, 0, sizeof(idx));
+        idx.lblk = ext_records(h)[0].lblk;
+        idx.pblk = blk;
+        ext_insert_at(path.node[l], path.slot[l] + 1, &idx);
+        if (ext_write_node(&path, l) != 0)
+            return -1;
+    }
+}
+
+/*
+ * Mark n blocks from lblk, inside the unwritten extent the path ends at,
+ * as written. What is left of the extent on either side stays unwritten
+ * in a record of its own; a converted head joins the written extent
+ * before it when it can, so filling preallocated space front to back
+ * doesn't leave a record per write.
+ */
+static int ext_convert(struct inode *inode, ExtPath *path, uint32_t lblk, uint32_t n) {
+
+    struct extent_header *leaf = path->node[path->depth];
+    int i = path->slot[path->depth];
+    struct extent *r = ext_records(leaf);
+    uint32_t off = lblk - r[i].lblk;
+
+    struct extent mid, rest;
+    memset(&mid, 0, sizeof(mid));
+    mid.lblk = lblk;
+    mid.pblk = r[i].pblk + off;
+    mid.len = n;
+    memset(&rest, 0, sizeof(rest));
+    rest.lblk = lblk + n;
+    rest.pblk = mid.pblk + n;
+    rest.len = r[i].len - off - n;
+    rest.flags = EXT_UNWRITTEN;
+
+    // Step 1: Converting the middle or tail, the head stays where it is
+    if (off > 0)
+    {
+        r[i].len = off;
+        if (ext_write_node(path, path->depth) != 0 || ext_insert(inode, &mid) != 0)
+            return -1;
+        return (rest.len > 0) ? ext_insert(inode, &rest) : 0;
+    }
+
+    // Step 2: Converting the head, append it to the written extent before it
+    struct extent *p = (i > 0) ? &r[i - 1] : NULL;
+    if (p != NULL && p->flags == 0 && p->lblk + p->len == lblk
+        && p->pblk + p->len == mid.pblk && p->len + n <= EXT_MAX_LEN)
+    {
+        p->len += n;
+        if (rest.len > 0)
+        {
+            r[i] = rest;
+        }
+        else
+        {
+            memmove(&r[i], &r[i + 1], (leaf->entries - i - 1) * sizeof(struct extent));
+            leaf->entries--;
+        }
+        return ext_write_node(path, path->depth);
+    }
+
+    // Step 3: Otherwise it takes the record over, the rest goes in after it
+    r[i] = mid;
+    if (ext_write_node(path, path->depth) != 0)
+        return -1;
+    return (rest.len > 0) ? ext_insert(inode, &rest) : 0;
+}
+
+/*
+ * Map logical block lblk through the extent tree. *len gets how many
+ * blocks from lblk, up to max, are contiguous on disk, or for a hole how
+ * many are unmapped. Unwritten blocks read as a hole. With alloc set a
+ * hole is filled with a run of new blocks and unwritten blocks are
+ * marked written. Returns the disk block, -1 for a hole or a full disk.
+ */
+static int ext_map(struct inode *inode, uint32_t lblk, int max, int alloc, int *len) {
+
+    ExtPath path;
+    *len = 1;
+    if (ext_walk(inode, lblk, &path) != 0)
+        return -1;
+
+    // Step 1: Look for the extent holding lblk
+    struct extent_header *leaf = path.node[path.depth];
+    int i = path.slot[path.depth];
+    struct extent *prev = (i >= 0) ? &ext_records(leaf)[i] : NULL;
+
+    if (prev != NULL && lblk < prev->lblk + prev->len)
+    {
+        uint32_t off = lblk - prev->lblk;
+        int blk = prev->pblk + off;
+        *len = (prev->len - off < (uint32_t)max) ? prev->len - off : max;
+        if (!(prev->flags & EXT_UNWRITTEN))
+            return blk;
+        if (!alloc)
+            return -1;
+        return (ext_convert(inode, &path, lblk, *len) == 0) ? blk : -1;
+    }
+
+    // Step 2: A hole runs up to the next record at any level
+    uint32_t hole = max;
+    for (int l = 0; l <= path.depth; l++)
+    {
+        if (path.next[l] - lblk < hole)
+            hole = path.next[l] - lblk;
+    }
+    *len = hole;
+    if (!alloc)
+        return -1;
 
-            int offset = entriesToRead * sizeof(struct dirent);
+    // Step 3: Fill it with a run placed right after the previous extent
+    int goal = (prev != NULL) ? (int)(prev->pblk + (lblk - prev->lblk)) : data_goal(inode->ino);
+    int got;
+    int blk = get_avail_blkrun(goal, hole < EXT_MAX_LEN ? hole : EXT_MAX_LEN, &got);
+    if (blk == -1)
+        return -1;
+    *len = got;
+    inode_add_blocks(inode, got);
 
-            struct dirent new_entry;
-            new_entry.valid = 1; // assuming 1 mean in used
-            new_entry.ino = f_ino;
-            strncpy(new_entry.name, fname, name_len);
-            new_entry.name[name_len] = '\0';
-            new_entry.len = name_len;
+    if (prev != NULL && prev->flags == 0 && prev->lblk + prev->len == lblk
+        && prev->pblk + prev->len == blk && prev->len + got <= EXT_MAX_LEN)
+    {
+        prev->len += got;
+        if (ext_write_node(&path, path.depth) != 0)
+            return -1;
+        return blk;
+    }
 
-            memcpy((char*) block+offset, &new_entry, sizeof(struct dirent));
-                
+    struct extent rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.lblk = lblk;
+    rec.pblk = blk;
+    rec.len = got;
+    if (ext_insert(inode, &rec) != 0)
+    {
+        free_blkrun(blk, got);
+        inode_add_blocks(inode, -got);
+        return -1;
+    }
+    return blk;
+}
 
-            if (bio_write(data_blk, block) > 0 )
+/*
+ * Drop everything a node maps in [from, to), freeing the data runs and
+ * the tree blocks left empty. Child nodes still holding records are
+ * written back; the caller writes h. A record reaching past both ends
+ * is the caller's to split.
+ */
+static int ext_trunc_node(struct inode *inode, struct extent_header *h, uint32_t from, uint32_t to) {
+    struct extent *r = ext_records(h);
+    int keep = 0;
+    for (int i = 0; i < h->entries; i++)
+    {
+        if (h->depth == 0)
+        {
+            // Step 1: A leaf record is freed whole or loses its head or tail
+            uint32_t start = r[i].lblk, end = r[i].lblk + r[i].len;
+            uint32_t cut_from = (start > from) ? start : from;
+            uint32_t cut_to = (end < to) ? end : to;
+            if (cut_from < cut_to)
             {
-                if (inodeMap[dir_inode.ino] == NULL)
-                {
-                    inodeMap[dir_inode.ino] = malloc(sizeof(LastDirent));
-                    
-                    inodeMap[dir_inode.ino]->last_block = data_blk;
-                    inodeMap[dir_inode.ino]->last_offset = offset;
-                }
-                else
+                free_blkrun(r[i].pblk + (cut_from - start), cut_to - cut_from);
+                inode_add_blocks(inode, -(int)(cut_to - cut_from));
+                if (cut_from == start && cut_to == end)
+                    continue;
+                if (cut_from == start)
                 {
-                    inodeMap[dir_inode.ino]->last_block = data_blk;
-                    inodeMap[dir_inode.ino]->last_offset = offset;
+                    r[i].pblk += cut_to - start;
+                    r[i].lblk = cut_to;
                 }
-                return 0; // Success
+                r[i].len = (cut_from == start) ? end - cut_to : cut_from - start;
             }
+            r[keep++] = r[i];
+            continue;
+        }
 
+        // Step 2: A child outside the range is untouched. Index entry 0
+        // also covers whatever lies below its key, so it is visited
+        // whenever the range starts below the next key.
+        uint32_t end = (i + 1 < h->entries) ? r[i + 1].lblk : UINT32_MAX;
+        if (end <= from || (i > 0 && r[i].lblk >= to))
+        {
+            r[keep++] = r[i];
+            continue;
+        }
+
+        char buf[BLOCK_SIZE];
+        struct extent_header *child = (struct extent_header*) buf;
+        if (cache_read(r[i].pblk, buf) <= 0 || child->magic != EXT_MAGIC)
+            return -1;
+        if (ext_trunc_node(inode, child, from, to) != 0)
+            return -1;
+
+        // Step 3: Free the child once empty, otherwise keep it
+        if (child->entries == 0)
+        {
+            free_blkno(r[i].pblk);
+            inode_add_blocks(inode, -1);
+            continue;
+        }
+        if (journal_write(r[i].pblk, buf) <= 0)
+            return -1;
+        r[keep++] = r[i];
+    }
+    h->entries = keep;
+    return 0;
+}
+
+/*
+ * Unmap blocks [from, to) of an extent-mapped inode. Freed runs go back
+ * to the bitmap whole, without touching their blocks.
+ */
+static int ext_punch(struct inode *inode, uint32_t from, uint32_t to) {
+
+    // Step 1: An extent reaching past both ends is split first, its tail
+    // moving to a record of its own
+    ExtPath path;
+    if (ext_walk(inode, from, &path) != 0)
+        return -1;
+    int i = path.slot[path.depth];
+    struct extent *r = (i >= 0) ? &ext_records(path.node[path.depth])[i] : NULL;
+    if (r != NULL && r->lblk < from && r->lblk + r->len > to)
+    {
+        struct extent tail = *r;
+        tail.lblk = to;
+        tail.pblk = r->pblk + (to - r->lblk);
+        tail.len = r->lblk + r->len - to;
+
+        free_blkrun(r->pblk + (from - r->lblk), to - from);
+        inode_add_blocks(inode, -(int)(to - from));
+        r->len = from - r->lblk;
+        if (ext_write_node(&path, path.depth) != 0)
+            return -1;
+        return ext_insert(inode, &tail);
+    }
+
+    // Step 2: Everything else only shrinks or goes
+    if (ext_trunc_node(inode, &inode->ext.hdr, from, to) != 0)
+        return -1;
+    if (inode->ext.hdr.entries == 0)
+        ext_init(inode);
+    return 0;
+}
+
+/*
+ * Unmap an extent-mapped inode from logical block from on
+ */
+int ext_truncate(struct inode *inode, uint32_t from) {
+    return ext_punch(inode, from, UINT32_MAX);
+}
+
+// Logical runs a preallocation mapped, so a failed one can be taken back
+typedef struct ExtRuns {
+    struct { uint32_t lblk, len; } *runs;
+    int n;
+    int max;
+} ExtRuns;
+
+static int ext_runs_add(ExtRuns *r, uint32_t lblk, uint32_t len) {
+    if (r->n > 0 && r->runs[r->n - 1].lblk + r->runs[r->n - 1].len == lblk)
+    {
+        r->runs[r->n - 1].len += len;
+        return 0;
+    }
+    if (r->n == r->max)
+    {
+        int max = r->max ? r->max * 2 : 16;
+        void *runs = realloc(r->runs, max * sizeof(*r->runs));
+        if (runs == NULL)
+            return -1;
+        r->runs = runs;
+        r->max = max;
+    }
+    r->runs[r->n].lblk = lblk;
+    r->runs[r->n].len = len;
+    r->n++;
+    return 0;
+}
+
+static int ext_prealloc_runs(struct inode *inode, uint32_t lblk, uint32_t count, ExtRuns *mapped) {
+
+    uint32_t end = lblk + count;
+    while (lblk < end)
+    {
+        ExtPath path;
+        if (ext_walk(inode, lblk, &path) != 0)
+            return -1;
+
+        // Step 1: Skip over the extent holding lblk
+        struct extent_header *leaf = path.node[path.depth];
+        int i = path.slot[path.depth];
+        struct extent *prev = (i >= 0) ? &ext_records(leaf)[i] : NULL;
+        if (prev != NULL && lblk < prev->lblk + prev->len)
+        {
+            lblk = prev->lblk + prev->len;
+            continue;
+        }
+
+        // Step 2: Take one run for the hole, up to the next record at any level
+        uint32_t hole = end - lblk;
+        for (int l = 0; l <= path.depth; l++)
+        {
+            if (path.next[l] - lblk < hole)
+                hole = path.next[l] - lblk;
+        }
+        int goal = (prev != NULL) ? (int)(prev->pblk + (lblk - prev->lblk)) : data_goal(inode->ino);
+        int got;
+        int blk = get_avail_blkrun(goal, hole < EXT_MAX_LEN ? hole : EXT_MAX_LEN, &got);
+        if (blk == -1)
+            return -1;
+        inode_add_blocks(inode, got);
+
+        // Step 3: Grow the unwritten extent before it or add one
+        if (prev != NULL && prev->flags == EXT_UNWRITTEN && prev->lblk + prev->len == lblk
+            && prev->pblk + prev->len == (uint32_t)blk && prev->len + got <= EXT_MAX_LEN)
+        {
+            prev->len += got;
+            if (ext_write_node(&path, path.depth) != 0)
+                return -1;
         }
         else
         {
-            if(dir_inode.indirect_ptr[indirect_idx] != -1)
+            struct extent rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.lblk = lblk;
+            rec.pblk = blk;
+            rec.len = got;
+            rec.flags = EXT_UNWRITTEN;
+            if (ext_insert(inode, &rec) != 0)
             {
-                // indirect ptr is allocated but need to allocate new data block to the inner entries.
-                int avail_data_block = get_avail_blkno();
+                free_blkrun(blk, got);
+                inode_add_blocks(inode, -got);
+                return -1;
+            }
+        }
+        if (ext_runs_add(mapped, lblk, got) != 0)
+        {
+            ext_punch(inode, lblk, lblk + got);
+            return -1;
+        }
+        lblk += got;
+    }
+    return 0;
+}
+
+/*
+ * Back the holes among count blocks from lblk with unwritten extents,
+ * each a run as long as the bitmap has free, without writing any data.
+ * Blocks mapped already are left alone. Returns -1 once the disk is full,
+ * with whatever this call mapped unmapped and freed again.
+ */
+static int ext_prealloc(struct inode *inode, uint32_t lblk, uint32_t count) {
+
+    ExtRuns mapped = { NULL, 0, 0 };
+    int ret = ext_prealloc_runs(inode, lblk, count, &mapped);
+    for (int i = 0; ret != 0 && i < mapped.n; i++)
+        ext_punch(inode, mapped.runs[i].lblk, mapped.runs[i].lblk + mapped.runs[i].len);
+    free(mapped.runs);
+    return ret;
+}
 
-                int blk_num = dir_inode.indirect_ptr[indirect_idx];
+/*
+ * Is lblk backed by an unwritten extent? It reads as a hole but needs no
+ * new block once written.
+ */
+static int ext_unwritten(struct inode *inode, uint32_t lblk) {
+    ExtPath path;
+    if (ext_walk(inode, lblk, &path) != 0)
+        return 0;
+    int i = path.slot[path.depth];
+    struct extent *r = (i >= 0) ? &ext_records(path.node[path.depth])[i] : NULL;
+    return r != NULL && lblk < r->lblk + r->len && (r->flags & EXT_UNWRITTEN);
+}
 
-                // now we need to update inode information as a result on disk
-                time_t current_time = time(NULL);
-                dir_inode.vstat.st_atime = current_time;
-                dir_inode.vstat.st_mtime = current_time;
-                dir_inode.size += sizeof(struct dirent);
-                if (writei(dir_inode.ino, &dir_inode) != 0)
-                    return -1;
+/*
+ * Map logical block lblk of a file or directory to its disk block, and
+ * set *len to how many blocks from there (up to max) are contiguous on
+ * disk, or unmapped for a hole. With alloc set, missing blocks are
+ * allocated; the caller then owns writing the inode back.
+ * Returns -1 if the block is not mapped or the disk is full.
+ */
+int bmap_len(struct inode *inode, int lblk, int max, int alloc, int *len) {
+    return ext_map(inode, lblk, max, alloc, len);
+}
 
-                memset(block, 0, BLOCK_SIZE);
-                memset(first_block, 0, BLOCK_SIZE);
+int bmap(struct inode *inode, int lblk, int alloc) {
+    int len;
+    return bmap_len(inode, lblk, 1, alloc, &len);
+}
+
+
+/*
+ * dentry cache
+ *
+ * Maps (parent ino, name) to the child ino so path walks cost one hash
+ * probe per component. A negative entry (ino == -1) remembers that the
+ * name does not exist. Entries are updated by dir_add()/dir_remove().
+ * dcache_lock guards the whole table; misses are filled while holding
+ * the directory's inode lock so they can't race with dir_add().
+ */
+#define DCACHE_SIZE 4096
+#define DCACHE_BUCKETS 8192
+
+typedef struct DentryEntry {
+    uint32_t parent;    // directory the name lives in
+    int ino;            // child inode number, -1 for a negative entry
+    uint16_t len;       // length of name
+    char name[208];
+    int used;
+    int referenced;     // CLOCK reference bit for eviction
+    int next;           // next slot in the same hash bucket, -1 ends chain
+} DentryEntry;
+
+DentryEntry dcache[DCACHE_SIZE];
+int dcache_buckets[DCACHE_BUCKETS];
+int dcache_hand = 0;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dcache_init() {
+    memset(dcache, 0, sizeof(dcache));
+    for (int i = 0; i < DCACHE_SIZE; i++)
+        dcache[i].next = -1;
+    memset(dcache_buckets, -1, sizeof(dcache_buckets));
+    dcache_hand = 0;
+}
+
+// FNV-1a over the parent ino and the name
+static unsigned int dcache_hash(uint32_t parent, const char *name, size_t len) {
+    unsigned int h = 2166136261u ^ parent;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h % DCACHE_BUCKETS;
+}
+
+static int dcache_find(uint32_t parent, const char *name, size_t len) {
+    for (int i = dcache_buckets[dcache_hash(parent, name, len)]; i != -1; i = dcache[i].next)
+    {
+        DentryEntry *d = &dcache[i];
+        if (d->parent == parent && d->len == len && memcmp(d->name, name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void dcache_unhash(int slot) {
+    DentryEntry *d = &dcache[slot];
+    int *link = &dcache_buckets[dcache_hash(d->parent, d->name, d->len)];
+    while (*link != slot)
+        link = &dcache[*link].next;
+    *link = d->next;
+    d->next = -1;
+    d->used = 0;
+}
+
+/*
+ * Look up name in directory parent.
+ * Returns the child ino, -1 if known not to exist, -2 on a cache miss.
+ */
+int dcache_lookup(uint32_t parent, const char *name, size_t len) {
+    pthread_mutex_lock(&dcache_lock);
+    int slot = dcache_find(parent, name, len);
+    int ino = -2;
+    if (slot != -1)
+    {
+        dcache[slot].referenced = 1;
+        ino = dcache[slot].ino;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return ino;
+}
+
+/*
+ * Record name in directory parent as ino (or -1 for a negative entry)
+ */
+void dcache_add(uint32_t parent, const char *name, size_t len, int ino) {
+    if (len >= sizeof(dcache[0].name))
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+
+    int slot = dcache_find(parent, name, len);
+    if (slot != -1)
+    {
+        dcache[slot].ino = ino;
+        dcache[slot].referenced = 1;
+        pthread_mutex_unlock(&dcache_lock);
+        return;
+    }
+
+    // CLOCK: skip recently used entries once
+    for (;;)
+    {
+        slot = dcache_hand;
+        dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+        if (!dcache[slot].used)
+            break;
+        if (dcache[slot].referenced)
+        {
+            dcache[slot].referenced = 0;
+            continue;
+        }
+        dcache_unhash(slot);
+        break;
+    }
+
+    DentryEntry *d = &dcache[slot];
+    unsigned int b = dcache_hash(parent, name, len);
+    d->parent = parent;
+    d->ino = ino;
+    d->len = len;
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+    d->used = 1;
+    d->referenced = 1;
+    d->next = dcache_buckets[b];
+    dcache_buckets[b] = slot;
+
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Forget name in directory parent
+ */
+void dcache_invalidate(uint32_t parent, const char *name, size_t len) {
+    pthread_mutex_lock(&dcache_lock);
+    int slot = dcache_find(parent, name, len);
+    if (slot != -1)
+        dcache_unhash(slot);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Forget every entry whose parent is the directory dir (e.g. on rmdir)
+ */
+void dcache_purge_dir(uint32_t dir) {
+    pthread_mutex_lock(&dcache_lock);
+    for (int i = 0; i < DCACHE_SIZE; i++)
+    {
+        if (dcache[i].used && dcache[i].parent == dir)
+            dcache_unhash(i);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * hashed directory index
+ *
+ * Small directories keep the packed linear layout. Once a directory
+ * fills DIR_INDEX_THRESHOLD blocks it is converted: logical block 0
+ * becomes a dx_root, and a hash of each name selects the one leaf
+ * block that can hold it. Full leaves are split in hash order, and a
+ * full root grows one level of index nodes, as in ext4's htree.
+ */
+#define DIR_INDEX_THRESHOLD 4
+
+// Fraction of a leaf filled when converting, leaving room to grow
+#define DX_FILL_ENTRIES ((BLOCK_SIZE / sizeof(struct dirent)) * 2 / 3)
+
+// FNV-1a over the name
+static uint32_t dx_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+// Index of the entry covering hash, entry 0 covers everything below entry 1
+static int dx_search(struct dx_entry *entries, int count, uint32_t hash) {
+    int lo = 1, hi = count - 1, found = 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].hash <= hash)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+static void dx_insert_entry(struct dx_entry *entries, uint16_t *count, int pos, uint32_t hash, uint32_t blk) {
+    memmove(&entries[pos + 1], &entries[pos], (*count - pos) * sizeof(struct dx_entry));
+    entries[pos].hash = hash;
+    entries[pos].blk = blk;
+    (*count)++;
+}
+
+// Index blocks visited on the way from the root to a leaf
+typedef struct DxPath {
+    char root_buf[BLOCK_SIZE];
+    char node_buf[BLOCK_SIZE];
+    int root_blk;
+    int node_blk;       // -1 when the root points straight at leaves
+    int root_slot;
+    int node_slot;
+    int leaf_lblk;
+} DxPath;
+
+static int dx_walk(struct inode *dir_inode, uint32_t hash, DxPath *path) {
+
+    path->root_blk = bmap(dir_inode, 0, 0);
+    if (path->root_blk == -1 || cache_read(path->root_blk, path->root_buf) <= 0)
+        return -1;
+
+    struct dx_root *root = (struct dx_root*) path->root_buf;
+    if (root->magic != DX_MAGIC || root->count == 0)
+        return -1;
+
+    path->root_slot = dx_search(root->entries, root->count, hash);
+    path->node_blk = -1;
+    path->leaf_lblk = root->entries[path->root_slot].blk;
+
+    if (root->levels == 1)
+    {
+        path->node_blk = bmap(dir_inode, path->leaf_lblk, 0);
+        if (path->node_blk == -1 || cache_read(path->node_blk, path->node_buf) <= 0)
+            return -1;
+
+        struct dx_node *node = (struct dx_node*) path->node_buf;
+        path->node_slot = dx_search(node->entries, node->count, hash);
+        path->leaf_lblk = node->entries[path->node_slot].blk;
+    }
+    return 0;
+}
+
+int dx_find(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent) {
+
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent));
+    char leaf[BLOCK_SIZE];
+    DxPath path;
+
+    if (dx_walk(dir_inode, dx_hash(fname, name_len), &path) != 0)
+        return -1;
+
+    int leaf_blk = bmap(dir_inode, path.leaf_lblk, 0);
+    const struct dirent *entries = (leaf_blk == -1) ? NULL : cache_view(leaf_blk, leaf);
+    if (entries == NULL)
+        return -1;
+
+    for (int j = 0; j < blk_dir_entries; j++)
+    {
+        if (entries[j].valid && entries[j].len == name_len && strncmp(fname, entries[j].name, name_len) == 0)
+        {
+            memcpy(dirent, &entries[j], sizeof(struct dirent));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Make sure dx_insert() can hook in a child after the one the walk went
+ * through: check the root has room for another index node when one has
+ * to split, and map the block (logical block lblk) a new node would
+ * take. Nothing is written, so a leaf split can still back out.
+ */
+static int dx_insert_prepare(struct inode *dir_inode, DxPath *path, int lblk) {
+
+    struct dx_root *root = (struct dx_root*) path->root_buf;
+    struct dx_node *node = (struct dx_node*) path->node_buf;
+
+    if (root->levels == 0 && root->count < DX_ROOT_LIMIT)
+        return 0;
+    if (root->levels != 0 && node->count < DX_NODE_LIMIT)
+        return 0;
+    if (root->levels != 0 && root->count >= DX_ROOT_LIMIT)
+        return -ENOSPC;
+    return (bmap(dir_inode, lblk, 1) == -1) ? -ENOSPC : 0;
+}
+
+// Hook a new child (hash -> lblk) in after the one the walk went through
+static int dx_insert(struct inode *dir_inode, DxPath *path, uint32_t hash, uint32_t lblk) {
+
+    struct dx_root *root = (struct dx_root*) path->root_buf;
+
+    if (root->levels == 0 && root->count < DX_ROOT_LIMIT)
+    {
+        dx_insert_entry(root->entries, &root->count, path->root_slot + 1, hash, lblk);
+        return journal_write(path->root_blk, root) > 0 ? 0 : -EIO;
+    }
+
+    if (root->levels == 0)
+    {
+        // Root is full: move its entries down into a new index node
+        char node_buf[BLOCK_SIZE];
+        struct dx_node *node = (struct dx_node*) node_buf;
+        int node_lblk = root->nblocks;
+        int node_blk = bmap(dir_inode, node_lblk, 1);
+        if (node_blk == -1)
+            return -ENOSPC;
+        root->nblocks++;
+
+        memset(node_buf, 0, BLOCK_SIZE);
+        node->magic = DX_MAGIC;
+        node->count = root->count;
+        memcpy(node->entries, root->entries, root->count * sizeof(struct dx_entry));
+        dx_insert_entry(node->entries, &node->count, path->root_slot + 1, hash, lblk);
+
+        root->levels = 1;
+        root->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].blk = node_lblk;
+
+        if (journal_write(node_blk, node_buf) <= 0 || journal_write(path->root_blk, root) <= 0)
+            return -EIO;
+        return 0;
+    }
+
+    struct dx_node *node = (struct dx_node*) path->node_buf;
+    if (node->count < DX_NODE_LIMIT)
+    {
+        dx_insert_entry(node->entries, &node->count, path->node_slot + 1, hash, lblk);
+
+        // the root is written too, it carries the block count
+        if (journal_write(path->node_blk, node) <= 0 || journal_write(path->root_blk, root) <= 0)
+            return -EIO;
+        return 0;
+    }
+
+    // Index node is full: split it in two and hook the upper half into the root
+    if (root->count >= DX_ROOT_LIMIT)
+        return -ENOSPC;
+
+    char new_buf[BLOCK_SIZE];
+    struct dx_node *new_node = (struct dx_node*) new_buf;
+    int new_lblk = root->nblocks;
+    int new_blk = bmap(dir_inode, new_lblk, 1);
+    if (new_blk == -1)
+        return -ENOSPC;
+    root->nblocks++;
+
+    int half = node->count / 2;
+    memset(new_buf, 0, BLOCK_SIZE);
+    new_node->magic = DX_MAGIC;
+    new_node->count = node->count - half;
+    memcpy(new_node->entries, &node->entries[half], new_node->count * sizeof(struct dx_entry));
+    node->count = half;
+
+    if (path->node_slot + 1 <= half)
+        dx_insert_entry(node->entries, &node->count, path->node_slot + 1, hash, lblk);
+    else
+        dx_insert_entry(new_node->entries, &new_node->count, path->node_slot + 1 - half, hash, lblk);
+
+    dx_insert_entry(root->entries, &root->count, path->root_slot + 1, new_node->entries[0].hash, new_lblk);
+
+    if (journal_write(path->node_blk, node) <= 0 || journal_write(new_blk, new_buf) <= 0
+        || journal_write(path->root_blk, root) <= 0)
+        return -EIO;
+    return 0;
+}
+
+typedef struct DxSortEntry {
+    uint32_t hash;
+    struct dirent dirent;
+} DxSortEntry;
+
+static int dx_cmp_hash(const void *a, const void *b) {
+    uint32_t ha = ((const DxSortEntry*)a)->hash, hb = ((const DxSortEntry*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+int dx_add(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent));
+    uint32_t hash = dx_hash(fname, name_len);
+    char leaf[BLOCK_SIZE];
+    DxPath path;
+
+    struct dirent new_entry;
+    memset(&new_entry, 0, sizeof(struct dirent));
+    new_entry.valid = 1;
+    new_entry.ino = f_ino;
+    strncpy(new_entry.name, fname, name_len);
+    new_entry.name[name_len] = '\0';
+    new_entry.len = name_len;
+
+    // Step 1: Hash the name down to its leaf
+    if (dx_walk(dir_inode, hash, &path) != 0)
+        return -EIO;
+
+    int leaf_blk = bmap(dir_inode, path.leaf_lblk, 0);
+    if (leaf_blk == -1 || cache_read(leaf_blk, leaf) <= 0)
+        return -EIO;
+
+    // Step 2: Use a free slot in the leaf if there is one
+    struct dirent *entries = (struct dirent*) leaf;
+    int slot = -1;
+    for (int j = 0; j < blk_dir_entries && slot == -1; j++)
+    {
+        if (!entries[j].valid)
+            slot = j;
+    }
+
+    if (slot != -1)
+    {
+        entries[slot] = new_entry;
+        if (journal_write(leaf_blk, leaf) <= 0)
+            return -EIO;
+    }
+    else
+    {
+        // Step 3: Leaf is full, split it in hash order around the median
+        DxSortEntry sorted[BLOCK_SIZE / sizeof(struct dirent) + 1];
+        int n = 0;
+        for (int j = 0; j < blk_dir_entries; j++)
+        {
+            sorted[n].hash = dx_hash(entries[j].name, entries[j].len);
+            sorted[n++].dirent = entries[j];
+        }
+        sorted[n].hash = hash;
+        sorted[n++].dirent = new_entry;
+        qsort(sorted, n, sizeof(DxSortEntry), dx_cmp_hash);
+
+        // equal hashes must stay in the same leaf
+        int split = n / 2;
+        while (split < n && sorted[split].hash == sorted[split - 1].hash)
+            split++;
+        if (split == n)
+        {
+            split = n / 2;
+            while (split > 0 && sorted[split].hash == sorted[split - 1].hash)
+                split--;
+        }
+        if (split == 0)
+            return -ENOSPC; // one hash fills the leaf
+
+        // Map the new leaf and whatever the index needs to take it in
+        // before either leaf is written, the entries moved out of the old
+        // one would be lost otherwise
+        struct dx_root *root = (struct dx_root*) path.root_buf;
+        int new_lblk = root->nblocks;
+        int new_blk = bmap(dir_inode, new_lblk, 1);
+        if (new_blk == -1)
+            return -ENOSPC;
+        root->nblocks++;
+        int ret = dx_insert_prepare(dir_inode, &path, root->nblocks);
+        if (ret != 0)
+            return ret;
+
+        char new_leaf[BLOCK_SIZE];
+        memset(leaf, 0, BLOCK_SIZE);
+        memset(new_leaf, 0, BLOCK_SIZE);
+        for (int j = 0; j < n; j++)
+        {
+            if (j < split)
+                entries[j] = sorted[j].dirent;
+            else
+                ((struct dirent*) new_leaf)[j - split] = sorted[j].dirent;
+        }
+
+        if (journal_write(leaf_blk, leaf) <= 0 || journal_write(new_blk, new_leaf) <= 0)
+            return -EIO;
+
+        ret = dx_insert(dir_inode, &path, sorted[split].hash, new_lblk);
+        if (ret != 0)
+            return ret;
+    }
+
+    // Step 4: Update directory inode
+    time_t current_time = time(NULL);
+    dir_inode->vstat.st_atime = current_time;
+    dir_inode->vstat.st_mtime = current_time;
+    dir_inode->size += sizeof(struct dirent);
+    return (writei(dir_inode->ino, dir_inode) == 0) ? 0 : -EIO;
+}
+
+int dx_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
+
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent));
+    char leaf[BLOCK_SIZE];
+    DxPath path;
+
+    if (dx_walk(dir_inode, dx_hash(fname, name_len), &path) != 0)
+        return -1;
+
+    int leaf_blk = bmap(dir_inode, path.leaf_lblk, 0);
+    if (leaf_blk == -1 || cache_read(leaf_blk, leaf) <= 0)
+        return -1;
+
+    // Leaves are unordered, so a removed entry just leaves a free slot
+    struct dirent *entries = (struct dirent*) leaf;
+    for (int j = 0; j < blk_dir_entries; j++)
+    {
+        if (entries[j].valid && entries[j].len == name_len && strncmp(fname, entries[j].name, name_len) == 0)
+        {
+            memset(&entries[j], 0, sizeof(struct dirent));
+            if (journal_write(leaf_blk, leaf) <= 0)
+                return -1;
 
-                if( bio_read(blk_num , first_block) <= 0 )
-                {
-                    
-                    return -1;
-                }
+            time_t current_time = time(NULL);
+            dir_inode->vstat.st_atime = current_time;
+            dir_inode->vstat.st_mtime = current_time;
+            dir_inode->size -= sizeof(struct dirent);
+            return writei(dir_inode->ino, dir_inode);
+        }
+    }
+    return -1;
+}
 
-                int* blk_nums = (int*) first_block;
+static int dx_readdir_leaf(struct inode *dir_inode, uint32_t lblk, void *buffer, rufs_fill_t filler, off_t offset) {
 
-                // assigning the blk number which is free to the direct ptr
-                blk_nums[inner_entries_idx] = avail_data_block;
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent));
+    char leaf[BLOCK_SIZE];
 
-                if(bio_write(blk_num, first_block) <= 0 )
-                    return -1;
+    int leaf_blk = bmap(dir_inode, lblk, 0);
+    const struct dirent *entries = (leaf_blk == -1) ? NULL : cache_view(leaf_blk, leaf);
+    if (entries == NULL)
+        return -1;
 
-                memset(block,0,BLOCK_SIZE);
+    for (int j = 0; j < blk_dir_entries; j++)
+    {
+        if (!entries[j].valid)
+            continue;
+        struct stat st = { .st_ino = entries[j].ino };
+        if (filler(buffer, entries[j].name, &st, offset) != 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
 
-                struct dirent new_entry;
-                new_entry.valid = 1; // assuming 1 mean in used
-                new_entry.ino = f_ino;
-                strncpy(new_entry.name, fname, name_len);
-                new_entry.name[name_len] = '\0';
-                new_entry.len = name_len;
+int dx_readdir(struct inode *dir_inode, void *buffer, rufs_fill_t filler, off_t offset) {
 
-                memcpy(block, &new_entry, sizeof(struct dirent));
+    char root_buf[BLOCK_SIZE];
+    char node_buf[BLOCK_SIZE];
+    struct dx_root *root = (struct dx_root*) root_buf;
+    struct dx_node *node = (struct dx_node*) node_buf;
 
-                if (bio_write(avail_data_block, block) > 0 )
-                {
-                    if (inodeMap[dir_inode.ino] == NULL)
-                    {
-                        inodeMap[dir_inode.ino] = malloc(sizeof(LastDirent));
-                        
-                        inodeMap[dir_inode.ino]->last_block = avail_data_block;
-                        inodeMap[dir_inode.ino]->last_offset = 0;
-                    }
-                    else
-                    {
-                        inodeMap[dir_inode.ino]->last_block = avail_data_block;
-                        inodeMap[dir_inode.ino]->last_offset = 0;
-                    }
-                    return 0; // Success
-                }
+    int root_blk = bmap(dir_inode, 0, 0);
+    if (root_blk == -1 || cache_read(root_blk, root_buf) <= 0 || root->magic != DX_MAGIC)
+        return -1;
 
-            }
-            else
-            {
-                // if need to allocate both data blk for inner entries and dir_entries data blk
-                int avail_data_block = get_avail_blkno();
-                int sec_avail_data_block = get_avail_blkno();
-
-                dir_inode.indirect_ptr[indirect_idx] = avail_data_block;
-
-                // now we need to update inode information as a result on disk
-                time_t current_time = time(NULL);
-                dir_inode.vstat.st_atime = current_time;
-                dir_inode.vstat.st_mtime = current_time;
-                dir_inode.size += sizeof(struct dirent);
-                if (writei(dir_inode.ino, &dir_inode) != 0)
-                    return -1;
+    for (int i = 0; i < root->count; i++)
+    {
+        if (root->levels == 0)
+        {
+            int ret = dx_readdir_leaf(dir_inode, root->entries[i].blk, buffer, filler, offset);
+            if (ret != 0)
+                return ret;
+            continue;
+        }
 
-                memset(block, 0, BLOCK_SIZE);
-                memset(first_block, 0, BLOCK_SIZE);
+        int node_blk = bmap(dir_inode, root->entries[i].blk, 0);
+        if (node_blk == -1 || cache_read(node_blk, node_buf) <= 0)
+            return -1;
 
-                memcpy(first_block, &sec_avail_data_block, sizeof(int));
+        for (int j = 0; j < node->count; j++)
+        {
+            int ret = dx_readdir_leaf(dir_inode, node->entries[j].blk, buffer, filler, offset);
+            if (ret != 0)
+                return ret;
+        }
+    }
+    return 0;
+}
 
-                if(bio_write(avail_data_block, first_block) <= 0 )
-                    return -1;
+/*
+ * Convert a linear directory to the hashed layout. Entries are sorted by
+ * hash and spread over partly filled leaves in logical blocks 1..n, the
+ * root goes into logical block 0, reusing the linear directory's blocks.
+ */
+int dx_convert(struct inode *dir_inode) {
 
-                struct dirent new_entry;
-                new_entry.valid = 1; // assuming 1 mean in used
-                new_entry.ino = f_ino;
-                strncpy(new_entry.name, fname, name_len);
-                new_entry.name[name_len] = '\0';
-                new_entry.len = name_len;
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent));
+    int total_dir_entries = dir_inode->size/sizeof(struct dirent);
+    char buf[BLOCK_SIZE];
 
-                memcpy(block, &new_entry, sizeof(struct dirent));
+    DxSortEntry *sorted = malloc((total_dir_entries + 1) * sizeof(DxSortEntry));
+    if (sorted == NULL)
+        return -ENOMEM;
 
-                if (bio_write(sec_avail_data_block, block) > 0 )
-                {
-                    int blk_no = dir_inode.indirect_ptr[0];
-                    memset(block, 0 , BLOCK_SIZE);
-                    bio_read(blk_no, block);
-
-                    int* entry = (int*) block;
-
-                    blk_no = entry[0];
-
-                    memset(block, 0 , BLOCK_SIZE);
-                    bio_read(blk_no, block);
-                    struct dirent x;
-                    memcpy(&x, block, sizeof(struct dirent));
-
-                    if (inodeMap[dir_inode.ino] == NULL)
-                    {
-                        inodeMap[dir_inode.ino] = malloc(sizeof(LastDirent));
-                        
-                        inodeMap[dir_inode.ino]->last_block = sec_avail_data_block;
-                        inodeMap[dir_inode.ino]->last_offset = 0;
-                    }
-                    else
-                    {
-                        inodeMap[dir_inode.ino]->last_block = sec_avail_data_block;
-                        inodeMap[dir_inode.ino]->last_offset = 0;
-                    }
-                    return 0; // Success
-                }
+    // Step 1: Read every entry of the linear layout
+    int n = 0;
+    for (int lblk = 0; lblk * blk_dir_entries < total_dir_entries; lblk++)
+    {
+        int data_blk = bmap(dir_inode, lblk, 0);
+        if (data_blk == -1 || cache_read(data_blk, buf) <= 0)
+        {
+            free(sorted);
+            return -EIO;
+        }
 
-            }
+        struct dirent *entries = (struct dirent*) buf;
+        for (int j = 0; j < blk_dir_entries && n < total_dir_entries; j++)
+        {
+            if (!entries[j].valid)
+                continue;
+            sorted[n].hash = dx_hash(entries[j].name, entries[j].len);
+            sorted[n++].dirent = entries[j];
+        }
+    }
+    qsort(sorted, n, sizeof(DxSortEntry), dx_cmp_hash);
+
+    // Step 2: Write the leaves, never splitting equal hashes across two
+    char root_buf[BLOCK_SIZE];
+    struct dx_root *root = (struct dx_root*) root_buf;
+    memset(root_buf, 0, BLOCK_SIZE);
+    root->magic = DX_MAGIC;
+    root->levels = 0;
+    root->nblocks = 1;
+
+    int next = 0;
+    while (next < n || root->count == 0)
+    {
+        int end = next + DX_FILL_ENTRIES;
+        if (end > n)
+            end = n;
+        while (end < n && end > next && sorted[end].hash == sorted[end - 1].hash)
+            end++;
 
+        if (root->count >= DX_ROOT_LIMIT || end - next > blk_dir_entries)
+        {
+            free(sorted);
+            return -ENOSPC;
+        }
 
+        int lblk = root->nblocks;
+        int data_blk = bmap(dir_inode, lblk, 1);
+        if (data_blk == -1)
+        {
+            free(sorted);
+            return -ENOSPC;
         }
 
+        memset(buf, 0, BLOCK_SIZE);
+        for (int j = next; j < end; j++)
+            ((struct dirent*) buf)[j - next] = sorted[j].dirent;
+        if (journal_write(data_blk, buf) <= 0)
+        {
+            free(sorted);
+            return -EIO;
+        }
 
+        root->entries[root->count].hash = (root->count == 0) ? 0 : sorted[next].hash;
+        root->entries[root->count].blk = lblk;
+        root->count++;
+        root->nblocks++;
+        next = end;
     }
-    return -1;
+    free(sorted);
+
+    // Step 3: Write the root over the first linear block and flag the inode
+    int root_blk = bmap(dir_inode, 0, 1);
+    if (root_blk == -1)
+        return -ENOSPC;
+    if (journal_write(root_blk, root_buf) <= 0)
+        return -EIO;
+
+    dir_inode->flags |= I_DIR_INDEXED;
+    dir_inode->size = n * sizeof(struct dirent);
+    return (writei(dir_inode->ino, dir_inode) == 0) ? 0 : -EIO;
 }
 
-// CAN SKIP
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 
-    // Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+/*
+ * directory operations
+ */
+static int dir_find_locked(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+    struct inode i_node;
+    
+    if(readi(ino, &i_node) == -1)
+    {
+        return -1;
+    }
+
+    if (i_node.flags & I_DIR_INDEXED)
+    {
+        return dx_find(&i_node, fname, name_len, dirent);
+    }
+
     int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
-  
-    //     DIRECT POINTERS
-    for(int i=0; i < 16; i++)
+    int total_dir_entries = i_node.size/sizeof(struct dirent); // here i will have the total num of dir entries
+
+    // Step 2: Get data block of current directory from inode, the linear
+    // layout keeps entries packed from logical block 0
+    for(int lblk = 0; lblk * blk_dir_entries < total_dir_entries; lblk++)
     {
-        int data_blk = dir_inode.direct_ptr[i];
-        if (data_blk <= 0) continue; // Skip if block number is invalid
+        int data_blk = bmap(&i_node, lblk, 0);
+        if (data_blk == -1) continue; // Skip if block number is invalid
 
-        // Step 3: Read directory's data block and check each directory entry.
-        memset(block, 0, BLOCK_SIZE);
-        if( bio_read(data_blk , block) <= 0 )
+        // Step 3: Read directory's data block (in place when the disk is mapped) and check each directory entry.
+        const struct dirent* entries = cache_view(data_blk, block);
+        if( entries == NULL )
         {
             return -1;
         }
 
-        struct dirent* entries = (struct dirent*) block;
-
-
-
         for(int j = 0; j<blk_dir_entries; j++)
         {
-            // printf("    ----> The %dth # of entry's name form the Block is %s\n", j, entries[j].name);
-            // fflush(stdout);
             //If the name matches, then copy directory entry to dirent structure
-            if (strncmp(fname, entries[j].name, name_len) == 0 && entries[j].len == name_len)
+            if (entries[j].valid && entries[j].len == name_len && strncmp(fname, entries[j].name, name_len) == 0)
             {
                 // strcmp returns 0 when the two strings are equal.
-                struct dirent new_entry;
-                new_entry.valid = 0;
-                new_entry.name[0] = '\0';
-                new_entry.len = 0;
+                memcpy(dirent, &entries[j], sizeof(struct dirent));
+                return 0;
+            }
+        }
+    }
 
-                int offset = j * sizeof(struct dirent);
+    return -1;
+}
+
+/*
+ * Resolve fname in directory ino through the dentry cache, falling back
+ * to dir_find() on a miss. Returns the child ino, or -1 if not found.
+ */
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
 
-                memset(first_block, 0, BLOCK_SIZE);
+    InodeEntry *e = ilock(ino, 0);
+    if (e == NULL)
+        return -1;
 
-                if( bio_read(inodeMap[dir_inode.ino]->last_block , first_block) <= 0 ) // this the last blk of last dirent
-                {
-                    return -1;
-                }
+    int ret = dir_find_locked(ino, fname, name_len, dirent);
+    iunlock(e);
+    return ret;
+}
 
-                void* temp_dirent = (struct dirent*)malloc(sizeof(struct dirent));
+// Same as dir_lookup() for a caller already holding the directory's lock
+static int dir_lookup_locked(uint32_t ino, const char *fname, size_t name_len) {
 
-                memcpy(temp_dirent, ((char*)first_block + inodeMap[dir_inode.ino]->last_offset), sizeof(struct dirent));
+    int child = dcache_lookup(ino, fname, name_len);
+    if (child != -2)
+        return child;
 
-                struct dirent to_add;
-                memcpy(&to_add, temp_dirent, sizeof(struct dirent));
-                
-                printf("THE NAME OF THE LAST dirent is %s\n", to_add.name);
+    struct dirent d;
+    child = (dir_find_locked(ino, fname, name_len, &d) == 0) ? d.ino : -1;
+    dcache_add(ino, fname, name_len, child);
+    return child;
+}
 
-                memcpy(((char*)first_block + inodeMap[dir_inode.ino]->last_offset), &new_entry, sizeof(struct dirent));
+int dir_lookup(uint32_t ino, const char *fname, size_t name_len) {
 
-                if (bio_write(inodeMap[dir_inode.ino]->last_block , first_block) < 0 )
-                {
-                    return -1;
-                }
+    // hot path: one probe, no inode lock
+    int child = dcache_lookup(ino, fname, name_len);
+    if (child != -2)
+        return child;
 
-                // if both blk is same then needs to read the updated one
-                if(inodeMap[dir_inode.ino]->last_block == data_blk)
-                {
-                     if( bio_read(data_blk , block) <= 0 )
-                    {
-                        return -1;
-                    }
-                }
-                if(inodeMap[dir_inode.ino]->last_block == data_blk && offset != inodeMap[dir_inode.ino]->last_offset)
-                {
-                    memcpy((char*) block+offset, &to_add, sizeof(struct dirent));
+    InodeEntry *e = ilock(ino, 0);
+    if (e == NULL)
+        return -1;
 
-                    if (bio_write(data_blk, block) < 0 )
-                    {
-                        return -1;
-                    }
-                }
+    child = dir_lookup_locked(ino, fname, name_len);
+    iunlock(e);
+    return child;
+}
 
-                // memcpy((char*) block+offset, &to_add, sizeof(struct dirent));
+/*
+ * Linear directories keep their entries packed from logical block 0, so
+ * entry n lives in logical block n / entries-per-block
+ */
+static int dir_add_linear(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 
-                // if (bio_write(data_blk, block) < 0 )
-                // {
-                //     return -1;
-                // }
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
+    int total_dir_entries = dir_inode->size/sizeof(struct dirent);
+    char buf[BLOCK_SIZE];
+
+    // Step 1: Find (or allocate) the block holding the next free slot
+    int lblk = total_dir_entries / blk_dir_entries;
+    int idx = total_dir_entries % blk_dir_entries;
+    int data_blk = bmap(dir_inode, lblk, 1);
+    if (data_blk == -1)
+        return -ENOSPC;
+
+    if (idx == 0)
+        memset(buf, 0, BLOCK_SIZE); // fresh block, nothing to keep
+    else if (cache_read(data_blk, buf) <= 0)
+        return -EIO;
+
+    // Step 2: Add directory entry and write to disk
+    struct dirent *new_entry = (struct dirent*) buf + idx;
+    memset(new_entry, 0, sizeof(struct dirent));
+    new_entry->valid = 1;
+    new_entry->ino = f_ino;
+    strncpy(new_entry->name, fname, name_len);
+    new_entry->name[name_len] = '\0';
+    new_entry->len = name_len;
+
+    if (journal_write(data_blk, buf) <= 0)
+        return -EIO;
+
+    // Step 3: Update directory inode
+    time_t current_time = time(NULL);
+    dir_inode->vstat.st_atime = current_time;
+    dir_inode->vstat.st_mtime = current_time;
+    dir_inode->size += sizeof(struct dirent);
+    return (writei(dir_inode->ino, dir_inode) == 0) ? 0 : -EIO;
+}
 
-                // update the last blk and offset for last dirent
-                if(inodeMap[dir_inode.ino]->last_offset == 0)
-                {
-                    inodeMap[dir_inode.ino]->last_block -= 1;
-                    inodeMap[dir_inode.ino]->last_offset = (BLOCK_SIZE) - sizeof(struct dirent);
-                }
-                else
-                {
-                    inodeMap[dir_inode.ino]->last_offset -= sizeof(struct dirent);
-                }
+static int dir_remove_linear(struct inode *dir_inode, const char *fname, size_t name_len) {
+
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
+    int total_dir_entries = dir_inode->size/sizeof(struct dirent);
+    char buf[BLOCK_SIZE];
+    char last_buf[BLOCK_SIZE];
 
+    if (total_dir_entries == 0)
+        return -1;
+
+    int last_lblk = (total_dir_entries - 1) / blk_dir_entries;
+    int last_idx = (total_dir_entries - 1) % blk_dir_entries;
+
+    for (int lblk = 0; lblk <= last_lblk; lblk++)
+    {
+        int data_blk = bmap(dir_inode, lblk, 0);
+        if (data_blk == -1 || cache_read(data_blk, buf) <= 0)
+            return -1;
 
-                // add(dir_inode.ino, data_blk, offset);
+        struct dirent *entries = (struct dirent*) buf;
+        int n = (lblk == last_lblk) ? last_idx + 1 : blk_dir_entries;
 
-                // bio_write(data_blk, block);
+        for (int j = 0; j < n; j++)
+        {
+            if (!entries[j].valid || entries[j].len != name_len || strncmp(fname, entries[j].name, name_len) != 0)
+                continue;
 
-                time_t current_time = time(NULL);
-                dir_inode.vstat.st_atime = current_time;
-                dir_inode.vstat.st_mtime = current_time;
-                dir_inode.size -= sizeof(struct dirent);
-                if (writei(dir_inode.ino, &dir_inode) != 0)
+            // Fill the hole with the last entry so the directory stays packed
+            if (lblk == last_lblk)
+            {
+                entries[j] = entries[last_idx];
+                memset(&entries[last_idx], 0, sizeof(struct dirent));
+            }
+            else
+            {
+                int last_blk = bmap(dir_inode, last_lblk, 0);
+                if (last_blk == -1 || cache_read(last_blk, last_buf) <= 0)
                     return -1;
 
-                memset(block, 0 , BLOCK_SIZE);
-                return 0;
+                struct dirent *last_entries = (struct dirent*) last_buf;
+                entries[j] = last_entries[last_idx];
+                memset(&last_entries[last_idx], 0, sizeof(struct dirent));
+
+                if (journal_write(last_blk, last_buf) <= 0)
+                    return -1;
             }
+
+            if (journal_write(data_blk, buf) <= 0)
+                return -1;
+
+            time_t current_time = time(NULL);
+            dir_inode->vstat.st_atime = current_time;
+            dir_inode->vstat.st_mtime = current_time;
+            dir_inode->size -= sizeof(struct dirent);
+            return writei(dir_inode->ino, dir_inode);
         }
+    }
+    return -1;
+}
 
+static int dir_add_entry(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+
+    int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
+
+    if(dir_lookup_locked(dir_inode.ino, fname, name_len) != -1)
+    {
+        return -EEXIST; // Check if fname (directory name) is already used in other entries
     }
-    
-    memset(first_block, 0, BLOCK_SIZE);
 
-    //     INDIRECT POINTERS
-    for(int i =0; i<8; i++)
+    if (dir_inode.flags & I_DIR_INDEXED)
+        return dx_add(&dir_inode, f_ino, fname, name_len);
+
+    // Switch to the hashed layout once the linear one gets long to scan
+    if (dir_inode.size / sizeof(struct dirent) >= DIR_INDEX_THRESHOLD * blk_dir_entries)
     {
-        int data_blk = dir_inode.indirect_ptr[i];
-        
-        if (data_blk <= 0) continue; // Skip if block number is invalid
+        int ret = dx_convert(&dir_inode);
+        if (ret != 0)
+            return ret;
+        return dx_add(&dir_inode, f_ino, fname, name_len);
+    }
 
-        // Step 3: Read directory's data block and check each directory entry.
-        if( bio_read(data_blk , first_block) <= 0 )
-        {
-            return -1;
-        }
+    return dir_add_linear(&dir_inode, f_ino, fname, name_len);
+}
 
-        int* blk_nums = (int*) first_block; // storing the direct pointers
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 
-        for(int j = 0; j<(BLOCK_SIZE/sizeof(int)); j++)
-        {
-            if(blk_nums[j] <= 0) continue;
-            memset(block, 0 ,BLOCK_SIZE);
+    // the name is copied into a dirent, NUL terminated
+    if (name_len >= sizeof(((struct dirent *)0)->name))
+        return -ENAMETOOLONG;
 
-            if( bio_read(blk_nums[j] , block) <= 0 )
-            {
-                return -1;
-            }
+    InodeEntry *e = ilock(dir_inode.ino, 1);
+    if (e == NULL)
+        return -EIO;
 
-            struct dirent* entries = (struct dirent*) block;
+    // the caller's copy may be stale by the time we hold the lock
+    int ret = (readi(dir_inode.ino, &dir_inode) == 0) ? 0 : -EIO;
+    if (ret == 0)
+        ret = dir_add_entry(dir_inode, f_ino, fname, name_len);
 
+    if (ret != 0)
+        dcache_invalidate(dir_inode.ino, fname, name_len);
+    else
+        dcache_add(dir_inode.ino, fname, name_len, f_ino); // resolvable without touching the disk
 
-            for(int k = 0; k < blk_dir_entries; k++)
-            {
-                //If the name matches, then copy directory entry to dirent structure
-                if (strncmp(fname, entries[k].name, name_len) == 0 && entries[k].len == name_len)
-                {
-                    // strcmp returns 0 when the two strings are equal.
-                    struct dirent new_entry;
-                    new_entry.valid = 0;
-                    new_entry.name[0] = '\0';
-                    new_entry.len = 0;
-
-                    int offset = k * sizeof(struct dirent);
-
-                    memset(first_block, 0, BLOCK_SIZE);
-
-                    if( bio_read(inodeMap[dir_inode.ino]->last_block , first_block) <= 0 ) // this the last blk of last dirent
-                    {
-                        return -1;
-                    }
-
-                     void* temp_dirent = (struct dirent*)malloc(sizeof(struct dirent));
-
-                    memcpy(temp_dirent, ((char*)first_block + inodeMap[dir_inode.ino]->last_offset), sizeof(struct dirent));
-
-                    struct dirent to_add;
-                    memcpy(&to_add, temp_dirent, sizeof(struct dirent));
-
-                    memcpy(((char*)first_block + inodeMap[dir_inode.ino]->last_offset), &new_entry, sizeof(struct dirent));
-
-                    if (bio_write(inodeMap[dir_inode.ino]->last_block , first_block) < 0 )
-                    {
-                        return -1;
-                    }
-
-                    
-                    // if both blk is same then needs to read the updated one
-                    if(inodeMap[dir_inode.ino]->last_block == data_blk)
-                    {
-                        if( bio_read(data_blk , block) <= 0 )
-                        {
-                            return -1;
-                        }
-                    }
-                    if(inodeMap[dir_inode.ino]->last_block == data_blk && offset != inodeMap[dir_inode.ino]->last_offset)
-                    {
-                        memcpy((char*) block+offset, &to_add, sizeof(struct dirent));
-
-                        if (bio_write(data_blk, block) < 0 )
-                        {
-                            return -1;
-                        }
-                    }
-
-                    // update the last blk and offset for last dirent
-                    if(inodeMap[dir_inode.ino]->last_offset == 0)
-                    {
-                        inodeMap[dir_inode.ino]->last_block -= 1;
-                        inodeMap[dir_inode.ino]->last_offset = (BLOCK_SIZE) - sizeof(struct dirent);
-                    }
-                    else
-                    {
-                        inodeMap[dir_inode.ino]->last_offset -= sizeof(struct dirent);
-                    }
-
-                    time_t current_time = time(NULL);
-                    dir_inode.vstat.st_atime = current_time;
-                    dir_inode.vstat.st_mtime = current_time;
-                    dir_inode.size -= sizeof(struct dirent);
-                    if (writei(dir_inode.ino, &dir_inode) != 0)
-                        return -1;
-
-                    memset(block, 0 , BLOCK_SIZE);
-                    return 0;
-                }
-            }
+    iunlock(e);
+    return ret;
+}
 
-        }
-    }
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 
-    // Step 2: Check if fname exist
+    InodeEntry *e = ilock(dir_inode.ino, 1);
+    if (e == NULL)
+        return -1;
 
-    // Step 3: If exist, then remove it from dir_inode's data block and write to disk
+    // the cached name is stale whatever happens below
+    dcache_invalidate(dir_inode.ino, fname, name_len);
 
-    return 0;
+    int ret = readi(dir_inode.ino, &dir_inode);
+    if (ret == 0 && (dir_inode.flags & I_DIR_INDEXED))
+        ret = dx_remove(&dir_inode, fname, name_len);
+    else if (ret == 0)
+        ret = dir_remove_linear(&dir_inode, fname, name_len);
+
+    iunlock(e);
+    return ret;
 }
+
 /*
  * namei operation
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
     
     // Step 1: Resolve the path name, walk through path, and finally, find its inode.
     // Note: You could either implement it in a iterative way or recursive way
@@ -950,70 +2345,117 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
     // Skip leading '/'
     while (*path == '/') path++;
 
-    // Find the end of the current segment
+    // Find the end of the current segment; a name too long for a
+    // directory entry can't be in one
     const char *end = strchr(path, '/');
+    size_t len = (end == NULL) ? strlen(path) : (size_t)(end - path);
+    if (len >= sizeof(segment)) {
+        return -ENAMETOOLONG;
+    }
 
-    if (end == NULL) {
-        strcpy(segment, path);
-        next_path = path + strlen(path);
-    } else {
-        size_t len = end - path;
-        strncpy(segment, path, len);
-         segment[len] = '\0'; // Null terminate
-        next_path = end + 1;
-    }
-    // Find the inode of the current segment
-    struct dirent dir_entry;
-    if (dir_find(ino, segment, strlen(segment), &dir_entry) != 0) {
+    memcpy(segment, path, len);
+    segment[len] = '\0'; // Null terminate
+    next_path = (end == NULL) ? path + len : end + 1;
+    // Find the inode of the current segment, one dentry cache probe when hot
+    int child = dir_lookup(ino, segment, strlen(segment));
+    if (child == -1) {
         return -1; // Segment not found
     }
 
     // Recursive call with the remaining path
-    return get_node_by_path(next_path, dir_entry.ino, inode);
+    return get_node_by_path(next_path, child, inode);
 }
 
 
 
 /*
- * Make file system
+ * Make file system on a disk of disk_size bytes with room for num_inodes
+ * inodes, spread evenly over its block groups
  */
-int rufs_mkfs() {
+int rufs_mkfs(uint64_t disk_size, uint64_t num_inodes) {
+
+    // Step 1: Work out the geometry
+    uint64_t disk_blocks = disk_size / BLOCK_SIZE;
+    uint64_t num_groups = (disk_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t inodes_per_group = 0, meta_blocks = 0;
+    for (int pass = 0; pass < 2 && num_groups > 0; pass++)
+    {
+        // a group's inode table slice is a whole number of blocks
+        inodes_per_group = (num_inodes + num_groups - 1) / num_groups;
+        inodes_per_group = (inodes_per_group + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+        meta_blocks = GROUP_META_BLKS + inodes_per_group / INODES_PER_BLOCK;
+
+        // leave out a last group too small to hold more than its metadata
+        uint64_t last = disk_blocks - (num_groups - 1) * BITS_PER_BLOCK;
+        if (num_groups == 1 || last > meta_blocks + 1)
+            break;
+        num_groups--;
+        disk_blocks = num_groups * BITS_PER_BLOCK;
+    }
+
+    // the journal takes at most a quarter of group 0
+    uint64_t group0_blocks = (disk_blocks < BITS_PER_BLOCK) ? disk_blocks : BITS_PER_BLOCK;
+    uint64_t journal_blocks = mkfs_journal_blocks;
+    if (journal_blocks > group0_blocks / 4)
+        journal_blocks = group0_blocks / 4;
+
+    if (num_inodes == 0 || disk_blocks > MAX_DISK_BLOCKS || inodes_per_group > BITS_PER_BLOCK
+        || journal_blocks < JOURNAL_MIN_BLOCKS || group0_blocks < 1 + journal_blocks + meta_blocks + 2) {
+        fprintf(stderr, "can't fit %llu inodes and a journal on a %llu byte disk\n",
+                (unsigned long long)num_inodes, (unsigned long long)disk_size);
+        return -1;
+    }
 
     // Call dev_init() to initialize (Create) Diskfile
-    dev_init(diskfile_path);
+    dev_init(diskfile_path, disk_blocks * BLOCK_SIZE);
+    cache_init(CACHE_NUM_BLOCKS);
+    icache_init();
+    dcache_init();
 
     // write superblock information
     sb = malloc(sizeof(struct superblock));
-    
+    memset(sb, 0, sizeof(struct superblock));
+
     sb->magic_num = MAGIC_NUM;
-    sb->max_inum = MAX_INUM;
-    sb->max_dnum = MAX_DNUM;
-    sb->i_bitmap_blk = 1;
-    sb->d_bitmap_blk = 2;
-    sb->i_start_blk =  3;
-    sb->d_start_blk = num_of_inode_blocks + 3;
+    sb->block_size = BLOCK_SIZE;
+    sb->disk_blocks = disk_blocks;
+    sb->max_inum = num_groups * inodes_per_group;
+    sb->max_dnum = disk_blocks - 1 - journal_blocks - num_groups * meta_blocks;
+    sb->num_groups = num_groups;
+    sb->blocks_per_group = BITS_PER_BLOCK;
+    sb->inodes_per_group = inodes_per_group;
+    sb->journal_start = 1;
+    sb->journal_blocks = journal_blocks;
+
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, sb, sizeof(struct superblock));
+    cache_write(0, block);
 
-    bio_write(0, sb);
+    if (journal_format(sb->journal_start, sb->journal_blocks) != 0)
+        return -1;
 
-    // initialize inode bitmap
-    inode_bitmap = (bitmap_t)malloc(MAX_INUM/8);
-    memset (inode_bitmap, 0, (MAX_INUM/8));
+    // Step 2: Initialize the bitmaps of every group. Metadata blocks, blocks
+    // past the end of the disk and inodes past the group's share are taken.
+    if (bitmap_alloc() != 0)
+        return -1;
 
-    // initialize data block bitmap
-    dBlock_bitmap = (bitmap_t)malloc(MAX_DNUM/8);
-    memset (dBlock_bitmap, 0, (MAX_DNUM/8));
+    for (int g = 0; g < (int)num_groups; g++)
+    {
+        int group_start = g * BITS_PER_BLOCK;
+        int group_end = (disk_blocks - group_start < BITS_PER_BLOCK) ? disk_blocks - group_start : BITS_PER_BLOCK;
+        set_bit_range(group_bits(dBlock_bitmap, g), 0, group_data_blk(g) - group_start);
+        set_bit_range(group_bits(dBlock_bitmap, g), group_end, BITS_PER_BLOCK);
+        set_bit_range(group_bits(inode_bitmap, g), inodes_per_group, BITS_PER_BLOCK);
+    }
+    memset(inode_bitmap_dirty, 1, num_groups);
+    memset(dBlock_bitmap_dirty, 1, num_groups);
 
     // update bitmap information for root directory
     set_bitmap(inode_bitmap, 0);
+    bitmap_count();
 
-    bio_write(sb->i_start_blk, inode_bitmap);
+    bitmap_sync();
 
-    bio_write(sb->d_bitmap_blk, dBlock_bitmap);
-
-
-    block = malloc(BLOCK_SIZE);
-    first_block = malloc(BLOCK_SIZE);
-    
     memset(block, 0, BLOCK_SIZE);
     memset(first_block, 0, BLOCK_SIZE);
 
@@ -1025,8 +2467,8 @@ int rufs_mkfs() {
     root_inode.size = 0; // will use to keep track of directory entries
     root_inode.type = S_IFDIR;
     root_inode.link = 2;
-    memset(root_inode.direct_ptr, -1, sizeof(root_inode.direct_ptr));
-    memset(root_inode.indirect_ptr, -1, sizeof(root_inode.indirect_ptr));
+    root_inode.flags = 0;
+    ext_init(&root_inode); // data is mapped by extents
     root_inode.vstat.st_dev = 0;
     root_inode.vstat.st_ino = root_inode.ino;
     root_inode.vstat.st_mode = __S_IFDIR | 0755;  // Directory with permissions 0755
@@ -1044,98 +2486,118 @@ int rufs_mkfs() {
 
     memcpy(block, &root_inode, INODE_SIZE);
 
-    bio_write(sb->i_start_blk, block);
+    cache_write(inode_blk(0), block);
     return 0;
 }
 
 
+/*
+ * Write in-core inodes and bitmaps into their blocks, called by the
+ * journal before every commit
+ */
+static int metadata_sync() {
+    if (inode_sync() != 0 || bitmap_sync() != 0)
+        return -1;
+    return 0;
+}
+
 /*
  * FUSE file operations
+ *
+ * Mount the disk file at diskfile_path, made with the mkfs_* geometry if
+ * it doesn't exist yet. The FUSE front end (rufs_fuse.c) calls this from
+ * its init; tools driving the operations directly call it themselves.
  */
-static void *rufs_init(struct fuse_conn_info *conn) {
+void rufs_mount() {
 
     // Step 1a: If disk file is not found, call mkfs
     if(dev_open(diskfile_path) == -1)
     {
-        rufs_mkfs();
+        if (rufs_mkfs(mkfs_disk_size, mkfs_num_inodes) != 0)
+            exit(EXIT_FAILURE);
+        if (journal_open(sb->journal_start, sb->journal_blocks, metadata_sync, release_blkrun) != 0)
+            exit(EXIT_FAILURE);
     }
     else
     {
         // Step 1b: If disk file is found, just initialize in-memory data structures
         // and read superblock from disk
+        cache_init(CACHE_NUM_BLOCKS);
+        icache_init();
+        dcache_init();
 
-        block = malloc(BLOCK_SIZE);
-        first_block = malloc(BLOCK_SIZE);
         sb = malloc(sizeof(struct superblock));
         
         memset(block, 0, BLOCK_SIZE);
         memset(first_block, 0, BLOCK_SIZE);
 
-        bio_read(0, block);
+        // The geometry comes from the superblock
+        cache_read(0, block);
         memcpy(sb, block, sizeof(struct superblock));
+        if (sb->magic_num != MAGIC_NUM || sb->block_size != BLOCK_SIZE) {
+            fprintf(stderr, "%s is not a rufs image with %d byte blocks\n", diskfile_path, BLOCK_SIZE);
+            exit(EXIT_FAILURE);
+        }
 
-        inode_bitmap = malloc(BLOCK_SIZE);
-        dBlock_bitmap = malloc(BLOCK_SIZE);
+        // Step 1c: Replay the journal before any metadata is read
+        if (journal_open(sb->journal_start, sb->journal_blocks, metadata_sync, release_blkrun) != 0) {
+            fprintf(stderr, "can't replay the journal of %s\n", diskfile_path);
+            exit(EXIT_FAILURE);
+        }
 
-        bio_read(sb->i_bitmap_blk,inode_bitmap);
-        bio_read(sb->d_bitmap_blk,dBlock_bitmap);
+        if (bitmap_load() != 0) {
+            fprintf(stderr, "can't load the bitmaps of %s\n", diskfile_path);
+            exit(EXIT_FAILURE);
+        }
 
     }
-    printf("EXITING INIT\n");
-    fflush(stdout);
-    
-    return NULL;
 }
 
-static void rufs_destroy(void *userdata) {
-
-    printf("INSIDE THE DESTROY\n");
-    
-    //calculating the total number of blocks used
-    bio_read(sb->d_bitmap_blk , dBlock_bitmap);
-    int numBlocksUsed = 0;
-    for(int i = 0; i < MAX_DNUM; i++)
-    {
-        if(get_bitmap(dBlock_bitmap, i) == 1)
-        {
-            numBlocksUsed++;
-        }
-    }
+static int da_sync_all(); // delayed allocation, below with the file I/O
 
-    printf("Num blocks used: %d\n",numBlocksUsed);
+void rufs_unmount() {
 
-    // Step 1: De-allocate in-memory data structures
+    TRACE("INSIDE THE DESTROY\n");
+    
+    TRACE("Num blocks used: %d\n", (int)(sb->max_dnum - dblk_free));
+
+    // Step 1: Write back delayed writes, commit and checkpoint the journal
+    // (inodes and bitmaps included), de-allocate in-memory data structures
+    journal_begin();
+    da_sync_all();
+    journal_end();
+    journal_close();
+    inode_sync();
+    bitmap_sync();
     free(inode_bitmap);
     free(dBlock_bitmap);
-    free(block);
-    free(first_block);
-    // Step 2: Close diskfile
+    free(inode_bitmap_dirty);
+    free(dBlock_bitmap_dirty);
+    free(groups);
+
+    // Step 2: Write back cached blocks and close diskfile
+    cache_destroy();
+    dev_sync();
     dev_close();
 
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
-
-    // Step 1: call get_node_by_path() to get inode from path
-    printf("INSIDE THE RUFS GET ATTR\n");
-    fflush(stdout);
-
-    struct inode inode_data;
-    int res = get_node_by_path(path, 0, &inode_data);
+static int get_node_by_fh(const char *path, uint64_t *fh, struct inode *inode); // open files, below
 
-    if (res != 0) {
-        return -ENOENT;  // File or directory does not exist
-    }
+// Fill the attributes of a file from its inode
+void inode_stat(const struct inode *inode, struct stat *stbuf) {
 
     // Use the information from the inode to fill in the stat structure
-    stbuf->st_mode = inode_data.vstat.st_mode;
-    stbuf->st_nlink = inode_data.link;
-    stbuf->st_uid = inode_data.vstat.st_uid;
-    stbuf->st_gid = inode_data.vstat.st_gid;
-    stbuf->st_size = inode_data.size;
-    stbuf->st_atime = inode_data.vstat.st_atime;
-    stbuf->st_mtime = inode_data.vstat.st_mtime;
-    stbuf->st_ctime = inode_data.vstat.st_ctime;
+    stbuf->st_mode = inode->vstat.st_mode;
+    stbuf->st_nlink = inode->link;
+    stbuf->st_uid = inode->vstat.st_uid;
+    stbuf->st_gid = inode->vstat.st_gid;
+    stbuf->st_size = inode->size;
+    stbuf->st_blocks = inode->vstat.st_blocks;
+    stbuf->st_blksize = BLOCK_SIZE;
+    stbuf->st_atime = inode->vstat.st_atime;
+    stbuf->st_mtime = inode->vstat.st_mtime;
+    stbuf->st_ctime = inode->vstat.st_ctime;
 
 
     if (S_ISDIR(stbuf->st_mode)) {
@@ -1146,18 +2608,35 @@ static int rufs_getattr(const char *path, struct stat *stbuf) {
         // If it's a regular file, set appropriate mode
         stbuf->st_mode |= __S_IFREG;
     }
+}
+
+int rufs_getattr(const char *path, struct stat *stbuf, uint64_t *fh) {
+
+    METRIC_OP(OP_GETATTR);
+
+    // Step 1: call get_node_by_path() to get inode from path
+    TRACE("INSIDE THE RUFS GET ATTR\n");
+
+    struct inode inode_data;
+    int res = get_node_by_fh(path, fh, &inode_data);
+
+    if (res != 0) {
+        return -ENOENT;  // File or directory does not exist
+    }
 
     // Step 2: fill attribute of file into stbuf from inode
+    inode_stat(&inode_data, stbuf);
 
         // stbuf->st_mode   = S_IFDIR | 0755;
         // stbuf->st_nlink  = 2;
         // time(&stbuf->st_mtime);
 
-    printf("EXITING GET ATTR, found inode ino: %d\n", inode_data.ino);
+    TRACE("EXITING GET ATTR, found inode ino: %d\n", inode_data.ino);
     return 0;
 }
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+int rufs_opendir(const char *path, uint64_t *fh) {
+    METRIC_OP(OP_OPENDIR);
 
     // Step 1: Call get_node_by_path() to get inode from path
     struct inode i_node;
@@ -1173,147 +2652,102 @@ static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-
-    printf("        **********INSIDE THE RUFS_READDIR**********\n");
+int dir_readdir_locked(struct inode i_node, void *buffer, rufs_fill_t filler, off_t offset) {
 
     int blk_dir_entries = (BLOCK_SIZE/sizeof(struct dirent)); // # of dir entries can have in 1 blk
 
-    // Step 1: Call get_node_by_path() to get inode from path
-    struct inode i_node;
-    if (get_node_by_path(path, 0, &i_node) != 0) {
-        return -ENOENT; // Return appropriate error code for "No such file or directory"
+    if (i_node.flags & I_DIR_INDEXED) {
+        return dx_readdir(&i_node, buffer, filler, offset);
     }
 
-    // Step 2: Read directory entries from its data blocks, and copy them to filler
+    int total_dir_entries = i_node.size/sizeof(struct dirent);
 
-    //     DIRECT POINTERS
-    for(int i=0; i < 16; i++)
+    // Step 2: Read directory entries from its data blocks, and copy them to filler
+    for(int lblk = 0; lblk * blk_dir_entries < total_dir_entries; lblk++)
     {
-        int data_blk = i_node.direct_ptr[i];
-        if (data_blk <= 0) continue; // Skip if block number is invalid
-
-        // printf("    ----> the data blk # trying to read from disk is %d\n", data_blk);
-        fflush(stdout);
+        int data_blk = bmap(&i_node, lblk, 0);
+        if (data_blk == -1) continue; // Skip if block number is invalid
 
-        // Step 3: Read directory's data block and check each directory entry.
-        memset(block, 0, BLOCK_SIZE);
-        if( bio_read(data_blk , block) <= 0 )
+        // Step 3: Read directory's data block (in place when the disk is mapped) and check each directory entry.
+        const struct dirent* entries = cache_view(data_blk, block);
+        if( entries == NULL )
         {
             return -1;
         }
 
-        struct dirent* entries = (struct dirent*) block;
-
         for(int j = 0; j<blk_dir_entries; j++)
         {
             // Use the filler function to add each directory entry to the buffer
             // The filler function will add the entry to the buffer and return 0 on success
             if(entries[j].valid != 0)
             {
-                if (filler(buffer, entries[j].name, NULL, offset) != 0) {
+                struct stat st = { .st_ino = entries[j].ino };
+                if (filler(buffer, entries[j].name, &st, offset) != 0) {
                     return -ENOMEM; // Return appropriate error code for "Insufficient memory"
                 }
             }
         }
     }
-    
-    memset(first_block, 0, BLOCK_SIZE);
-
-    //     INDIRECT POINTERS
-    for(int i =0; i<8; i++)
-    {
-        int data_blk = i_node.indirect_ptr[i];
-        
-        if (data_blk <= 0) continue; // Skip if block number is invalid
-
-        // Step 3: Read directory's data block and check each directory entry.
-        if( bio_read(data_blk , first_block) <= 0 )
-        {
-            return -1;
-        }
-
-        int* blk_nums = (int*) first_block; // storing the direct pointers
-
-        for(int j = 0; j<(BLOCK_SIZE/sizeof(int)); j++)
-        {
-            if(blk_nums[j] <= 0) continue;
-            memset(block, 0 ,BLOCK_SIZE);
-
-            if( bio_read(blk_nums[j] , block) <= 0 )
-            {
-                return -1;
-            }
-
-            struct dirent* entries = (struct dirent*) block;
-
-            for(int k = 0; k < blk_dir_entries; k++)
-            {
-                if(entries[k].valid != 0)
-                {    if (filler(buffer, entries[k].name, NULL, offset) != 0) {
-                        return -ENOMEM; // Return appropriate error code for "Insufficient memory"
-                    }
-                }
-            }
-        }
-    }
 
     return 0;
 }
 
+int rufs_readdir(const char *path, void *buffer, rufs_fill_t filler, off_t offset, uint64_t *fh) {
+    METRIC_OP(OP_READDIR);
 
-static int rufs_mkdir(const char *path, mode_t mode) {
-
-    // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    printf("INSIDE THE MKDIR\n");
-    fflush(stdout);
-
-    char *path_dup = strdup(path); // Duplicate path to avoid modifying the original
-    if (path_dup == NULL) {
-        return -1; // Memory allocation failed
+    TRACE("        **********INSIDE THE RUFS_READDIR**********\n");
+
+    // Step 1: Call get_node_by_path() to get inode from path
+    struct inode i_node;
+    if (get_node_by_path(path, 0, &i_node) != 0) {
+        return -ENOENT; // Return appropriate error code for "No such file or directory"
     }
 
-    // Find the last occurrence of '/'
-    char *last_slash = strrchr(path_dup, '/');
-    if (last_slash == NULL) {
-        free(path_dup);
-        return -1; // Invalid path (no '/' found)
+    // Step 2: Hold the directory's read lock while its blocks are walked
+    InodeEntry *e = ilock(i_node.ino, 0);
+    if (e == NULL) {
+        return -ENOENT;
     }
 
-    // Extract directory path and file name
-    char *dir_path = path_dup;
-    char *file_name = last_slash + 1;
-    *last_slash = '\0'; // Split the string into directory path and file name
+    int ret = readi(i_node.ino, &i_node);
+    if (ret == 0)
+        ret = dir_readdir_locked(i_node, buffer, filler, offset);
 
-    // Step 2: Call get_node_by_path() to get inode of parent directory
-    struct inode dir_inode;
-    if (get_node_by_path(dir_path, 0 , &dir_inode) != 0) {
-        free(path_dup);
-        return -1; // Parent directory not found
-    }
+    iunlock(e);
+    return ret;
+}
 
-    // Step 3: Call get_avail_ino() to get an available inode number
-    uint16_t new_ino = get_avail_ino();
 
-    // Step 4: Call dir_add() to add directory entry of target directory to parent directory
-    if (dir_add(dir_inode, new_ino, file_name, strlen(file_name)) != 0) {
-        free(path_dup);
-        return -1; // Failed to add directory entry
+/*
+ * Allocate and initialize an inode of the given type (and permissions),
+ * then link it into a directory under name. Returns the new inode number,
+ * or -errno.
+ */
+int node_make(struct inode dir_inode, const char *name, mode_t type) {
+
+    size_t name_len = strlen(name);
+    if (name_len >= sizeof(((struct dirent *)0)->name))
+        return -ENAMETOOLONG;
+
+    // Step 1: Call get_avail_ino() to get an available inode number
+    int new_ino = get_avail_ino(dir_inode.ino, S_ISDIR(type));
+    if (new_ino == -1) {
+        return -ENOSPC;
     }
 
-    // Step 5: Update inode for target directory
+    // Step 2: Update inode for target file or directory
     struct inode new_inode;
 
     new_inode.ino = new_ino;
     new_inode.valid = 1;
     new_inode.size = 0; // will use to keep track of directory entries
-    new_inode.type = __S_IFDIR | 0755; // DIR w/permission
+    new_inode.type = type;
     new_inode.link = 0;
-    memset(new_inode.direct_ptr, -1, sizeof(new_inode.direct_ptr));
-    memset(new_inode.indirect_ptr, -1, sizeof(new_inode.indirect_ptr));
+    new_inode.flags = 0;
+    ext_init(&new_inode); // data is mapped by extents
     new_inode.vstat.st_dev = 0;
     new_inode.vstat.st_ino = new_inode.ino;
-    new_inode.vstat.st_mode = new_inode.type;  // Directory with permissions 0755
+    new_inode.vstat.st_mode = new_inode.type;
     new_inode.vstat.st_nlink = new_inode.link;
     new_inode.vstat.st_uid = getuid();
     new_inode.vstat.st_gid = getgid();
@@ -1325,24 +2759,28 @@ static int rufs_mkdir(const char *path, mode_t mode) {
     time_t current_time = time(NULL);
     new_inode.vstat.st_atime = current_time;
     new_inode.vstat.st_mtime = current_time;
-    // Step 6: Call writei() to write inode to disk
+
+    // Step 3: Call writei() to write inode to disk, before the name is visible to other threads
     if(writei(new_ino, &new_inode) != 0)
     {
-        free(path_dup);
-        return -1; // Failed to write inode
+        free_ino(new_ino);
+        return -EIO; // Failed to write inode
     }
 
-    free(path_dup);
+    // Step 4: Call dir_add() to add its directory entry to the parent directory
+    int ret = dir_add(dir_inode, new_ino, name, name_len);
+    if (ret != 0) {
+        free_ino(new_ino);
+        return ret; // -EEXIST if the name is taken, else why the entry couldn't be added
+    }
 
-    return 0;
+    return new_ino;
 }
 
-// CAN SKIP
-static int rufs_rmdir(const char *path) {
+static int rufs_mkdir(const char *path, mode_t mode) {
 
     // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    printf("INSIDE THE MKDIR\n");
-    fflush(stdout);
+    TRACE("INSIDE THE MKDIR\n");
 
     char *path_dup = strdup(path); // Duplicate path to avoid modifying the original
     if (path_dup == NULL) {
@@ -1361,55 +2799,73 @@ static int rufs_rmdir(const char *path) {
     char *file_name = last_slash + 1;
     *last_slash = '\0'; // Split the string into directory path and file name
 
-    // Step 2: Call get_node_by_path() to get inode of target directory
-    struct inode target_inode;
-    if (get_node_by_path(path, 0 , &target_inode) != 0) {
-        free(path_dup);
-        return -1; // Parent directory not found
-    }
-
-    // Step 3: Clear data block bitmap of target directory
-    int bytes = target_inode.size;
-    if(bytes != 0){
-        free(path_dup);
-        return -ENOTEMPTY;
-    }
-
-    // Step 4: Clear inode bitmap and its data block
-    unset_bitmap(inode_bitmap, target_inode.ino); // clear the inode in bitmap
-    if( bio_write(sb->i_bitmap_blk, inode_bitmap) <= 0)
-        return -1;
-    
-    // Step 5: Call get_node_by_path() to get inode of parent directory
-    struct inode parent_inode;
-    if (get_node_by_path(dir_path, 0 , &parent_inode) != 0) {
+    // Step 2: Call get_node_by_path() to get inode of parent directory
+    struct inode dir_inode;
+    if (get_node_by_path(dir_path, 0 , &dir_inode) != 0) {
         free(path_dup);
         return -1; // Parent directory not found
     }
 
-    // Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-    if( dir_remove(parent_inode, file_name, strlen(file_name)) == -1)
-    {
-        free(path_dup);
-        return -1;
-    }
+    // Step 3: Allocate the new directory and link it into its parent
+    int ret = node_make(dir_inode, file_name, __S_IFDIR | 0755);
 
     free(path_dup);
-    return 0;
+
+    return (ret < 0) ? ret : 0;
 }
 
 // DO NOT NEED TO IMPLEMENT
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
+int rufs_releasedir(const char *path, uint64_t *fh) {
+    METRIC_OP(OP_RELEASEDIR);
     // For this project, you don't need to fill this function
     // But DO NOT DELETE IT!
     return 0;
 }
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+/*
+ * Open file handle, stored in *fh (fuse_file_info->fh) by open and
+ * create. It pins the in-core inode and carries the file's readahead
+ * state.
+ */
+#define RA_MIN_BLOCKS (16 * 1024 / BLOCK_SIZE)          // first window, 16KB
+#define RA_MAX_BLOCKS (2 * 1024 * 1024 / BLOCK_SIZE)    // largest window, 2MB
+
+typedef struct OpenFile {
+    InodeEntry *ie;
+    uint32_t ino;       // of ie, kept here to be read without icache_lock
+    pthread_mutex_t ra_lock;
+    off_t ra_next;      // offset the next sequential read starts at
+    int ra_window;      // readahead window in blocks, 0 after a random read
+    int ra_end;         // first logical block past what was prefetched
+} OpenFile;
+
+OpenFile *of_open(uint32_t ino) {
+    OpenFile *of = calloc(1, sizeof(OpenFile));
+    if (of == NULL)
+        return NULL;
+
+    of->ino = ino;
+    of->ie = iget(ino);
+    if (of->ie == NULL) {
+        free(of);
+        return NULL;
+    }
+    pthread_mutex_init(&of->ra_lock, NULL);
+    return of;
+}
+
+void of_close(OpenFile *of) {
+    if (of == NULL)
+        return;
+    iput(of->ie);
+    pthread_mutex_destroy(&of->ra_lock);
+    free(of);
+}
+
+static int rufs_create(const char *path, mode_t mode, uint64_t *fh) {
 
     // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    printf("INSIDE THE CREATE\n");
-    fflush(stdout);
+    TRACE("INSIDE THE CREATE\n");
 
     char *path_dup = strdup(path); // Duplicate path to avoid modifying the original
     if (path_dup == NULL) {
@@ -1435,56 +2891,44 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
         return -1; // Parent directory not found
     }
 
-    // Step 3: Call get_avail_ino() to get an available inode number
-    uint16_t new_ino = get_avail_ino();
-
-    // Step 4: Call dir_add() to add directory entry of target file to parent directory
-    if (dir_add(dir_inode, new_ino, file_name, strlen(file_name)) != 0) {
+    // Step 3: Allocate the new file and link it into its parent
+    int new_ino = node_make(dir_inode, file_name, __S_IFREG | (mode & 0777));
+    if (new_ino < 0) {
         free(path_dup);
-        return -1; // Failed to add directory entry
+        return new_ino;
     }
 
-    // Step 5: Update inode for target file
-    struct inode new_inode;
-
-    new_inode.ino = new_ino;
-    new_inode.valid = 1;
-    new_inode.size = 0; // will use to keep track of directory entries
-    new_inode.type = __S_IFREG | (mode & 0777); // reg file w/ permission
-    new_inode.link = 0;
-    memset(new_inode.direct_ptr, -1, sizeof(new_inode.direct_ptr));
-    memset(new_inode.indirect_ptr, -1, sizeof(new_inode.indirect_ptr));
-    new_inode.vstat.st_dev = 0;
-    new_inode.vstat.st_ino = new_inode.ino;
-    new_inode.vstat.st_mode = new_inode.type;  // Directory with permissions 0755
-    new_inode.vstat.st_nlink = new_inode.link;
-    new_inode.vstat.st_uid = getuid();
-    new_inode.vstat.st_gid = getgid();
-    new_inode.vstat.st_rdev = 0;
-    new_inode.vstat.st_size = new_inode.size;
-    new_inode.vstat.st_blksize = BLOCK_SIZE;
-    new_inode.vstat.st_blocks = 0;
-
-    time_t current_time = time(NULL);
-    new_inode.vstat.st_atime = current_time;
-    new_inode.vstat.st_mtime = current_time;
-
-
-    // Step 6: Call writei() to write inode to disk
-
-    if(writei(new_ino, &new_inode) != 0)
-    {
+    // Step 4: Pin the in-core inode for the file handle, dropped in release;
+    // without one the file is unlinked again rather than left half made
+    OpenFile *of = of_open(new_ino);
+    if (of == NULL) {
+        node_remove(dir_inode, file_name, 0);
         free(path_dup);
-        return -1; // Failed to write inode
+        return -ENOMEM;
     }
+    *fh = (uint64_t)(uintptr_t) of;
 
     free(path_dup);
 
     return 0;
 }
 
+/*
+ * Get the inode of an open file from its handle, falling back to a path
+ * walk when there is no handle (e.g. truncate by path)
+ */
+static int get_node_by_fh(const char *path, uint64_t *fh, struct inode *inode) {
+    if (fh != NULL && *fh != 0) {
+        pthread_mutex_lock(&icache_lock);
+        memcpy(inode, &((OpenFile*)(uintptr_t) *fh)->ie->inode, INODE_SIZE);
+        pthread_mutex_unlock(&icache_lock);
+        return 0;
+    }
+    return get_node_by_path(path, 0, inode);
+}
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
+int rufs_open(const char *path, uint64_t *fh) {
+    METRIC_OP(OP_OPEN);
 
     // Step 1: Call get_node_by_path() to get inode from path
     struct inode i_node;
@@ -1492,6 +2936,13 @@ static int rufs_open(const char *path, struct fuse_file_info *fi) {
         return -1; // Return appropriate error code for "No such file or directory"
     }
 
+    // Pin the in-core inode while the file is open, dropped in release
+    OpenFile *of = of_open(i_node.ino);
+    if (of == NULL) {
+        return -ENFILE;
+    }
+    *fh = (uint64_t)(uintptr_t) of;
+
     // // Step 2: If not find, return -1
     // if (!i_node.valid) {
     //     return -ENOENT; // Return appropriate error code for "No such file or directory"
@@ -1500,246 +2951,801 @@ static int rufs_open(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+/*
+ * Map logical blocks lblk.. of a file and return how many of them, up to
+ * max, follow each other on disk. *blk_no gets the first one; for a hole
+ * (-1) the run is the unmapped stretch.
+ */
+static int bmap_run(struct inode *inode, int lblk, int max, int alloc, int *blk_no) {
 
-    // Step 1: You could call get_node_by_path() to get inode from path
-    printf("INSIDE READ FUNC\n");
-    struct inode i_node;
-    if (get_node_by_path(path, 0 , &i_node) != 0) {
-        return -1; // Parent directory not found
+    int len;
+    *blk_no = bmap_len(inode, lblk, max, alloc, &len);
+    if (*blk_no == -1)
+        return alloc ? 1 : len;
+
+    int nblks = len;
+    while (nblks < max)
+    {
+        if (bmap_len(inode, lblk + nblks, max - nblks, alloc, &len) != *blk_no + nblks)
+            break;
+        nblks += len;
     }
-    // Step 2: Based on size and offset, read its data blocks from disk
-    int blk_to_write = offset/BLOCK_SIZE; // 0-based indexing
+    return nblks;
+}
+
+/*
+ * Delayed allocation
+ *
+ * Writes are absorbed by a per-inode buffer of dirty pages instead of
+ * going to the disk. Blocks are only allocated when the buffer is
+ * written back, on flush or release of the file or once it holds
+ * DA_MAX_PAGES pages (DA_TOTAL_PAGES for all files together), so the
+ * allocator sees everything written so far and can hand out one
+ * contiguous run, and repeated small writes to a block cost a single
+ * device write. A page for a block that isn't mapped yet reserves one,
+ * and the file reserves what its extent tree may need to take the new
+ * runs in, so a full disk is still reported by write() and writeback
+ * always finds the blocks it was promised.
+ *
+ * The pages of a file are kept sorted by logical block and guarded by
+ * its inode lock: readers overlay them, writers add to them.
+ */
+#define DA_MAX_PAGES    256     // per file, 1MB
+#define DA_TOTAL_PAGES  2048    // all files together, 8MB
+#define DA_DIRECT_BLOCKS 64     // whole blocks a write needs to bypass the buffer
+
+typedef struct DirtyPage {
+    int lblk;
+    int remap;          // the block wasn't mapped or never written
+    int reserved;       // the block wasn't mapped, one is reserved for it
+    char data[BLOCK_SIZE];
+} DirtyPage;
+
+static int da_total = 0;        // pages buffered across all files
+
+// Index of the first page at or after lblk
+static int da_find(InodeEntry *e, int lblk) {
+    int lo = 0, hi = e->npages;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (e->pages[mid]->lblk < lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Tree blocks the writeback of n remapped pages may take: none while the
+ * records fit in the inode, else a split at every level and a new root
+ * level, plus a leaf for every half-full one the records can fill. A
+ * page can split an unwritten extent into two records.
+ */
+static int da_meta_blocks(const struct inode *inode, int n) {
+    const struct extent_header *h = &inode->ext.hdr;
+    if (n == 0 || (h->depth == 0 && h->entries + 2 * n <= EXT_ROOT_MAX))
+        return 0;
+    return h->depth + 2 + 2 * n / (EXT_BLOCK_MAX / 2);
+}
+
+/*
+ * Reserve what one more remapped page needs, its block if it lies over
+ * a hole (data) and any tree blocks on top. Returns -1 if the disk is full.
+ */
+static int da_reserve(InodeEntry *e, struct inode *inode, int data) {
+    int need = e->nreserved + data + da_meta_blocks(inode, e->nremap + 1);
+    if (need > e->reserved)
+    {
+        if (reserve_blkno(need - e->reserved) != 0)
+            return -1;
+        e->reserved = need;
+    }
+    e->nremap++;
+    e->nreserved += data;
+    return 0;
+}
+
+/*
+ * Bring the reservation of a file in line with the pages it has left,
+ * giving back what they no longer need. One cut short by a writeback
+ * that failed halfway is topped up again if the disk still allows.
+ */
+static void da_settle(InodeEntry *e, struct inode *inode) {
+    int need = e->nreserved + da_meta_blocks(inode, e->nremap);
+    if (need < e->reserved)
+        unreserve_blkno(e->reserved - need);
+    else if (need > e->reserved && reserve_blkno(need - e->reserved) != 0)
+        return;
+    e->reserved = need;
+}
+
+/*
+ * Get the dirty page for lblk, adding one if the file has none yet. It
+ * starts out as the block's current data unless the caller is about to
+ * overwrite all of it (whole). Returns NULL with errno set on failure.
+ */
+static DirtyPage *da_page(InodeEntry *e, struct inode *inode, int lblk, int whole) {
+
+    int i = da_find(e, lblk);
+    if (i < e->npages && e->pages[i]->lblk == lblk)
+        return e->pages[i];
+
+    if (e->npages == e->maxpages)
+    {
+        int max = e->maxpages ? 2 * e->maxpages : 16;
+        DirtyPage **pages = realloc(e->pages, max * sizeof(DirtyPage*));
+        if (pages == NULL)
+            return NULL;
+        e->pages = pages;
+        e->maxpages = max;
+    }
+
+    DirtyPage *pg = malloc(sizeof(DirtyPage));
+    if (pg == NULL)
+        return NULL;
+    pg->lblk = lblk;
+
+    // preallocated (unwritten) blocks read as zeros and need no block of
+    // their own, only room to split their extent
+    int blk_no = bmap(inode, lblk, 0);
+    pg->remap = (blk_no == -1);
+    pg->reserved = (blk_no == -1 && !ext_unwritten(inode, lblk));
+    if (pg->remap && da_reserve(e, inode, pg->reserved) != 0)
+    {
+        free(pg);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    if (whole)
+        ;
+    else if (blk_no == -1)
+        memset(pg->data, 0, BLOCK_SIZE);
+    else if (cache_read(blk_no, pg->data) <= 0)
+    {
+        free(pg);
+        errno = EIO;
+        return NULL;
+    }
+
+    memmove(&e->pages[i + 1], &e->pages[i], (e->npages - i) * sizeof(DirtyPage*));
+    e->pages[i] = pg;
+    e->npages++;
+    __atomic_add_fetch(&da_total, 1, __ATOMIC_RELAXED);
+    return pg;
+}
+
+/*
+ * Drop the buffered pages of a file for logical blocks [from, to), e.g.
+ * past its new end when it is truncated, and what was reserved for them
+ */
+static void da_drop(InodeEntry *e, struct inode *inode, int from, int to) {
+    int first = da_find(e, from);
+    int last = da_find(e, to);
+    for (int i = first; i < last; i++)
+    {
+        e->nremap -= e->pages[i]->remap;
+        e->nreserved -= e->pages[i]->reserved;
+        free(e->pages[i]);
+    }
+    memmove(&e->pages[first], &e->pages[last], (e->npages - last) * sizeof(DirtyPage*));
+    __atomic_sub_fetch(&da_total, last - first, __ATOMIC_RELAXED);
+    e->npages -= last - first;
+    da_settle(e, inode);
+}
+
+/*
+ * Drop every buffered page of a file, e.g. when it is deleted
+ */
+static void da_discard(InodeEntry *e) {
+    da_drop(e, &e->inode, 0, INT_MAX);
+}
+
+/*
+ * Allocate and write the buffered pages of a file. Consecutive pages are
+ * mapped together so new blocks come out of the allocator as runs, and
+ * every run goes down with one cache_writev(), all in one device batch.
+ * The allocator draws on the blocks the file reserved. Pages that don't
+ * make it to the disk stay buffered, to be tried again.
+ * The mapping changes land in *inode, which the caller writes back.
+ * Caller holds the inode lock for writing.
+ */
+static int da_writeback(InodeEntry *e, struct inode *inode) {
+
+    int ret = 0;
+    int i = 0;
+
+    dblk_held = e->reserved;
+    bio_batch_begin();
+    while (i < e->npages && ret == 0)
+    {
+        // Step 1: Find the run of pages with consecutive logical blocks
+        int j = i + 1;
+        while (j < e->npages && e->pages[j]->lblk == e->pages[j - 1]->lblk + 1)
+            j++;
+
+        // Step 2: Map it, allocating as few physical runs as the disk allows
+        while (i < j)
+        {
+            int blk_no;
+            int nblks = bmap_run(inode, e->pages[i]->lblk, j - i, 1, &blk_no);
+            if (blk_no == -1) {
+                ret = -ENOSPC;
+                break;
+            }
+            if (nblks > CACHE_IOV_MAX)
+                nblks = CACHE_IOV_MAX;
+
+            // Step 3: Write the pages of the physical run with one call
+            struct iovec iov[CACHE_IOV_MAX];
+            for (int k = 0; k < nblks; k++) {
+                iov[k].iov_base = e->pages[i + k]->data;
+                iov[k].iov_len = BLOCK_SIZE;
+            }
+            if (cache_writev(blk_no, iov, nblks) <= 0) {
+                ret = -EIO;
+                break;
+            }
+            i += nblks;
+        }
+    }
+    int batch = bio_batch_end();
+    if (batch != 0 && ret == 0)
+        ret = -EIO;
+    e->reserved = dblk_held;
+    dblk_held = 0;
+
+    // Step 4: Pages are only safe to drop once the batch is on the disk.
+    // Those left keep their reservation unless they got their block.
+    if (ret == 0)
+    {
+        da_discard(e);
+        return 0;
+    }
+    int done = (batch == 0) ? i : 0;
+    for (int k = done; k < e->npages; k++)
+    {
+        DirtyPage *pg = e->pages[k];
+        if (pg->remap && bmap(inode, pg->lblk, 0) != -1)
+        {
+            e->nremap--;
+            e->nreserved -= pg->reserved;
+            pg->remap = pg->reserved = 0;
+        }
+    }
+    if (done > 0)
+        da_drop(e, inode, 0, e->pages[done - 1]->lblk + 1);
+    else
+        da_settle(e, inode);
+    return ret;
+}
+
+/*
+ * Write back the buffered pages of a file along with its inode.
+ * Caller holds the inode lock for writing.
+ */
+static int da_flush(InodeEntry *e) {
+    if (e->npages == 0)
+        return 0;
+
+    struct inode inode;
+    if (readi(e->inode.ino, &inode) != 0)
+        return -EIO;
+
+    int ret = da_writeback(e, &inode);
+    if (writei(inode.ino, &inode) != 0 && ret == 0)
+        ret = -EIO;
+    return ret;
+}
+
+/*
+ * Write back the buffered pages of every file, e.g. at unmount
+ */
+static int da_sync_all() {
+    int ret = 0;
+    for (int i = 0; i < ICACHE_SIZE; i++)
+    {
+        pthread_mutex_lock(&icache_lock);
+        int ino = (icache[i].used && icache[i].npages > 0) ? icache[i].inode.ino : -1;
+        pthread_mutex_unlock(&icache_lock);
+        if (ino == -1)
+            continue;
+
+        InodeEntry *e = ilock(ino, 1);
+        if (e == NULL || da_flush(e) != 0)
+            ret = -1;
+        if (e != NULL)
+            iunlock(e);
+    }
+    return ret;
+}
+
+/*
+ * Copy the buffered pages overlapping [offset, offset + len) over what
+ * was read from the disk
+ */
+static void da_overlay(InodeEntry *e, char *buffer, off_t offset, size_t len) {
+    int last = (offset + len - 1) / BLOCK_SIZE;
+    for (int i = da_find(e, offset / BLOCK_SIZE); i < e->npages && e->pages[i]->lblk <= last; i++)
+    {
+        off_t pstart = (off_t)e->pages[i]->lblk * BLOCK_SIZE;
+        off_t from = (pstart > offset) ? pstart : offset;
+        off_t to = (pstart + BLOCK_SIZE < offset + (off_t)len) ? pstart + BLOCK_SIZE : offset + (off_t)len;
+        memcpy(buffer + (from - offset), e->pages[i]->data + (from - pstart), to - from);
+    }
+}
+
+// Caller holds the file's inode lock
+static int file_read(InodeEntry *e, struct inode i_node, char *buffer, size_t size, off_t offset) {
+
+    if (offset >= i_node.size)
+        return 0;
+    if (offset + size > i_node.size)
+        size = i_node.size - offset;
+
+    // Step 2: Based on size and offset, map its data blocks in physically contiguous runs
+    int blk_to_read = offset/BLOCK_SIZE; // 0-based indexing
     int bytes_to_skip = (offset % BLOCK_SIZE);// skip the offset
     int retSize = size;
-    // Step 3: copy the correct amount of data from offset to buffer
-    while (size > 0) {
+    char *start = buffer;
 
-        if(blk_to_write < 16)
-        {
-            // FOR DIRECT POINTER
-            int blk_no = i_node.direct_ptr[blk_to_write];
+    // Runs are queued as one batch when the device supports it, so the
+    // partial head and tail blocks are copied out only once it completes.
+    // The head with an offset can only be in the first run and the short
+    // tail only in the last one, so each has a scratch buffer of its own.
+    struct { char *dst; const char *src; size_t len; } partial[2];
+    int npartial = 0;
 
-            size_t bytes_to_write = (size > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size;
-            
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(blk_no, block) <= 0) {
-                return -1;
-            }
+    bio_batch_begin();
+    while (size > 0) {
 
-            memcpy(buffer,  ((char*)block + bytes_to_skip) +1, bytes_to_write);
+        int max_blks = (bytes_to_skip + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int blk_no;
+        int nblks = bmap_run(&i_node, blk_to_read, max_blks, 0, &blk_no);
 
-            size -= bytes_to_write;
-            buffer += bytes_to_write;
-            bytes_to_skip = 0; // after first time, need to allocate from starting
-            blk_to_write++;
+        size_t bytes_to_read = (size_t)nblks * BLOCK_SIZE - bytes_to_skip;
+        if (bytes_to_read > size)
+            bytes_to_read = size;
+
+        if (blk_no == -1)
+        {
+            // never written, reads back as zeros
+            memset(buffer, 0, bytes_to_read);
         }
         else
         {
-            // FOR INDIRECT POINTERS
-            int indir_blk_write = blk_to_write -16;
-            int indirect_idx = indir_blk_write /(BLOCK_SIZE/(sizeof(int)));
-            int inner_entries_idx = indir_blk_write % (BLOCK_SIZE/(sizeof(int)));
+            // Step 3: Read the whole run with one call. Full blocks land in
+            // the caller's buffer, only a partial head or tail block goes
+            // through a scratch buffer.
+            size_t tail = (bytes_to_skip + bytes_to_read) % BLOCK_SIZE;
+            int head_partial = (bytes_to_skip != 0 || bytes_to_read < BLOCK_SIZE);
+            int tail_partial = (nblks > 1 && tail != 0);
+            int full_blks = nblks - head_partial - tail_partial;
+            size_t head = 0;
+            if (head_partial)
+                head = (nblks == 1) ? bytes_to_read : BLOCK_SIZE - bytes_to_skip;
+
+            char *head_buf = (bytes_to_skip != 0) ? block : first_block;
+
+            struct iovec iov[3];
+            int iovcnt = 0;
+            if (head_partial) {
+                iov[iovcnt].iov_base = head_buf;
+                iov[iovcnt++].iov_len = BLOCK_SIZE;
+            }
+            if (full_blks > 0) {
+                iov[iovcnt].iov_base = buffer + head;
+                iov[iovcnt++].iov_len = (size_t)full_blks * BLOCK_SIZE;
+            }
+            if (tail_partial) {
+                iov[iovcnt].iov_base = first_block;
+                iov[iovcnt++].iov_len = BLOCK_SIZE;
+            }
 
+            if (cache_readv(blk_no, iov, iovcnt) <= 0) {
+                bio_batch_end();
+                return -1;
+            }
 
-            int inner_blk_no = i_node.indirect_ptr[indirect_idx];
+            if (head_partial) {
+                partial[npartial].dst = buffer;
+                partial[npartial].src = head_buf + bytes_to_skip;
+                partial[npartial++].len = head;
+            }
+            if (tail_partial) {
+                partial[npartial].dst = buffer + bytes_to_read - tail;
+                partial[npartial].src = first_block;
+                partial[npartial++].len = tail;
+            }
+        }
 
-            if (inner_blk_no == -1) { // If block needs to be assigned
-                inner_blk_no = get_avail_blkno();
-                i_node.indirect_ptr[indirect_idx] = inner_blk_no;
-                memset(block, 0, BLOCK_SIZE);
+        size -= bytes_to_read;
+        buffer += bytes_to_read;
+        bytes_to_skip = 0; // after first time, need to allocate from starting
+        blk_to_read += nblks;
+    }
+    if (bio_batch_end() != 0) {
+        return -1;
+    }
 
-                if (bio_write(inner_blk_no, block) <= 0) {
-                    return -1;
-                }
+    for (int i = 0; i < npartial; i++)
+        memcpy(partial[i].dst, partial[i].src, partial[i].len);
 
-            }
+    // Step 4: Writes still buffered are newer than the disk
+    da_overlay(e, start, offset, retSize);
 
-            size_t bytes_to_write = (size > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size;
 
+    // Only the in-core inode is touched, it is written back with the others
+    i_node.vstat.st_atime = time(NULL);
 
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(inner_blk_no, block) <= 0) {
-                return -1;
-            }
+    if(writei(i_node.ino, &i_node) != 0)
+    {
+        return -1; // Failed to write inode
+    }
+    // Note: this function should return the amount of bytes you copied to buffer
+    return retSize;
+}
+
+/*
+ * Follow the access pattern of an open file after a read of len bytes at
+ * offset. A sequential reader gets a window of blocks prefetched into
+ * the cache, refilled once it has read halfway into it and doubled each
+ * time up to RA_MAX_BLOCKS; a random read collapses the window. Mapping
+ * the window goes through bmap, so the extent tree blocks it
+ * needs are pulled into the cache as well. Caller holds the inode lock.
+ */
+static void file_readahead(OpenFile *of, struct inode *inode, off_t offset, int len) {
+    int last = (offset + len - 1) / BLOCK_SIZE;
+    int file_blks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int start = 0, end = 0;
+
+    pthread_mutex_lock(&of->ra_lock);
+    if (offset == of->ra_next) {
+        if (of->ra_end - (last + 1) < of->ra_window / 2) {
+            // grow the window to at least twice the request size
+            int req_blks = last - offset / BLOCK_SIZE + 1;
+            int window = of->ra_window ? of->ra_window * 2 : RA_MIN_BLOCKS;
+            if (window < 2 * req_blks)
+                window = 2 * req_blks;
+            if (window > RA_MAX_BLOCKS)
+                window = RA_MAX_BLOCKS;
+            of->ra_window = window;
+
+            start = (of->ra_end > last + 1) ? of->ra_end : last + 1;
+            end = last + 1 + window;
+            if (end > file_blks)
+                end = file_blks;
+            if (end > of->ra_end)
+                of->ra_end = end;
+        }
+    } else {
+        of->ra_window = 0;
+        of->ra_end = 0;
+    }
+    of->ra_next = offset + len;
+    pthread_mutex_unlock(&of->ra_lock);
+
+    // prefetch each physically contiguous run of the window; holes are skipped
+    while (start < end) {
+        int blk_no;
+        int nblks = bmap_run(inode, start, end - start, 0, &blk_no);
+        if (blk_no != -1 && cache_prefetch(blk_no, nblks) != 0)
+            break;
+        start += nblks;
+    }
+}
 
-            int* entries = (int*) block;
+// Write straight through to the disk, mapping each block as it goes
+static int file_write_direct(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    // Based on size and offset, map each data block, allocating missing ones
+    int blk_to_write = offset/BLOCK_SIZE; // 0-based indexing
+    int bytes_to_skip = (offset % BLOCK_SIZE);// skip the offset
+    int retSize = size;
+    int ret = retSize;
 
-            int blk_no = entries[inner_entries_idx];
+    // Full-block runs come straight from the FUSE buffer, which stays valid
+    // until we return, so they can all go out as one batch
+    bio_batch_begin();
+    while (size > 0) {
 
-            if (blk_no == 0) { // If block needs to be assigned
-                blk_no = get_avail_blkno();
-                entries[inner_entries_idx] = blk_no;
-                memset(block, 0, BLOCK_SIZE);
+        size_t bytes_to_write = (size > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size;
+        int nblks = 1;
 
-                if (bio_write(blk_no, block) <= 0) {
-                    return -1;
-                }
+        // Write the correct amount of data from offset to disk
+        if (bytes_to_write == BLOCK_SIZE)
+        {
+            // whole aligned blocks: take as many as follow each other on disk
+            // and write them straight from the FUSE buffer with one call
+            int blk_no;
+            nblks = bmap_run(inode, blk_to_write, size / BLOCK_SIZE, 1, &blk_no);
+            if (blk_no == -1) {
+                ret = -ENOSPC;
+                break;
+            }
 
+            bytes_to_write = (size_t)nblks * BLOCK_SIZE;
+            struct iovec iov = { (void*)buffer, bytes_to_write };
+            if (cache_writev(blk_no, &iov, 1) <= 0) {
+                ret = -1;
+                break;
+            }
+        }
+        else
+        {
+            int fresh = (bmap(inode, blk_to_write, 0) == -1);
+            int blk_no = bmap(inode, blk_to_write, 1);
+            if (blk_no == -1) {
+                ret = -ENOSPC;
+                break;
             }
 
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(blk_no, block) <= 0) {
-                return -1;
+            // partial head/tail block: only an existing block has data worth keeping
+            if (fresh)
+                memset(block, 0, BLOCK_SIZE);
+            else if (cache_read(blk_no, block) <= 0) {
+                ret = -1;
+                break;
             }
 
-            memcpy(buffer, ((char*)block + bytes_to_skip) +1, bytes_to_write);
-            if (bio_write(blk_no, block) <= 0) {
-                return -1;
+            memcpy((char*)block + bytes_to_skip, buffer, bytes_to_write);
+            if (cache_write(blk_no, block) <= 0) {
+                ret = -1;
+                break;
             }
+        }
+
+        size -= bytes_to_write;
+        buffer += bytes_to_write;
+        bytes_to_skip = 0; // after first time, need to allocate from starting
+        blk_to_write += nblks;
+    }
+    if (bio_batch_end() != 0 && ret > 0)
+        ret = -1;
+    return ret;
+}
+
+// Copy a write into the file's dirty pages, returns the bytes taken
+static int file_write_pages(InodeEntry *e, struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    int blk_to_write = offset/BLOCK_SIZE; // 0-based indexing
+    int bytes_to_skip = (offset % BLOCK_SIZE);// skip the offset
+    size_t done = 0;
 
+    while (done < size) {
 
-            size -= bytes_to_write;
-            buffer += bytes_to_write;
-            bytes_to_skip = 0; // after first time, need to allocate from starting
-            blk_to_write++;
+        size_t bytes_to_write = (size - done > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size - done;
 
+        // a page that is overwritten completely needs no read of the old data
+        DirtyPage *pg = da_page(e, inode, blk_to_write, bytes_to_write == BLOCK_SIZE);
+        if (pg == NULL) {
+            return done ? (int)done : -errno;
         }
-        
+        memcpy(pg->data + bytes_to_skip, buffer + done, bytes_to_write);
+
+        done += bytes_to_write;
+        bytes_to_skip = 0; // after first time, need to allocate from starting
+        blk_to_write++;
     }
+    return done;
+}
 
+// Caller holds the file's inode lock for writing
+static int file_write(InodeEntry *e, struct inode i_node, const char *buffer, size_t size, off_t offset) {
 
-    time_t current_time = time(NULL);
-    i_node.vstat.st_atime = current_time;
-    i_node.vstat.st_mtime = current_time;
-    
+    int ret;
+
+    // Step 2: A write spanning many whole blocks shows the allocator its
+    // extent by itself. It goes straight down, after the pages buffered
+    // before it so those keep their place ahead of it on the disk.
+    size_t head = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+    if (size > head && (size - head) / BLOCK_SIZE >= DA_DIRECT_BLOCKS)
+    {
+        ret = da_writeback(e, &i_node);
+        if (ret == 0)
+            ret = file_write_direct(&i_node, buffer, size, offset);
+    }
+    else
+    {
+        // Step 3: Anything smaller is buffered, allocated once there is enough of it
+        ret = file_write_pages(e, &i_node, buffer, size, offset);
+        if (ret > 0 && (e->npages >= DA_MAX_PAGES || __atomic_load_n(&da_total, __ATOMIC_RELAXED) >= DA_TOTAL_PAGES))
+        {
+            int err = da_writeback(e, &i_node);
+            if (err != 0)
+                ret = err;
+        }
+    }
+
+    // Step 4: Update the inode info, the mapping may have changed even on failure
+    if (ret > 0)
+    {
+        time_t current_time = time(NULL);
+        i_node.vstat.st_atime = current_time;
+        i_node.vstat.st_mtime = current_time;
+        if (offset + ret > i_node.size)
+            i_node.size = offset + ret;
+        i_node.vstat.st_size = i_node.size;
+    }
 
     if(writei(i_node.ino, &i_node) != 0)
     {
         return -1; // Failed to write inode
     }
-    // Note: this function should return the amount of bytes you copied to buffer
-    return retSize;
+    // Note: this function should return the amount of bytes you write to disk
+    return ret;
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+int rufs_read(const char *path, char *buffer, size_t size, off_t offset, uint64_t *fh) {
+    METRIC_OP(OP_READ);
+
     // Step 1: You could call get_node_by_path() to get inode from path
-    printf("INSIDE WRITE FUNC\n");
+    TRACE("INSIDE READ FUNC\n");
     struct inode i_node;
-    if (get_node_by_path(path, 0 , &i_node) != 0) {
+    if (get_node_by_fh(path, fh, &i_node) != 0) {
         return -1; // Parent directory not found
     }
-    // Step 2: Based on size and offset, read its data blocks from disk
-    int blk_to_write = offset/BLOCK_SIZE; // 0-based indexing
-    int bytes_to_skip = (offset % BLOCK_SIZE);// skip the offset
-    int retSize = size;
 
-    while (size > 0) {
+    // Step 2: Readers of the same file share the inode lock
+    InodeEntry *e = ilock(i_node.ino, 0);
+    if (e == NULL) {
+        return -1;
+    }
 
-        if(blk_to_write < 16)
-        {
-            // FOR DIRECT POINTER
-            int blk_no = i_node.direct_ptr[blk_to_write];
+    int ret = readi(i_node.ino, &i_node);
+    if (ret == 0)
+        ret = file_read(e, i_node, buffer, size, offset);
+    if (ret > 0 && fh != NULL && *fh != 0)
+        file_readahead((OpenFile*)(uintptr_t) *fh, &i_node, offset, ret);
 
-            if (blk_no == -1) { // If block needs to be assigned
-                blk_no = get_avail_blkno();
-                i_node.direct_ptr[blk_to_write] = blk_no;
-            }
+    iunlock(e);
+    if (ret > 0)
+        METRIC_BYTES(OP_READ, ret);
+    return ret;
+}
 
-            size_t bytes_to_write = (size > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size;
-            
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(blk_no, block) <= 0) {
-                return -1;
-            }
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, uint64_t *fh) {
 
-            memcpy( ((char*)block + bytes_to_skip) +1, buffer, bytes_to_write);
-            if (bio_write(blk_no, block) <= 0) {
-                return -1;
-            }
+    // Step 1: You could call get_node_by_path() to get inode from path
+    TRACE("INSIDE WRITE FUNC\n");
+    struct inode i_node;
+    if (get_node_by_fh(path, fh, &i_node) != 0) {
+        return -1; // Parent directory not found
+    }
 
-            size -= bytes_to_write;
-            buffer += bytes_to_write;
-            bytes_to_skip = 0; // after first time, need to allocate from starting
-            blk_to_write++;
-        }
-        else
-        {
-            // FOR INDIRECT POINTERS
-            int indir_blk_write = blk_to_write -16;
-            int indirect_idx = indir_blk_write /(BLOCK_SIZE/(sizeof(int)));
-            int inner_entries_idx = indir_blk_write % (BLOCK_SIZE/(sizeof(int)));
+    // Step 2: Writers take the inode lock exclusively
+    InodeEntry *e = ilock(i_node.ino, 1);
+    if (e == NULL) {
+        return -1;
+    }
 
+    int ret = readi(i_node.ino, &i_node);
+    if (ret == 0)
+        ret = file_write(e, i_node, buffer, size, offset);
 
-            int inner_blk_no = i_node.indirect_ptr[indirect_idx];
+    // Without an open handle there is no release to write the pages back
+    if (ret > 0 && (fh == NULL || *fh == 0)) {
+        int err = da_flush(e);
+        if (err != 0)
+            ret = err;
+    }
 
-            if (inner_blk_no == -1) { // If block needs to be assigned
-                inner_blk_no = get_avail_blkno();
-                i_node.indirect_ptr[indirect_idx] = inner_blk_no;
-                memset(block, 0, BLOCK_SIZE);
+    iunlock(e);
+    return ret;
+}
 
-                if (bio_write(inner_blk_no, block) <= 0) {
-                    return -1;
-                }
+/*
+ * Release the data blocks of a file from logical block from on, e.g. all
+ * of them once it is unlinked. Blocks go back to the bitmap in runs and
+ * are not cleared on the disk. The mapping changes land in *inode, which
+ * the caller writes back.
+ * Caller holds the file's inode lock for writing.
+ */
+static int file_trunc_blocks(struct inode *inode, int from) {
+    return ext_truncate(inode, from);
+}
 
-            }
+/*
+ * Kernel references to inodes under the low-level API: each lookup,
+ * create and mkdir reply takes one, forget drops them. An inode unlinked
+ * while the kernel still references it is an orphan, released by the last
+ * forget. The high-level API leaves ll_nlookup NULL.
+ */
+uint64_t *ll_nlookup = NULL;
+char *ll_orphan = NULL;
+pthread_mutex_t ll_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            size_t bytes_to_write = (size > (BLOCK_SIZE - bytes_to_skip)) ? (BLOCK_SIZE - bytes_to_skip) : size;
+// Keep an unlinked inode as an orphan if the kernel still references it, 1 if kept
+static int ll_keep_orphan(uint32_t ino) {
+    if (ll_nlookup == NULL)
+        return 0;
 
+    pthread_mutex_lock(&ll_lock);
+    int held = (ll_nlookup[ino] > 0);
+    if (held)
+        ll_orphan[ino] = 1;
+    pthread_mutex_unlock(&ll_lock);
+    return held;
+}
 
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(inner_blk_no, block) <= 0) {
-                return -1;
-            }
+/*
+ * Release the data blocks and the inode of a file or directory no longer
+ * reachable by name
+ */
+int node_free(uint32_t ino) {
 
-            int* entries = (int*) block;
+    // Step 1: Clear data block bitmap under its write lock
+    InodeEntry *e = ilock(ino, 1);
+    if (e == NULL) {
+        return -EIO;
+    }
 
-            int blk_no = entries[inner_entries_idx];
+    // writes still buffered for it will never be needed
+    da_discard(e);
 
-            if (blk_no == 0) { // If block needs to be assigned
-                blk_no = get_avail_blkno();
-                entries[inner_entries_idx] = blk_no;
-                memset(block, 0, BLOCK_SIZE);
+    struct inode inode;
+    int ret = readi(ino, &inode);
+    if (ret == 0)
+        ret = file_trunc_blocks(&inode, 0);
+    iunlock(e);
 
-                if (bio_write(blk_no, block) <= 0) {
-                    return -1;
-                }
+    if (ret != 0) {
+        return -EIO;
+    }
 
-            }
+    // Step 2: Clear inode bitmap
+    free_ino(ino);
+    return 0;
+}
 
-            memset(block, 0, BLOCK_SIZE);
-            if (bio_read(blk_no, block) <= 0) {
-                return -1;
-            }
+/*
+ * Remove name from a directory, then release the file (or empty
+ * directory, with is_dir set) it named
+ */
+int node_remove(struct inode parent_inode, const char *name, int is_dir) {
 
-            memcpy( ((char*)block + bytes_to_skip) +1, buffer, bytes_to_write);
-            if (bio_write(blk_no, block) <= 0) {
-                return -1;
-            }
+    // Step 1: Find the target and check it is of the kind asked for
+    size_t name_len = strlen(name);
+    int ino = dir_lookup(parent_inode.ino, name, name_len);
+    if (ino < 0) {
+        return -ENOENT;
+    }
 
-            size -= bytes_to_write;
-            buffer += bytes_to_write;
-            bytes_to_skip = 0; // after first time, need to allocate from starting
-            blk_to_write++;
+    struct inode target_inode;
+    if (readi(ino, &target_inode) != 0) {
+        return -EIO;
+    }
+    if (is_dir && !S_ISDIR(target_inode.type)) {
+        return -ENOTDIR;
+    }
+    if (!is_dir && S_ISDIR(target_inode.type)) {
+        return -EISDIR;
+    }
+    if (is_dir && target_inode.size != 0) {
+        return -ENOTEMPTY;
+    }
 
-        }
-        
+    // Step 2: Call dir_remove() to remove its directory entry in the parent directory
+    if (dir_remove(parent_inode, name, name_len) == -1) {
+        return -ENOENT;
     }
-    // Step 3: Write the correct amount of data from offset to disk
 
-    // Step 4: Update the inode info and write it to disk
-    time_t current_time = time(NULL);
-    i_node.vstat.st_atime = current_time;
-    i_node.vstat.st_mtime = current_time;
-    int new_write_size = (offset + retSize) - (i_node.size);
-    i_node.size += new_write_size;
-    i_node.vstat.st_size = i_node.size;
-    
+    // nothing may still resolve through a removed directory
+    if (is_dir)
+        dcache_purge_dir(ino);
 
-    if(writei(i_node.ino, &i_node) != 0)
-    {
-        return -1; // Failed to write inode
-    }
-    // Note: this function should return the amount of bytes you write to disk
-    return retSize;
+    // Step 3: Release its blocks and inode, only once the name is gone so
+    // another thread can't be handed them while still reachable
+    if (ll_keep_orphan(ino))
+        return 0;
+    return node_free(ino);
 }
 
 // CAN SKIP
 static int rufs_unlink(const char *path) {
 
     // Step 1: Use dirname() and basename() to separate parent directory path and target file name
-    printf("INSIDE THE UNLINK\n");
-    fflush(stdout);
+    TRACE("INSIDE THE UNLINK\n");
 
     char *path_dup = strdup(path); // Duplicate path to avoid modifying the original
     if (path_dup == NULL) {
@@ -1758,151 +3764,526 @@ static int rufs_unlink(const char *path) {
     char *file_name = last_slash + 1;
     *last_slash = '\0'; // Split the string into directory path and file name
 
-    // Step 2: Call get_node_by_path() to get inode of target file
-    struct inode target_inode;
-    if (get_node_by_path(path, 0 , &target_inode) != 0) {
+    // Step 2: Call get_node_by_path() to get inode of parent directory
+    struct inode parent_inode;
+    if (get_node_by_path(dir_path, 0 , &parent_inode) != 0) {
         free(path_dup);
-        return -1; // Parent directory not found
+        return -ENOENT; // Parent directory not found
     }
 
-    // Step 3: Clear data block bitmap of target file
-    int bytes = target_inode.size;
-    int data_blk = bytes / BLOCK_SIZE; // Last block index to clear
+    // Step 3: Remove the name and release the file
+    int ret = node_remove(parent_inode, file_name, 0);
 
-    for (int blk_to_clear = 0; blk_to_clear <= data_blk; blk_to_clear++) {
-        if (blk_to_clear < 16) {
-            // DIRECT POINTERS
-            int blk_no = target_inode.direct_ptr[blk_to_clear];
+    free(path_dup);
+    return ret;
 
-            if (blk_no != -1) { // Check if the block is assigned
-                memset(block, 0, BLOCK_SIZE); // Clear the block
-                if (bio_write(blk_no, block) <= 0) {
-                    free(path_dup);
-                    return -1; // Failed to write block
-                }
-                unset_bitmap(dBlock_bitmap, (blk_no- sb->d_start_blk) ); // clear the block in bitmap
+}
 
-                target_inode.direct_ptr[blk_to_clear] = -1; // Set pointer to -1
-            }
-        }
-        else {
-            // INDIRECT POINTERS
-            int indir_blk_write = blk_to_clear - 16;
-            int indirect_idx = indir_blk_write / (BLOCK_SIZE / sizeof(int));
-            // int inner_entries_idx = indir_blk_write % (BLOCK_SIZE / sizeof(int));
-
-            int indirect_blk_no = target_inode.indirect_ptr[indirect_idx];
-
-            if (indirect_blk_no != -1) { // Check if the indirect block is assigned
-                if (bio_read(indirect_blk_no, block) <= 0) {
-                    free(path_dup);
-                    return -1; // Failed to read indirect block
-                }
+// CAN SKIP
+static int rufs_rmdir(const char *path) {
 
-                int *indirect_block_entries = (int *)block;
-                for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
-                    int blk_no = indirect_block_entries[i];
-                    if (blk_no != 0) {
-                        memset(block, 0, BLOCK_SIZE); // Clear the data block
-                        if (bio_write(blk_no, block) <= 0) {
-                            free(path_dup);
-                            return -1; // Failed to write data block
-                        }
-                        unset_bitmap(dBlock_bitmap, (blk_no- sb->d_start_blk) ); // clear the block in bitmap
-                        indirect_block_entries[i] = 0; // Clear the pointer in the indirect block
-                    }
-                }
+    // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+    TRACE("INSIDE THE RMDIR\n");
 
-                // Clear and write back the indirect block itself
-                memset(block, 0, BLOCK_SIZE);
-                if (bio_write(indirect_blk_no, block) <= 0) {
-                    free(path_dup);
-                    return -1; // Failed to write back the cleared indirect block
-                }
-                unset_bitmap(dBlock_bitmap, (indirect_blk_no- sb->d_start_blk) ); // clear the block in bitmap
-                target_inode.indirect_ptr[indirect_idx] = -1; // Set indirect pointer to -1
-            }
-        }
+    char *path_dup = strdup(path); // Duplicate path to avoid modifying the original
+    if (path_dup == NULL) {
+        return -1; // Memory allocation failed
     }
-    // Step 4: Clear inode bitmap and its data block
-    unset_bitmap(inode_bitmap, target_inode.ino); // clear the inode in bitmap
-    
-    // Step 5: Call get_node_by_path() to get inode of parent directory
+
+    // Find the last occurrence of '/'
+    char *last_slash = strrchr(path_dup, '/');
+    if (last_slash == NULL) {
+        free(path_dup);
+        return -1; // Invalid path (no '/' found)
+    }
+
+    // Extract directory path and file name
+    char *dir_path = path_dup;
+    char *file_name = last_slash + 1;
+    *last_slash = '\0'; // Split the string into directory path and file name
+
+    // Step 2: Call get_node_by_path() to get inode of parent directory
     struct inode parent_inode;
     if (get_node_by_path(dir_path, 0 , &parent_inode) != 0) {
         free(path_dup);
-        return -1; // Parent directory not found
+        return -ENOENT; // Parent directory not found
+    }
+
+    // Step 3: Remove the name and release the directory, if it is empty
+    int ret = node_remove(parent_inode, file_name, 1);
+
+    free(path_dup);
+    return ret;
+}
+
+/*
+ * Zero bytes [from, to) of a file, all within one block: in its buffered
+ * page if it has one, else on the disk if the block was ever written.
+ * Caller holds the file's inode lock for writing.
+ */
+static int file_zero_block(InodeEntry *e, struct inode *inode, off_t from, off_t to) {
+    int lblk = from / BLOCK_SIZE;
+    int off = from % BLOCK_SIZE;
+    if (from >= to)
+        return 0;
+
+    int i = da_find(e, lblk);
+    if (i < e->npages && e->pages[i]->lblk == lblk)
+    {
+        memset(e->pages[i]->data + off, 0, to - from);
+        return 0;
     }
 
-    // Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-    if( dir_remove(parent_inode, file_name, strlen(file_name)) == -1)
+    int blk_no = bmap(inode, lblk, 0);
+    if (blk_no == -1)
+        return 0;
+    if (cache_read(blk_no, block) <= 0)
+        return -EIO;
+    memset((char*)block + off, 0, to - from);
+    return (cache_write(blk_no, block) > 0) ? 0 : -EIO;
+}
+
+/*
+ * Set the size of a file. Shrinking drops its buffered pages and blocks
+ * past the new end, preallocated ones included, and zeroes the rest of
+ * the last block, so the file reads back zeros if it grows again.
+ * Growing only moves the size, the new part is a hole.
+ */
+int file_truncate(uint32_t ino, off_t size) {
+
+    // Step 1: Only a regular file, and only as far as it can be mapped
+    if (size < 0)
+        return -EINVAL;
+
+    InodeEntry *e = ilock(ino, 1);
+    if (e == NULL)
+        return -EIO;
+
+    struct inode inode;
+    int ret = readi(ino, &inode) == 0 ? 0 : -EIO;
+    if (ret == 0 && S_ISDIR(inode.type))
+        ret = -EISDIR;
+    if (ret == 0 && (size + BLOCK_SIZE - 1) / BLOCK_SIZE > (off_t)UINT32_MAX)
+        ret = -EFBIG;
+
+    // Step 2: Not growing, cut the buffered pages and the mapping at the
+    // first block wholly past the end, and clear the rest of the last one
+    if (ret == 0 && (uint64_t)size <= inode.size)
     {
-        free(path_dup);
-        return -1;
+        int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        da_drop(e, &inode, keep, INT_MAX);
+        ret = file_trunc_blocks(&inode, keep) == 0 ? 0 : -EIO;
+        if (ret == 0 && size % BLOCK_SIZE != 0)
+            ret = file_zero_block(e, &inode, size, (off_t)keep * BLOCK_SIZE);
     }
 
-    free(path_dup);
-    return 0;
+    // Step 3: Update the inode info, the mapping may have changed even on failure
+    if (ret == 0 && (uint64_t)size != inode.size)
+    {
+        time_t current_time = time(NULL);
+        inode.size = size;
+        inode.vstat.st_size = size;
+        inode.vstat.st_mtime = current_time;
+        inode.vstat.st_ctime = current_time;
+    }
+    if (writei(ino, &inode) != 0 && ret == 0)
+        ret = -EIO;
 
+    iunlock(e);
+    return ret;
 }
 
-// DO NOT NEED TO DO THIS
-static int rufs_truncate(const char *path, off_t size) {
-    // For this project, you don't need to fill this function
-    // But DO NOT DELETE IT!
-    return 0;
+/*
+ * Set the times of a file, to the second as the inode keeps them. A NULL
+ * time or UTIME_OMIT leaves it alone, UTIME_NOW takes the current time.
+ * The change time follows unless it is given too, as the kernel does
+ * under the write-back cache, where it owns all three.
+ */
+static void time_set(time_t *field, const struct timespec *ts, time_t now) {
+    if (ts == NULL || ts->tv_nsec == UTIME_OMIT)
+        return;
+    *field = (ts->tv_nsec == UTIME_NOW) ? now : ts->tv_sec;
 }
 
-static int rufs_release(const char *path, struct fuse_file_info *fi) {
-    // For this project, you don't need to fill this function
-    // But DO NOT DELETE IT!
-    return 0;
+int file_set_times(uint32_t ino, const struct timespec *atime, const struct timespec *mtime, const struct timespec *ctime) {
+
+    InodeEntry *e = ilock(ino, 1);
+    if (e == NULL)
+        return -EIO;
+
+    struct inode inode;
+    int ret = readi(ino, &inode) == 0 ? 0 : -EIO;
+    if (ret == 0)
+    {
+        time_t current_time = time(NULL);
+        struct timespec now = { current_time, 0 };
+        time_set(&inode.vstat.st_atime, atime, current_time);
+        time_set(&inode.vstat.st_mtime, mtime, current_time);
+        time_set(&inode.vstat.st_ctime, ctime ? ctime : &now, current_time);
+        ret = writei(ino, &inode) == 0 ? 0 : -EIO;
+    }
+
+    iunlock(e);
+    return ret;
 }
 
-static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-    // For this project, you don't need to fill this function
-    // But DO NOT DELETE IT!
-    return 0;
+/*
+ * Preallocate [offset, offset + len) of a file, or punch a hole in it.
+ * Preallocated runs come straight from the bitmap as unwritten extents,
+ * which read as zeros until written, and nothing is written to them.
+ * Punching unmaps the whole blocks in the range and zeroes the partial
+ * ones at its edges.
+ */
+static int file_fallocate(uint32_t ino, int mode, off_t offset, off_t len) {
+
+    // Step 1: Check the request
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0)
+        return -EINVAL;
+    if ((offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE > (off_t)UINT32_MAX)
+        return -EFBIG;
+
+    InodeEntry *e = ilock(ino, 1);
+    if (e == NULL)
+        return -EIO;
+
+    struct inode inode;
+    int ret = readi(ino, &inode) == 0 ? 0 : -EIO;
+    if (ret == 0 && S_ISDIR(inode.type))
+        ret = -EISDIR;
+
+    off_t end = offset + len;
+    if (ret == 0 && (mode & FALLOC_FL_PUNCH_HOLE))
+    {
+        // Step 2a: Whole blocks go, buffered pages included; a block the
+        // range only partly covers is zeroed
+        int first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int last = end / BLOCK_SIZE;
+        if (first < last)
+        {
+            da_drop(e, &inode, first, last);
+            ret = ext_punch(&inode, first, last) == 0 ? 0 : -EIO;
+        }
+        // a range inside one block is all head
+        off_t head_end = (first > last) ? end : (off_t)first * BLOCK_SIZE;
+        off_t tail_start = (first > last) ? end : (off_t)last * BLOCK_SIZE;
+        if (ret == 0)
+            ret = file_zero_block(e, &inode, offset, head_end);
+        if (ret == 0)
+            ret = file_zero_block(e, &inode, tail_start, end);
+    }
+    else if (ret == 0)
+    {
+        // Step 2b: Back the holes in the range in as few runs as the disk allows
+        int first = offset / BLOCK_SIZE;
+        int last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (ext_prealloc(&inode, first, last - first) != 0)
+            ret = -ENOSPC;
+        if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && (uint64_t)end > inode.size)
+        {
+            inode.size = end;
+            inode.vstat.st_size = end;
+        }
+    }
+
+    // Step 3: Update the inode info, the mapping may have changed even on failure
+    if (ret == 0)
+    {
+        time_t current_time = time(NULL);
+        inode.vstat.st_ctime = current_time;
+        if (mode & FALLOC_FL_PUNCH_HOLE)
+            inode.vstat.st_mtime = current_time;
+    }
+    if (writei(ino, &inode) != 0 && ret == 0)
+        ret = -EIO;
+
+    iunlock(e);
+    return ret;
 }
 
-static int rufs_utimens(const char *path, const struct timespec tv[2]) {
-    // For this project, you don't need to fill this function
-    // But DO NOT DELETE IT!
+static int rufs_truncate(const char *path, off_t size, uint64_t *fh) {
+    struct inode inode;
+    if (get_node_by_fh(path, fh, &inode) != 0)
+        return -ENOENT;
+    return file_truncate(inode.ino, size);
+}
+
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t len, uint64_t *fh) {
+    struct inode inode;
+    if (get_node_by_fh(path, fh, &inode) != 0)
+        return -ENOENT;
+    return file_fallocate(inode.ino, mode, offset, len);
+}
+
+int rufs_release(const char *path, uint64_t *fh) {
+    METRIC_OP(OP_RELEASE);
+    OpenFile *of = (OpenFile*)(uintptr_t) *fh;
+
+    // Allocate and write back what is still buffered for the file
+    int ret = 0;
+    journal_begin();
+    InodeEntry *e = ilock(of->ino, 1);
+    if (e != NULL) {
+        ret = da_flush(e);
+        iunlock(e);
+    }
+    journal_end();
+
+    // Drop the in-core inode reference taken by open/create
+    of_close(of);
+    *fh = 0;
+    return ret;
+}
+
+/*
+ * close(2) ends up here: write back the file's buffered pages, allocating
+ * their blocks, so errors reach the caller. Nothing is made durable, that
+ * is what fsync is for.
+ */
+int rufs_flush(const char * path, uint64_t *fh) {
+    METRIC_OP(OP_FLUSH);
+    if (fh == NULL || *fh == 0)
+        return 0;
+
+    journal_begin();
+    InodeEntry *e = ilock(((OpenFile*)(uintptr_t) *fh)->ino, 1);
+    int ret = (e != NULL) ? da_flush(e) : -EIO;
+    if (e != NULL)
+        iunlock(e);
+    journal_end();
+    return ret;
+}
+
+/*
+ * Write back the file data of an inode still dirty in the cache, run by
+ * run of its mapping
+ */
+static int file_flush_blocks(struct inode *inode) {
+    int nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int lblk = 0; lblk < nblocks; )
+    {
+        int len;
+        int blk_no = bmap_len(inode, lblk, nblocks - lblk, 0, &len);
+        if (blk_no != -1 && cache_flush_range(blk_no, len) != 0)
+            return -EIO;
+        lblk += (len > 0) ? len : 1;
+    }
     return 0;
 }
 
+/*
+ * Make a file durable. Its buffered pages and cached data go down first,
+ * then the journal is committed if it still holds a change to the inode
+ * (for fdatasync, one the data depends on); if not, a bare barrier does.
+ * Concurrent callers share commits and barriers.
+ */
+int rufs_fsync(const char *path, int datasync, uint64_t *fh) {
+    METRIC_OP(OP_FSYNC);
+
+    // Step 1: Find the inode, through the handle when there is one
+    struct inode inode;
+    if (get_node_by_fh(path, fh, &inode) != 0)
+        return -ENOENT;
+
+    // Step 2: Allocate and write back its data
+    journal_begin();
+    InodeEntry *e = ilock(inode.ino, 1);
+    if (e == NULL)
+    {
+        journal_end();
+        return -EIO;
+    }
+    int ret = da_flush(e);
+    if (ret == 0)
+        ret = file_flush_blocks(&e->inode);
+
+    pthread_mutex_lock(&icache_lock);
+    unsigned tid = datasync ? e->dtid : e->tid;
+    pthread_mutex_unlock(&icache_lock);
+    iunlock(e);
+    journal_end();
+    if (ret != 0)
+        return ret;
+
+    // Step 3: One commit or barrier makes it durable
+    return (journal_sync(tid) == 0) ? 0 : -EIO;
+}
+
+/*
+ * Directory blocks are metadata, so whatever the journal holds is
+ * committed
+ */
+int rufs_fsyncdir(const char *path, int datasync, uint64_t *fh) {
+    METRIC_OP(OP_FSYNCDIR);
+    struct inode inode;
+    if (get_node_by_path(path, 0, &inode) != 0)
+        return -ENOENT;
+    return (journal_sync(journal_tid()) == 0) ? 0 : -EIO;
+}
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/*
+ * Find the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset,
+ * a block at a time. Preallocated blocks never written count as a hole,
+ * buffered pages as data even over one.
+ * There is an implicit hole at the end of the file; past it there is
+ * nothing to find. Caller holds the file's inode lock.
+ */
+static off_t file_seek_hole(InodeEntry *e, struct inode *inode, off_t offset, int whence) {
+    if (offset < 0 || (uint64_t)offset >= inode->size)
+        return -ENXIO;
+
+    int nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int lblk = offset / BLOCK_SIZE;
+    while (lblk < nblocks)
+    {
+        // Step 1: Size up the stretch from lblk that is all data or all hole
+        int len;
+        int data = (bmap_len(inode, lblk, nblocks - lblk, 0, &len) != -1);
+        int i = da_find(e, lblk);
+        if (!data && i < e->npages && e->pages[i]->lblk == lblk)
+        {
+            data = 1;
+            for (len = 1; i + len < e->npages && e->pages[i + len]->lblk == lblk + len; len++)
+                ;
+        }
+        else if (!data && i < e->npages && e->pages[i]->lblk < lblk + len)
+        {
+            len = e->pages[i]->lblk - lblk;
+        }
+
+        // Step 2: Stop at the first stretch of the kind asked for
+        if (data == (whence == SEEK_DATA))
+        {
+            off_t at = (off_t)lblk * BLOCK_SIZE;
+            return (at > offset) ? at : offset;
+        }
+        lblk += (len > 0) ? len : 1;
+    }
+    return (whence == SEEK_DATA) ? -ENXIO : (off_t)inode->size;
+}
+
+/*
+ * SEEK_DATA and SEEK_HOLE. FUSE only passes these down from 3.8 on, and
+ * handles the other whence values itself.
+ */
+off_t rufs_lseek(const char *path, off_t offset, int whence, uint64_t *fh) {
+    METRIC_OP(OP_LSEEK);
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return -EINVAL;
+
+    struct inode inode;
+    if (get_node_by_fh(path, fh, &inode) != 0)
+        return -ENOENT;
+
+    InodeEntry *e = ilock(inode.ino, 0);
+    if (e == NULL)
+        return -EIO;
+    off_t ret = (readi(inode.ino, &inode) == 0) ? file_seek_hole(e, &inode, offset, whence) : -EIO;
+    iunlock(e);
+    return ret;
+}
+
+static int rufs_utimens(const char *path, const struct timespec tv[2], uint64_t *fh) {
+
+    struct inode inode;
+    if (get_node_by_fh(path, fh, &inode) != 0)
+        return -ENOENT;
+
+    // NULL sets both to now, as utimensat() does
+    static const struct timespec now[2] = { { 0, UTIME_NOW }, { 0, UTIME_NOW } };
+    if (tv == NULL)
+        tv = now;
+    return file_set_times(inode.ino, &tv[0], &tv[1], NULL);
+}
+
 
-static struct fuse_operations rufs_ope = {
-    .init        = rufs_init,
-    .destroy    = rufs_destroy,
+/*
+ * Operations changing metadata run inside a journal handle, taken before
+ * any inode lock, so a commit never catches one halfway
+ */
+int rufs_mkdir_tx(const char *path, mode_t mode) {
+    METRIC_OP(OP_MKDIR);
+    journal_begin();
+    int ret = rufs_mkdir(path, mode);
+    journal_end();
+    return ret;
+}
 
-    .getattr    = rufs_getattr,
-    .readdir    = rufs_readdir,
-    .opendir    = rufs_opendir,
-    .releasedir    = rufs_releasedir,
-    .mkdir        = rufs_mkdir,
-    .rmdir        = rufs_rmdir,
+int rufs_rmdir_tx(const char *path) {
+    METRIC_OP(OP_RMDIR);
+    journal_begin();
+    int ret = rufs_rmdir(path);
+    journal_end();
+    return ret;
+}
 
-    .create        = rufs_create,
-    .open        = rufs_open,
-    .read         = rufs_read,
-    .write        = rufs_write,
-    .unlink        = rufs_unlink,
+int rufs_create_tx(const char *path, mode_t mode, uint64_t *fh) {
+    METRIC_OP(OP_CREATE);
+    journal_begin();
+    int ret = rufs_create(path, mode, fh);
+    journal_end();
+    return ret;
+}
 
-    .truncate   = rufs_truncate,
-    .flush      = rufs_flush,
-    .utimens    = rufs_utimens,
-    .release    = rufs_release
-};
+int rufs_write_tx(const char *path, const char *buffer, size_t size, off_t offset, uint64_t *fh) {
+    METRIC_OP(OP_WRITE);
+    journal_begin();
+    int ret = rufs_write(path, buffer, size, offset, fh);
+    journal_end();
+
+    // blocks freed by a transaction still open only come back with its commit
+    if (ret == -ENOSPC && journal_reclaim()) {
+        journal_begin();
+        ret = rufs_write(path, buffer, size, offset, fh);
+        journal_end();
+    }
+    if (ret > 0)
+        METRIC_BYTES(OP_WRITE, ret);
+    return ret;
+}
 
+int rufs_unlink_tx(const char *path) {
+    METRIC_OP(OP_UNLINK);
+    journal_begin();
+    int ret = rufs_unlink(path);
+    journal_end();
+    return ret;
+}
 
-int main(int argc, char *argv[]) {
-    int fuse_stat;
+int rufs_truncate_tx(const char *path, off_t size, uint64_t *fh) {
+    METRIC_OP(OP_TRUNCATE);
+    journal_begin();
+    int ret = rufs_truncate(path, size, fh);
+    journal_end();
+    return ret;
+}
 
-    getcwd(diskfile_path, PATH_MAX);
-    strcat(diskfile_path, "/DISKFILE");
+int rufs_fallocate_tx(const char *path, int mode, off_t offset, off_t len, uint64_t *fh) {
+    METRIC_OP(OP_FALLOCATE);
+    journal_begin();
+    int ret = rufs_fallocate(path, mode, offset, len, fh);
+    journal_end();
 
-    fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+    if (ret == -ENOSPC && journal_reclaim()) {
+        journal_begin();
+        ret = rufs_fallocate(path, mode, offset, len, fh);
+        journal_end();
+    }
+    return ret;
+}
 
-    return fuse_stat;
+int rufs_utimens_tx(const char *path, const struct timespec tv[2], uint64_t *fh) {
+    METRIC_OP(OP_UTIMENS);
+    journal_begin();
+    int ret = rufs_utimens(path, tv, fh);
+    journal_end();
+    return ret;
 }
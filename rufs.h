@@ -13,54 +13,134 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
-
+#define MAGIC_NUM 0x5C3D
+#define DEFAULT_DISK_SIZE	(32 * 1024 * 1024)	/* mkfs defaults */
+#define DEFAULT_NUM_INODES	1024
+#define MAX_DISK_BLOCKS		0x7FFFFFFF			/* block numbers are ints */
 
+/*
+ * The geometry of an image is fixed by mkfs and read back from here at
+ * mount. Past the superblock the disk is split into block groups, each
+ * with its own bitmaps and slice of the inode table (see rufs.c). The
+ * metadata journal sits between the superblock and group 0's bitmaps.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
-	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	block_size;			/* bytes per block */
+	uint64_t	disk_blocks;		/* blocks on the disk */
+	uint64_t	max_inum;			/* number of inodes */
+	uint64_t	max_dnum;			/* number of data blocks */
+	uint64_t	num_groups;			/* block groups */
+	uint64_t	blocks_per_group;	/* blocks in a group, the last may be short */
+	uint64_t	inodes_per_group;	/* inodes in a group */
+	uint64_t	journal_start;		/* first block of the journal */
+	uint64_t	journal_blocks;		/* journal size */
+};
+
+/*
+ * extent tree
+ *
+ * Every inode, flagged I_EXTENTS, maps its data with (logical start,
+ * physical start, length) records. Up to EXT_ROOT_MAX records live in
+ * the inode; beyond that the root holds index entries
+ * (lblk, pblk of a child block) and the records move down into tree
+ * blocks, each starting with its own extent_header.
+ */
+#define EXT_MAGIC		0xE47E
+#define EXT_ROOT_MAX	7
+#define EXT_BLOCK_MAX	((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXT_MAX_LEN		0xFFFF		/* blocks in a single extent */
+#define EXT_MAX_DEPTH	4
+
+#define EXT_UNWRITTEN	0x1			/* allocated but never written, reads as zeros */
+
+struct extent_header {
+	uint16_t	magic;				/* EXT_MAGIC */
+	uint16_t	entries;			/* records in use */
+	uint16_t	max;				/* capacity of this node */
+	uint16_t	depth;				/* 0: records are extents, else index entries */
+};
+
+struct extent {
+	uint32_t	lblk;				/* first logical block covered */
+	uint32_t	pblk;				/* first disk block, or child block in an index */
+	uint16_t	len;				/* number of blocks, unused in an index */
+	uint16_t	flags;				/* EXT_* extent flags */
+};
+
+struct extent_root {
+	struct extent_header	hdr;
+	struct extent			entries[EXT_ROOT_MAX];
 };
 
 struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
+	uint64_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
-	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint16_t	link;				/* link count */
+	uint16_t	flags;				/* I_* inode flags */
+	struct extent_root	ext;		/* extent tree root */
 	struct stat	vstat;				/* inode stat */
 };
 
+#define I_DIR_INDEXED	0x1			/* directory uses the hashed index */
+#define I_EXTENTS		0x2			/* data is mapped by the extent tree */
+
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
 	char name[208];					/* name of the directory entry */
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * hashed directory index
+ *
+ * An indexed directory keeps a dx_root in its logical block 0. Index
+ * entries map the lowest name hash of a leaf (or of an index node when
+ * levels is 1) to its logical block; leaves are plain dirent blocks.
+ */
+#define DX_MAGIC		0x44584952	/* "DXIR" */
+#define DX_ROOT_LIMIT	((BLOCK_SIZE - 16) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT	((BLOCK_SIZE - 8) / sizeof(struct dx_entry))
+
+struct dx_entry {
+	uint32_t	hash;				/* lowest name hash covered */
+	uint32_t	blk;				/* logical block in the directory */
+};
+
+struct dx_root {
+	uint32_t	magic;				/* DX_MAGIC */
+	uint16_t	levels;				/* 0: entries are leaves, 1: index nodes */
+	uint16_t	count;				/* entries in use */
+	uint32_t	nblocks;			/* logical blocks used by the directory */
+	uint32_t	reserved;
+	struct dx_entry	entries[];
+};
+
+struct dx_node {
+	uint32_t	magic;				/* DX_MAGIC */
+	uint16_t	count;				/* entries in use */
+	uint16_t	reserved;
+	struct dx_entry	entries[];
+};
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
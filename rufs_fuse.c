@@ -0,0 +1,906 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *    Tiny File System
+ *    File:    rufs_fuse.c
+ *
+ *    The FUSE front end: connection setup, the high-level and low-level
+ *    operation tables, command line and main(). The file system itself is
+ *    in rufs.c, reached through rufs_ops.h.
+ *
+ */
+
+#define FUSE_USE_VERSION 35
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "journal.h"
+#include "metrics.h"
+#include "rufs.h"
+#include "rufs_ops.h"
+
+// What is asked of the kernel connection, set from the command line too
+static double entry_timeout = 1.0;      // seconds the kernel caches names
+static double attr_timeout = 1.0;       // and attributes
+static int conn_writeback_cache = 1;    // kernel buffers writes in its page cache
+static int conn_splice = 1;             // write payloads move through a pipe
+static int conn_async_read = 1;         // several reads of a file in flight at once
+static uint32_t conn_max_write = 1024 * 1024;
+static uint32_t conn_max_readahead = 1024 * 1024;
+
+// Unix socket the metrics are scraped from, none if empty
+static char metrics_path[PATH_MAX];
+
+/*
+ * Ask for a capability if the kernel offers it, or make sure it is off
+ */
+static void conn_want(struct fuse_conn_info *conn, unsigned cap, int on) {
+    if (on && (conn->capable & cap))
+        conn->want |= cap;
+    else
+        conn->want &= ~cap;
+}
+
+/*
+ * Negotiate the connection: large requests, reads of a file in parallel,
+ * write payloads taken from the kernel through a pipe, and writes
+ * gathered in the kernel's page cache. Read replies are copied out of a
+ * buffer, libfuse only splices replies that come from a file descriptor,
+ * so splice write and move are left off. The kernel caps max_readahead
+ * at the device's read_ahead_kb, and libfuse max_write at its buffer size.
+ */
+static void rufs_conn_init(struct fuse_conn_info *conn) {
+    conn_want(conn, FUSE_CAP_ASYNC_READ, conn_async_read);
+    conn_want(conn, FUSE_CAP_SPLICE_READ, conn_splice);
+    conn_want(conn, FUSE_CAP_SPLICE_WRITE, 0);
+    conn_want(conn, FUSE_CAP_SPLICE_MOVE, 0);
+    conn_want(conn, FUSE_CAP_WRITEBACK_CACHE, conn_writeback_cache);
+    conn->max_write = conn_max_write;
+    conn->max_readahead = conn_max_readahead;
+}
+
+static void *rufs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+
+    // Step 1: Mount the disk file
+    rufs_mount();
+
+    // Step 2: Negotiate the connection, and how long the kernel caches
+    // names and attributes (cfg is NULL under the low-level API)
+    rufs_conn_init(conn);
+    if (cfg != NULL) {
+        cfg->entry_timeout = entry_timeout;
+        cfg->attr_timeout = attr_timeout;
+        cfg->negative_timeout = entry_timeout;
+    }
+
+    // Step 3: Serve the metrics, now that fuse has daemonized; the mount
+    // works on without them
+    if (metrics_path[0] != '\0' && metrics_serve(metrics_path) != 0)
+        fprintf(stderr, "can't serve metrics on %s\n", metrics_path);
+
+    TRACE("EXITING INIT\n");
+    
+    return NULL;
+}
+
+static void rufs_destroy(void *userdata) {
+    metrics_stop();
+    rufs_unmount();
+}
+
+/*
+ * The core takes an open file as the address of its handle, NULL for none
+ */
+#define FH(fi) ((fi) != NULL ? &(fi)->fh : NULL)
+
+/*
+ * A write spliced from the kernel arrives still in a pipe and is read out
+ * once, straight into a buffer; one already in memory is used in place
+ */
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    struct fuse_buf *src = &buf->buf[buf->idx];
+    if (buf->count - buf->idx == 1 && !(src->flags & FUSE_BUF_IS_FD))
+        return rufs_write_tx(path, (char*)src->mem + buf->off, size, offset, FH(fi));
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    if ((dst.buf[0].mem = malloc(size)) == NULL)
+        return -ENOMEM;
+
+    ssize_t n = fuse_buf_copy(&dst, buf, 0);
+    int ret = (n < 0) ? (int)n : rufs_write_tx(path, dst.buf[0].mem, n, offset, FH(fi));
+    free(dst.buf[0].mem);
+    return ret;
+}
+
+/*
+ * The high-level API: the core's path operations, with the handle taken
+ * out of FUSE's file info
+ */
+static int rufs_hl_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    return rufs_getattr(path, stbuf, FH(fi));
+}
+
+static int rufs_hl_opendir(const char *path, struct fuse_file_info *fi) {
+    return rufs_opendir(path, FH(fi));
+}
+
+// readdir fills through the caller's filler, which also takes flags
+typedef struct HlFill {
+    void *buffer;
+    fuse_fill_dir_t filler;
+} HlFill;
+
+static int hl_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    HlFill *f = buf;
+    return f->filler(f->buffer, name, stbuf, off, 0);
+}
+
+static int rufs_hl_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    HlFill f = { buffer, filler };
+    return rufs_readdir(path, &f, hl_fill, offset, FH(fi));
+}
+
+static int rufs_hl_releasedir(const char *path, struct fuse_file_info *fi) {
+    return rufs_releasedir(path, FH(fi));
+}
+
+static int rufs_hl_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    return rufs_fsyncdir(path, datasync, FH(fi));
+}
+
+static int rufs_hl_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    return rufs_create_tx(path, mode, FH(fi));
+}
+
+static int rufs_hl_open(const char *path, struct fuse_file_info *fi) {
+    return rufs_open(path, FH(fi));
+}
+
+static int rufs_hl_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    return rufs_read(path, buffer, size, offset, FH(fi));
+}
+
+static int rufs_hl_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    return rufs_write_tx(path, buffer, size, offset, FH(fi));
+}
+
+static int rufs_hl_flush(const char *path, struct fuse_file_info *fi) {
+    return rufs_flush(path, FH(fi));
+}
+
+static int rufs_hl_release(const char *path, struct fuse_file_info *fi) {
+    return rufs_release(path, FH(fi));
+}
+
+static int rufs_hl_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return rufs_fsync(path, datasync, FH(fi));
+}
+
+static int rufs_hl_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    return rufs_truncate_tx(path, size, FH(fi));
+}
+
+static int rufs_hl_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    return rufs_fallocate_tx(path, mode, offset, len, FH(fi));
+}
+
+static off_t rufs_hl_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi) {
+    return rufs_lseek(path, offset, whence, FH(fi));
+}
+
+static int rufs_hl_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    return rufs_utimens_tx(path, tv, FH(fi));
+}
+
+static struct fuse_operations rufs_ope = {
+    .init        = rufs_init,
+    .destroy    = rufs_destroy,
+
+    .getattr    = rufs_hl_getattr,
+    .readdir    = rufs_hl_readdir,
+    .opendir    = rufs_hl_opendir,
+    .releasedir    = rufs_hl_releasedir,
+    .mkdir        = rufs_mkdir_tx,
+    .rmdir        = rufs_rmdir_tx,
+
+    .create        = rufs_hl_create,
+    .open        = rufs_hl_open,
+    .read         = rufs_hl_read,
+    .write        = rufs_hl_write,
+    .write_buf  = rufs_write_buf,
+    .unlink        = rufs_unlink_tx,
+
+    .truncate   = rufs_hl_truncate,
+    .fallocate  = rufs_hl_fallocate,
+    .flush      = rufs_hl_flush,
+    .fsync      = rufs_hl_fsync,
+    .fsyncdir   = rufs_hl_fsyncdir,
+    .lseek      = rufs_hl_lseek,
+    .utimens    = rufs_hl_utimens,
+    .release    = rufs_hl_release
+};
+
+
+/*
+ * Low-level FUSE API (--lowlevel). The kernel names files by node id
+ * rather than by path, so every operation starts from the inode itself
+ * and nothing is walked. A node id is the inode number plus one, which
+ * makes the root FUSE_ROOT_ID. Replies carry entry and attribute timeouts
+ * so the kernel caches both, failed lookups included.
+ */
+#define LL_NODEID(ino)  ((fuse_ino_t)(ino) + 1)
+#define LL_INO(nodeid)  ((uint32_t)((nodeid) - 1))
+
+static int ll_mode = 0;                 // serve the low-level API
+
+// The path operations fail with -1 or -errno, replies take a positive errno
+static int ll_errno(int ret) {
+    return (ret == -1) ? EIO : -ret;
+}
+
+// Fill an entry reply for ino and count the kernel's new reference to it
+static int ll_entry(uint32_t ino, struct fuse_entry_param *e) {
+    struct inode inode;
+    if (readi(ino, &inode) != 0)
+        return -EIO;
+
+    memset(e, 0, sizeof(*e));
+    e->ino = LL_NODEID(ino);
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
+    inode_stat(&inode, &e->attr);
+    e->attr.st_ino = e->ino;
+
+    pthread_mutex_lock(&ll_lock);
+    ll_nlookup[ino]++;
+    pthread_mutex_unlock(&ll_lock);
+    return 0;
+}
+
+// Drop n kernel references to ino, releasing it if it was the last of an orphan
+static void ll_unref(uint32_t ino, uint64_t n) {
+    pthread_mutex_lock(&ll_lock);
+    ll_nlookup[ino] -= (n < ll_nlookup[ino]) ? n : ll_nlookup[ino];
+    int release = (ll_nlookup[ino] == 0 && ll_orphan[ino]);
+    if (release)
+        ll_orphan[ino] = 0;
+    pthread_mutex_unlock(&ll_lock);
+
+    if (release) {
+        journal_begin();
+        node_free(ino);
+        journal_end();
+    }
+}
+
+static void ll_reply_entry(fuse_req_t req, uint32_t ino) {
+    struct fuse_entry_param e;
+    if (ll_entry(ino, &e) != 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    // an interrupted request never reached the kernel, nor did the reference
+    if (fuse_reply_entry(req, &e) != 0)
+        ll_unref(ino, 1);
+}
+
+static void rufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    rufs_init(conn, NULL);
+
+    ll_nlookup = calloc(sb->max_inum, sizeof(uint64_t));
+    ll_orphan = calloc(sb->max_inum, 1);
+    if (ll_nlookup == NULL || ll_orphan == NULL) {
+        fprintf(stderr, "can't allocate the inode reference table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void rufs_ll_destroy(void *userdata) {
+
+    // Orphans the kernel never forgot go with the mount
+    journal_begin();
+    for (uint32_t ino = 0; ino < sb->max_inum; ino++) {
+        if (ll_orphan[ino])
+            node_free(ino);
+    }
+    journal_end();
+
+    free(ll_nlookup);
+    free(ll_orphan);
+    ll_nlookup = NULL;
+    ll_orphan = NULL;
+
+    rufs_destroy(userdata);
+}
+
+static void rufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    METRIC_OP(OP_LOOKUP);
+    int ino = dir_lookup(LL_INO(parent), name, strlen(name));
+    if (ino < 0) {
+        // node id 0 tells the kernel to cache the miss for entry_timeout
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = entry_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    ll_reply_entry(req, ino);
+}
+
+static void rufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    METRIC_OP(OP_FORGET);
+    ll_unref(LL_INO(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_reply_attr(fuse_req_t req, fuse_ino_t ino) {
+    struct inode inode;
+    if (readi(LL_INO(ino), &inode) != 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    inode_stat(&inode, &st);
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+static void rufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    METRIC_OP(OP_GETATTR);
+    ll_reply_attr(req, ino);
+}
+
+static void rufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    METRIC_OP(OP_SETATTR);
+
+    // Step 1: Owners and permissions stay as they are, like through the path API
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    // Step 2: A new size truncates the file
+    journal_begin();
+    int ret = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        ret = file_truncate(LL_INO(ino), attr->st_size);
+
+    // Step 3: Then the times, which the kernel sends after writes under
+    // the write-back cache as it keeps them itself
+    if (ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_CTIME))) {
+        struct timespec atime = attr->st_atim, mtime = attr->st_mtim;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            atime.tv_nsec = UTIME_NOW;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            mtime.tv_nsec = UTIME_NOW;
+        ret = file_set_times(LL_INO(ino), (to_set & FUSE_SET_ATTR_ATIME) ? &atime : NULL,
+            (to_set & FUSE_SET_ATTR_MTIME) ? &mtime : NULL, (to_set & FUSE_SET_ATTR_CTIME) ? &attr->st_ctim : NULL);
+    }
+    journal_end();
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ll_reply_attr(req, ino);
+}
+
+static void rufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    METRIC_OP(OP_MKDIR);
+    struct inode dir_inode;
+    journal_begin();
+    int ret = (readi(LL_INO(parent), &dir_inode) == 0) ? node_make(dir_inode, name, __S_IFDIR | 0755) : -EIO;
+    journal_end();
+
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        ll_reply_entry(req, ret);
+}
+
+static void rufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    METRIC_OP(OP_CREATE);
+
+    // Step 1: Allocate the new file and link it into its parent
+    struct inode dir_inode;
+    journal_begin();
+    int ret = (readi(LL_INO(parent), &dir_inode) == 0) ? node_make(dir_inode, name, __S_IFREG | (mode & 0777)) : -EIO;
+    journal_end();
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    // Step 2: Open it, the handle pins the in-core inode until release
+    OpenFile *of = of_open(ret);
+    struct fuse_entry_param e;
+    if (of == NULL || ll_entry(ret, &e) != 0) {
+        of_close(of);
+        journal_begin();
+        if (readi(LL_INO(parent), &dir_inode) == 0)
+            node_remove(dir_inode, name, 0);
+        journal_end();
+        fuse_reply_err(req, (of == NULL) ? ENOMEM : EIO);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t) of;
+    if (fuse_reply_create(req, &e, fi) != 0) {
+        of_close(of);
+        ll_unref(ret, 1);
+    }
+}
+
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int is_dir) {
+    METRIC_OP(is_dir ? OP_RMDIR : OP_UNLINK);
+    struct inode parent_inode;
+    journal_begin();
+    int ret = (readi(LL_INO(parent), &parent_inode) == 0) ? node_remove(parent_inode, name, is_dir) : -EIO;
+    journal_end();
+    fuse_reply_err(req, -ret);
+}
+
+static void rufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    ll_remove(req, parent, name, 0);
+}
+
+static void rufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    ll_remove(req, parent, name, 1);
+}
+
+static void rufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    METRIC_OP(OP_OPEN);
+    OpenFile *of = of_open(LL_INO(ino));
+    if (of == NULL) {
+        fuse_reply_err(req, ENFILE);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t) of;
+    if (fuse_reply_open(req, fi) != 0)
+        of_close(of);
+}
+
+/*
+ * Data operations always come with the handle from open or create, which
+ * the path operations take over any path, so they serve both APIs
+ */
+static void rufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int ret = rufs_read(NULL, buf, size, off, FH(fi));
+    if (ret < 0)
+        fuse_reply_err(req, ll_errno(ret));
+    else
+        fuse_reply_buf(req, buf, ret);
+    free(buf);
+}
+
+static void rufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    int ret = rufs_write_buf(NULL, bufv, off, fi);
+    if (ret < 0)
+        fuse_reply_err(req, ll_errno(ret));
+    else
+        fuse_reply_write(req, ret);
+}
+
+static void rufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ll_errno(rufs_flush(NULL, FH(fi))));
+}
+
+static void rufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ll_errno(rufs_release(NULL, FH(fi))));
+}
+
+static void rufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ll_errno(rufs_fsync(NULL, datasync, FH(fi))));
+}
+
+static void rufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ll_errno(rufs_fallocate_tx(NULL, mode, offset, length, FH(fi))));
+}
+
+static void rufs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi) {
+    off_t ret = rufs_lseek(NULL, off, whence, FH(fi));
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_lseek(req, ret);
+}
+
+/*
+ * Directory handle: the listing taken when a read starts at offset 0,
+ * handed out in slices. An entry's offset is its index plus one.
+ */
+typedef struct DirList {
+    int n;
+    int max;
+    struct {
+        uint32_t ino;
+        char *name;
+    } *ents;
+} DirList;
+
+static void dl_clear(DirList *dl) {
+    for (int i = 0; i < dl->n; i++)
+        free(dl->ents[i].name);
+    dl->n = 0;
+}
+
+// Filler collecting a listing from dir_readdir_locked()
+static int dl_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    DirList *dl = buf;
+    if (dl->n == dl->max) {
+        int max = dl->max ? dl->max * 2 : 64;
+        void *ents = realloc(dl->ents, max * sizeof(*dl->ents));
+        if (ents == NULL)
+            return 1;
+        dl->ents = ents;
+        dl->max = max;
+    }
+
+    if ((dl->ents[dl->n].name = strdup(name)) == NULL)
+        return 1;
+    dl->ents[dl->n++].ino = stbuf->st_ino;
+    return 0;
+}
+
+static int dl_load(DirList *dl, uint32_t ino) {
+    dl_clear(dl);
+
+    InodeEntry *e = ilock(ino, 0);
+    if (e == NULL)
+        return -EIO;
+
+    struct inode inode;
+    int ret = readi(ino, &inode);
+    if (ret == 0)
+        ret = dir_readdir_locked(inode, dl, dl_fill, 0);
+    iunlock(e);
+    return (ret == -1) ? -EIO : ret;
+}
+
+static void rufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    METRIC_OP(OP_OPENDIR);
+    DirList *dl = calloc(1, sizeof(DirList));
+    if (dl == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t) dl;
+    if (fuse_reply_open(req, fi) != 0)
+        free(dl);
+}
+
+static void rufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    METRIC_OP(OP_READDIR);
+    DirList *dl = (DirList*)(uintptr_t) fi->fh;
+
+    // Step 1: A read from the start (re)takes the listing
+    int ret = (off == 0) ? dl_load(dl, LL_INO(ino)) : 0;
+    char *buf = (ret == 0) ? malloc(size) : NULL;
+    if (buf == NULL) {
+        fuse_reply_err(req, (ret != 0) ? -ret : ENOMEM);
+        return;
+    }
+
+    // Step 2: Hand out as many entries from off as fit
+    size_t used = 0;
+    for (int i = off; i < dl->n; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = LL_NODEID(dl->ents[i].ino);
+        size_t len = fuse_add_direntry(req, buf + used, size - used, dl->ents[i].name, &st, i + 1);
+        if (len > size - used)
+            break;
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+/*
+ * readdir with the attributes of each entry, which saves the kernel a
+ * lookup per name; every entry handed out is a reference, like a lookup
+ */
+static void rufs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    METRIC_OP(OP_READDIR);
+    DirList *dl = (DirList*)(uintptr_t) fi->fh;
+
+    int ret = (off == 0) ? dl_load(dl, LL_INO(ino)) : 0;
+    char *buf = (ret == 0) ? malloc(size) : NULL;
+    if (buf == NULL) {
+        fuse_reply_err(req, (ret != 0) ? -ret : ENOMEM);
+        return;
+    }
+
+    size_t used = 0;
+    for (int i = off; i < dl->n; i++) {
+        const char *name = dl->ents[i].name;
+        size_t len = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
+        if (len > size - used)
+            break;
+
+        // the listing may be older than the name, skip it if it is gone
+        struct fuse_entry_param e;
+        int child = dir_lookup(LL_INO(ino), name, strlen(name));
+        if (child < 0 || ll_entry(child, &e) != 0)
+            continue;
+        fuse_add_direntry_plus(req, buf + used, size - used, name, &e, i + 1);
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void rufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    METRIC_OP(OP_RELEASEDIR);
+    DirList *dl = (DirList*)(uintptr_t) fi->fh;
+    dl_clear(dl);
+    free(dl->ents);
+    free(dl);
+    fuse_reply_err(req, 0);
+}
+
+// Directory blocks are metadata, whatever the journal holds is committed
+static void rufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    METRIC_OP(OP_FSYNCDIR);
+    fuse_reply_err(req, (journal_sync(journal_tid()) == 0) ? 0 : EIO);
+}
+
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+    .init       = rufs_ll_init,
+    .destroy    = rufs_ll_destroy,
+
+    .lookup     = rufs_ll_lookup,
+    .forget     = rufs_ll_forget,
+    .getattr    = rufs_ll_getattr,
+    .setattr    = rufs_ll_setattr,
+    .opendir    = rufs_ll_opendir,
+    .readdir    = rufs_ll_readdir,
+    .readdirplus = rufs_ll_readdirplus,
+    .releasedir = rufs_ll_releasedir,
+    .fsyncdir   = rufs_ll_fsyncdir,
+    .mkdir      = rufs_ll_mkdir,
+    .rmdir      = rufs_ll_rmdir,
+
+    .create     = rufs_ll_create,
+    .open       = rufs_ll_open,
+    .read       = rufs_ll_read,
+    .write_buf  = rufs_ll_write_buf,
+    .unlink     = rufs_ll_unlink,
+
+    .fallocate  = rufs_ll_fallocate,
+    .flush      = rufs_ll_flush,
+    .fsync      = rufs_ll_fsync,
+    .lseek      = rufs_ll_lseek,
+    .release    = rufs_ll_release
+};
+
+/*
+ * Mount and serve the low-level API, what fuse_main() does for the
+ * high-level one
+ */
+static int rufs_ll_main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    int err = -1;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.mountpoint == NULL) {
+        fprintf(stderr, "usage: %s --lowlevel [options] <mountpoint>\n", argv[0]);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    struct fuse_session *se = fuse_session_new(&args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread) {
+                    err = fuse_session_loop(se);
+                } else {
+                    struct fuse_loop_config config = { .clone_fd = opts.clone_fd, .max_idle_threads = opts.max_idle_threads };
+                    err = fuse_session_loop_mt(se, &config);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return err ? 1 : 0;
+}
+
+/*
+ * Parse a byte count with an optional K, M, G or T suffix, at most max
+ */
+static int parse_size(const char *str, uint64_t max, uint64_t *size) {
+    char *end;
+    errno = 0;
+    uint64_t n = strtoull(str, &end, 10);
+    if (end == str || *str == '-' || errno != 0)
+        return -1;
+
+    int shift = 0;
+    switch (*end) {
+    case 'T': case 't': shift += 10; /* fall through */
+    case 'G': case 'g': shift += 10; /* fall through */
+    case 'M': case 'm': shift += 10; /* fall through */
+    case 'K': case 'k': shift += 10; end++; break;
+    }
+    if (*end != '\0' || n > (max >> shift))
+        return -1;
+    *size = n << shift;
+    return 0;
+}
+
+/*
+ * Parse a non-negative number of seconds, fractions allowed
+ */
+static int parse_secs(const char *str, double *secs) {
+    char *end;
+    double n = strtod(str, &end);
+    if (end == str || *end != '\0' || n < 0)
+        return -1;
+    *secs = n;
+    return 0;
+}
+
+/*
+ * Pull rufs' own options out of argv before the rest goes to FUSE:
+ *   --backend=pread|mmap|uring   how the disk file is accessed (default pread)
+ *   --lowlevel                   serve the low-level API, by inode number
+ * what is asked of the kernel connection:
+ *   --entry-timeout=SECS         how long the kernel caches names (default 1)
+ *   --attr-timeout=SECS          and attributes (default 1)
+ *   --max-write=SIZE             largest write request (default 1M)
+ *   --max-readahead=SIZE         largest kernel readahead (default 1M)
+ *   --no-writeback-cache         write through the kernel's page cache
+ *   --no-splice                  copy write payloads instead of splicing them
+ *   --no-async-read              one read of a file in flight at a time
+ *   --metrics-socket=PATH        serve metrics on a Unix socket (see metrics.c)
+ * and the geometry used when the disk file has to be created:
+ *   --disk-size=SIZE             size of the disk (default 32M)
+ *   --inodes=N                   number of inodes (default 1024)
+ *   --journal-size=SIZE          size of the metadata journal (default 4M, at least 1M)
+ */
+static int rufs_parse_opts(int *argc, char *argv[]) {
+    int out = 1;
+    uint64_t size;
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], "--backend=", 10) == 0) {
+            const char *name = argv[i] + 10;
+            if (strcmp(name, "pread") == 0)
+                dev_set_backend(DEV_PREAD);
+            else if (strcmp(name, "mmap") == 0)
+                dev_set_backend(DEV_MMAP);
+            else if (strcmp(name, "uring") == 0)
+                dev_set_backend(DEV_URING);
+            else {
+                fprintf(stderr, "unknown backend: %s\n", name);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--lowlevel") == 0) {
+            ll_mode = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--entry-timeout=", 16) == 0) {
+            if (parse_secs(argv[i] + 16, &entry_timeout) != 0) {
+                fprintf(stderr, "bad entry timeout: %s\n", argv[i] + 16);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--attr-timeout=", 15) == 0) {
+            if (parse_secs(argv[i] + 15, &attr_timeout) != 0) {
+                fprintf(stderr, "bad attribute timeout: %s\n", argv[i] + 15);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--max-write=", 12) == 0) {
+            if (parse_size(argv[i] + 12, UINT32_MAX, &size) != 0 || size < BLOCK_SIZE) {
+                fprintf(stderr, "bad max write: %s\n", argv[i] + 12);
+                return -1;
+            }
+            conn_max_write = size;
+            continue;
+        }
+        if (strncmp(argv[i], "--max-readahead=", 16) == 0) {
+            if (parse_size(argv[i] + 16, UINT32_MAX, &size) != 0) {
+                fprintf(stderr, "bad max readahead: %s\n", argv[i] + 16);
+                return -1;
+            }
+            conn_max_readahead = size;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-writeback-cache") == 0) {
+            conn_writeback_cache = 0;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-splice") == 0) {
+            conn_splice = 0;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-async-read") == 0) {
+            conn_async_read = 0;
+            continue;
+        }
+        if (strncmp(argv[i], "--metrics-socket=", 17) == 0) {
+            // fuse changes to / when it daemonizes, keep a relative path where it was given
+            const char *path = argv[i] + 17;
+            metrics_path[0] = '\0';
+            if (path[0] != '/' && getcwd(metrics_path, PATH_MAX - 1) != NULL)
+                strcat(metrics_path, "/");
+            if (strlen(metrics_path) + strlen(path) >= PATH_MAX) {
+                fprintf(stderr, "metrics socket path too long: %s\n", path);
+                return -1;
+            }
+            strcat(metrics_path, path);
+            continue;
+        }
+        if (strncmp(argv[i], "--disk-size=", 12) == 0) {
+            if (parse_size(argv[i] + 12, UINT64_MAX, &mkfs_disk_size) != 0 || mkfs_disk_size == 0) {
+                fprintf(stderr, "bad disk size: %s\n", argv[i] + 12);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--inodes=", 9) == 0) {
+            if (parse_size(argv[i] + 9, UINT64_MAX, &mkfs_num_inodes) != 0 || mkfs_num_inodes == 0) {
+                fprintf(stderr, "bad inode count: %s\n", argv[i] + 9);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "--journal-size=", 15) == 0) {
+            if (parse_size(argv[i] + 15, UINT64_MAX, &size) != 0 || (mkfs_journal_blocks = size / BLOCK_SIZE) < JOURNAL_MIN_BLOCKS) {
+                fprintf(stderr, "bad journal size: %s\n", argv[i] + 15);
+                return -1;
+            }
+            continue;
+        }
+        argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fuse_stat;
+
+    getcwd(diskfile_path, PATH_MAX);
+    strcat(diskfile_path, "/DISKFILE");
+
+    if (rufs_parse_opts(&argc, argv) != 0)
+        return 1;
+
+    if (ll_mode)
+        fuse_stat = rufs_ll_main(argc, argv);
+    else
+        fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+
+    return fuse_stat;
+}
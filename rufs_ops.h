@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	rufs_ops.h
+ *
+ *	The file system core in rufs.c, as called by the FUSE front end
+ *	(rufs_fuse.c) and by tools that drive it without a mount, such as
+ *	benchmark/microbench.c. Nothing here comes from FUSE, so the core
+ *	builds without its headers and links without libfuse.
+ *
+ */
+
+#ifndef _RUFS_OPS_H_
+#define _RUFS_OPS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rufs.h"
+
+typedef struct InodeEntry InodeEntry;
+typedef struct OpenFile OpenFile;
+
+/*
+ * Where FUSE has types of its own the core takes plainer ones, which the
+ * front end converts: an open file is the fh of its fuse_file_info,
+ * passed by address (NULL for none), and readdir fills through
+ * rufs_fill_t, fuse_fill_dir_t without the flags.
+ */
+typedef int (*rufs_fill_t)(void *buffer, const char *name, const struct stat *stbuf, off_t offset);
+
+/* disk file and the geometry mkfs gives it */
+extern char diskfile_path[PATH_MAX];
+extern uint64_t mkfs_disk_size;
+extern uint64_t mkfs_num_inodes;
+extern uint64_t mkfs_journal_blocks;
+extern struct superblock *sb;
+
+/* mount and unmount */
+int rufs_mkfs(uint64_t disk_size, uint64_t num_inodes);
+void rufs_mount();
+void rufs_unmount();
+
+/* allocation */
+int get_avail_ino(uint32_t parent, int is_dir);
+int get_avail_blkno(int goal);
+void free_ino(int ino);
+void free_blkno(int blk_no);
+
+/* inodes */
+int readi(uint32_t ino, struct inode *inode);
+int writei(uint32_t ino, struct inode *inode);
+InodeEntry *ilock(uint32_t ino, int write);
+void iunlock(InodeEntry *e);
+void inode_stat(const struct inode *inode, struct stat *stbuf);
+
+/* directories and names */
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_lookup(uint32_t ino, const char *fname, size_t name_len);
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len);
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len);
+int dir_readdir_locked(struct inode i_node, void *buffer, rufs_fill_t filler, off_t offset);
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode);
+
+/* files by inode, as the low-level API names them; callers hold a journal handle */
+int node_make(struct inode dir_inode, const char *name, mode_t type);
+int node_remove(struct inode parent_inode, const char *name, int is_dir);
+int node_free(uint32_t ino);
+int file_truncate(uint32_t ino, off_t size);
+int file_set_times(uint32_t ino, const struct timespec *atime, const struct timespec *mtime, const struct timespec *ctime);
+OpenFile *of_open(uint32_t ino);
+void of_close(OpenFile *of);
+
+/* kernel references under the low-level API, NULL under the high-level one */
+extern uint64_t *ll_nlookup;
+extern char *ll_orphan;
+extern pthread_mutex_t ll_lock;
+
+/*
+ * Path operations, with the FUSE signatures but for the types above. The
+ * _tx ones run in their own journal handle. Data operations take the
+ * handle in *fh from open or create over any path.
+ */
+int rufs_getattr(const char *path, struct stat *stbuf, uint64_t *fh);
+int rufs_opendir(const char *path, uint64_t *fh);
+int rufs_readdir(const char *path, void *buffer, rufs_fill_t filler, off_t offset, uint64_t *fh);
+int rufs_releasedir(const char *path, uint64_t *fh);
+int rufs_fsyncdir(const char *path, int datasync, uint64_t *fh);
+int rufs_mkdir_tx(const char *path, mode_t mode);
+int rufs_rmdir_tx(const char *path);
+int rufs_create_tx(const char *path, mode_t mode, uint64_t *fh);
+int rufs_unlink_tx(const char *path);
+int rufs_open(const char *path, uint64_t *fh);
+int rufs_read(const char *path, char *buffer, size_t size, off_t offset, uint64_t *fh);
+int rufs_write_tx(const char *path, const char *buffer, size_t size, off_t offset, uint64_t *fh);
+int rufs_flush(const char *path, uint64_t *fh);
+int rufs_release(const char *path, uint64_t *fh);
+int rufs_fsync(const char *path, int datasync, uint64_t *fh);
+int rufs_truncate_tx(const char *path, off_t size, uint64_t *fh);
+int rufs_fallocate_tx(const char *path, int mode, off_t offset, off_t len, uint64_t *fh);
+off_t rufs_lseek(const char *path, off_t offset, int whence, uint64_t *fh);
+int rufs_utimens_tx(const char *path, const struct timespec tv[2], uint64_t *fh);
+
+#endif
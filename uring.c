@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	uring.c
+ *
+ *	Minimal io_uring wrapper used by block.c to batch disk I/O. Requests
+ *	are queued into the submission ring and handed to the kernel with a
+ *	single io_uring_enter() that also waits for all of them to complete.
+ *	Talks to the kernel directly, so there is no dependency on liburing.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+struct Uring {
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned queued;            // SQEs filled in but not yet submitted
+    int failed;                 // a completed request fell short or errored
+    struct iovec *iov_pool;     // URING_IOV_MAX iovecs per SQE slot
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+//Set up a ring, NULL if the kernel doesn't support io_uring
+Uring *uring_create(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Uring *ring = calloc(1, sizeof(Uring));
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->iov_pool = malloc(p.sq_entries * URING_IOV_MAX * sizeof(struct iovec));
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED || ring->iov_pool == NULL) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return ring;
+}
+
+void uring_destroy(Uring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    free(ring->iov_pool);
+    close(ring->fd);
+    free(ring);
+}
+
+//Queue a vectored read or write; nothing reaches the kernel until
+//uring_submit_wait(), unless the submission ring is full
+int uring_queue(Uring *ring, int op, int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (iovcnt > URING_IOV_MAX) {
+        return -1;
+    }
+    // ring is full: push it out now, remembering any failure for the final wait
+    if (ring->queued == ring->entries && uring_submit_wait(ring) != 0) {
+        ring->failed = 1;
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+
+    // the kernel reads the iovecs at submission, keep them until then
+    struct iovec *vec = &ring->iov_pool[idx * URING_IOV_MAX];
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        vec[i] = iov[i];
+        len += iov[i].iov_len;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (op == URING_WRITE) ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long)vec;
+    sqe->len = iovcnt;
+    sqe->user_data = len;       // expected transfer, checked on completion
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return 0;
+}
+
+//Submit everything queued with one io_uring_enter() and wait for it.
+//Returns -1 if any request since the last call failed.
+int uring_submit_wait(Uring *ring) {
+    unsigned submitted = 0;
+
+    while (ring->queued > 0) {
+        int ret = sys_io_uring_enter(ring->fd, ring->queued, submitted + ring->queued, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter failed");
+            // drop what the kernel never took, its buffers may not outlive us
+            __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->queued, __ATOMIC_RELEASE);
+            ring->queued = 0;
+            ring->failed = 1;
+            break;
+        }
+        ring->queued -= ret;
+        submitted += ret;
+    }
+
+    // reap completions until every submitted request is accounted for
+    while (submitted > 0) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                perror("io_uring_enter failed");
+                ring->failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->res < 0 || (unsigned long long)cqe->res != cqe->user_data)
+            ring->failed = 1;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        submitted--;
+    }
+
+    int ret = ring->failed ? -1 : 0;
+    ring->failed = 0;
+    return ret;
+}
@@ -0,0 +1,27 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	uring.h
+ *
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES	64		/* submission queue depth */
+#define URING_IOV_MAX	64		/* buffers per queued request */
+
+#define URING_READ		0
+#define URING_WRITE		1
+
+typedef struct Uring Uring;
+
+Uring *uring_create(unsigned entries);
+void uring_destroy(Uring *ring);
+int uring_queue(Uring *ring, int op, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+int uring_submit_wait(Uring *ring);
+
+#endif